@@ -73,9 +73,27 @@
 #define CHECKSUM_CHECK_TCP          1
 #define CHECKSUM_CHECK_ICMP         1
 
-/* Statistics - disable for size */
-#define LWIP_STATS                  0
+/* Profiling builds account checksum time to a region (see prof.c) */
+#ifdef PROFILE
+#define LWIP_CHKSUM_ALGORITHM       2
+#define LWIP_CHKSUM                 prof_chksum
+unsigned short prof_chksum(const void *dataptr, int len);
+#endif
+
+/* Statistics - only the cheap counters /__stats reports: pool usage
+ * and TCP segment counts. The heap is ours (MEM_LIBC_MALLOC). */
+#define LWIP_STATS                  1
 #define LWIP_STATS_DISPLAY          0
+#define MEMP_STATS                  1
+#define TCP_STATS                   1
+#define LINK_STATS                  0
+#define ETHARP_STATS                0
+#define IP_STATS                    0
+#define IPFRAG_STATS                0
+#define ICMP_STATS                  0
+#define UDP_STATS                   0
+#define MEM_STATS                   0
+#define SYS_STATS                   0
 
 /* Loopback */
 #define LWIP_NETIF_LOOPBACK         0
@@ -0,0 +1,41 @@
+/*
+ * app.c - Starting the firmware's server inside a harness
+ *
+ * main.c is linked unchanged; these boot it without the firmware's
+ * messages and step its main loop (see native.h).
+ */
+
+#include "native.h"
+#include "http_internal.h"
+#include "virtio_net.h"
+#include "console.h"
+#include "heap.h"
+#include "timer.h"
+
+#include "lwip/init.h"
+#include "lwip/timeouts.h"
+
+int native_stack_init(const char *disk_image) {
+    console_init();
+    heap_init();
+    timer_init();
+    lwip_init();
+
+    if (virtio_net_init() == NULL) {
+        return -1;
+    }
+
+    if (disk_image != NULL) {
+        /* Mounted up front so no harness times the mount as a request */
+        native_blk_open(disk_image);
+        http_mount_fs();
+    }
+
+    http_server_init();
+    return 0;
+}
+
+void native_stack_poll(void) {
+    virtio_net_poll();
+    sys_check_timeouts();
+}
@@ -0,0 +1,98 @@
+/*
+ * bench.c - In-process HTTP microbenchmark
+ *
+ * Runs the firmware's server and a loopback client in one host process
+ * and times sequential GETs, one connection each. There is no simulator,
+ * bridge or kernel socket in the path, so the numbers are the cost of
+ * the stack itself (lwIP both ways, the HTTP handler, lwext4 with the
+ * image in the page cache) and are steady enough to compare commits.
+ *
+ *   ./native_bench [--disk=IMAGE] [--path=/PATH] [--requests=N] [--warmup=N]
+ */
+
+#include "native.h"
+#include "hist.h"
+#include "timer.h"
+#include "platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_REQUESTS 10000
+#define DEFAULT_WARMUP 100
+#define REQUEST_TIMEOUT_MS 5000
+
+static uint64_t ticks_to_ns(uint64_t ticks) {
+    return ticks * (1000000000ull / TIMER_FREQ);
+}
+
+int main(int argc, char **argv) {
+    const char *disk = NULL;
+    const char *path = "/";
+    long requests = DEFAULT_REQUESTS;
+    long warmup = DEFAULT_WARMUP;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--disk=", 7) == 0) {
+            disk = argv[i] + 7;
+        } else if (strncmp(argv[i], "--path=", 7) == 0) {
+            path = argv[i] + 7;
+        } else if (strncmp(argv[i], "--requests=", 11) == 0) {
+            requests = atol(argv[i] + 11);
+        } else if (strncmp(argv[i], "--warmup=", 9) == 0) {
+            warmup = atol(argv[i] + 9);
+        } else {
+            fprintf(stderr, "Usage: %s [--disk=IMAGE] [--path=/PATH] [--requests=N] [--warmup=N]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    native_quiet = 1;
+    if (native_stack_init(disk) != 0) {
+        fprintf(stderr, "Stack init failed\n");
+        return 1;
+    }
+
+    char req[512];
+    int req_len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: bench\r\n\r\n", path);
+    if (req_len >= (int)sizeof(req)) {
+        fprintf(stderr, "Path too long\n");
+        return 1;
+    }
+
+    static struct hist latency;
+    struct loop_response resp;
+    uint64_t bytes = 0;
+    long errors = 0;
+    int status = 0;
+
+    for (long i = 0; i < warmup; i++) {
+        loop_request(req, req_len, REQUEST_TIMEOUT_MS, &resp);
+    }
+
+    uint64_t start = timer_ticks();
+    for (long i = 0; i < requests; i++) {
+        uint64_t t0 = timer_ticks();
+        if (loop_request(req, req_len, REQUEST_TIMEOUT_MS, &resp) != 0) {
+            errors++;
+            continue;
+        }
+        hist_record(&latency, ticks_to_ns(timer_ticks() - t0));
+        bytes += resp.bytes;
+        status = resp.status;
+    }
+    double secs = ticks_to_ns(timer_ticks() - start) / 1e9;
+
+    printf("%s: %ld requests, %ld errors, status %d, %.3f s\n",
+           path, requests, errors, status, secs);
+    if (secs > 0) {
+        printf("  %.0f req/s, %.2f MB/s\n", (requests - errors) / secs, bytes / secs / 1e6);
+    }
+    printf("  latency us: p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+           hist_percentile(&latency, 50) / 1e3, hist_percentile(&latency, 90) / 1e3,
+           hist_percentile(&latency, 99) / 1e3, latency.max / 1e3);
+
+    return errors ? 1 : 0;
+}
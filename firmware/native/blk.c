@@ -0,0 +1,96 @@
+/*
+ * blk.c - virtio_blk.h on a disk image file, for the native build
+ *
+ * Requests go straight to pread()/pwrite() on the image, so the block
+ * layer above (lwext4's cache, ext4_blockdev_virtio.c) sees the same
+ * sector-level traffic it would on Spike. The counters mean the same as
+ * the driver's, minus notifies, which there are none of.
+ */
+
+#include "native.h"
+#include "virtio_blk.h"
+#include "console.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *image_path;
+static int image_fd = -1;
+static uint64_t capacity;
+static struct virtio_blk_stats blk_stats;
+
+void native_blk_open(const char *path) {
+    image_path = path;
+}
+
+int virtio_blk_init(void) {
+    if (image_fd >= 0) return 0;
+    if (image_path == NULL) return -1;
+
+    image_fd = open(image_path, O_RDWR);
+    if (image_fd < 0) {
+        console_printf("blk: cannot open %s\n", image_path);
+        return -1;
+    }
+
+    off_t size = lseek(image_fd, 0, SEEK_END);
+    capacity = size > 0 ? (uint64_t)size / VIRTIO_BLK_SECTOR_SIZE : 0;
+    console_printf("blk: %s, %lu sectors\n", image_path, (unsigned long)capacity);
+    return 0;
+}
+
+static int blk_range_ok(uint64_t sector, uint32_t count) {
+    return image_fd >= 0 && sector <= capacity && count <= capacity - sector;
+}
+
+int virtio_blk_read(uint64_t sector, void *buf, uint32_t count) {
+    size_t len = (size_t)count * VIRTIO_BLK_SECTOR_SIZE;
+
+    blk_stats.reads++;
+    if (!blk_range_ok(sector, count) ||
+        pread(image_fd, buf, len, sector * VIRTIO_BLK_SECTOR_SIZE) != (ssize_t)len) {
+        blk_stats.errors++;
+        return -1;
+    }
+    blk_stats.bytes_read += len;
+    return 0;
+}
+
+int virtio_blk_write(uint64_t sector, const void *buf, uint32_t count) {
+    size_t len = (size_t)count * VIRTIO_BLK_SECTOR_SIZE;
+
+    blk_stats.writes++;
+    if (!blk_range_ok(sector, count) ||
+        pwrite(image_fd, buf, len, sector * VIRTIO_BLK_SECTOR_SIZE) != (ssize_t)len) {
+        blk_stats.errors++;
+        return -1;
+    }
+    blk_stats.bytes_written += len;
+    return 0;
+}
+
+int virtio_blk_flush(void) {
+    blk_stats.flushes++;
+    if (image_fd < 0 || fdatasync(image_fd) != 0) {
+        blk_stats.errors++;
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t virtio_blk_capacity(void) {
+    return capacity;
+}
+
+uint32_t virtio_blk_sector_size(void) {
+    return VIRTIO_BLK_SECTOR_SIZE;
+}
+
+int virtio_blk_available(void) {
+    return image_fd >= 0;
+}
+
+void virtio_blk_get_stats(struct virtio_blk_stats *stats) {
+    *stats = blk_stats;
+}
@@ -0,0 +1,44 @@
+/*
+ * fuzz_http.c - libFuzzer target for the HTTP request handler
+ *
+ * Each input is sent as the request bytes of one loopback connection
+ * to the in-process server, so the request line and header parsing run
+ * exactly as they do on the target, behind real lwIP segments. Server
+ * state (lwIP, the mounted filesystem) persists across inputs.
+ *
+ *   make fuzz
+ *   ./fuzz_http -max_len=4096 corpus/
+ *
+ * Set FUZZ_DISK=IMAGE to mount a filesystem so that file paths reach
+ * lwext4 as well; without it only the built-in pages are served. Note
+ * that writes through the server would land in the image.
+ */
+
+#include "native.h"
+
+#include "lwip/opt.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define REQUEST_TIMEOUT_MS 2000
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static int initialized;
+    struct loop_response resp;
+
+    if (!initialized) {
+        native_quiet = 1;
+        if (native_stack_init(getenv("FUZZ_DISK")) != 0) abort();
+        initialized = 1;
+    }
+
+    /* The client sends everything in one tcp_write() */
+    if (size > TCP_SND_BUF) size = TCP_SND_BUF;
+    if (size == 0) return 0;
+
+    loop_request(data, size, REQUEST_TIMEOUT_MS, &resp);
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef ARCH_CC_H
+#define ARCH_CC_H
+
+/*
+ * arch/cc.h for the host-native build. Unlike the firmware's, this one
+ * lets lwIP use the system headers; only what they cannot provide is
+ * defined here.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* System protection type (for critical sections) */
+typedef int sys_prot_t;
+
+/* Structure packing */
+#define PACK_STRUCT_FIELD(x) x
+#define PACK_STRUCT_STRUCT __attribute__((packed))
+#define PACK_STRUCT_BEGIN
+#define PACK_STRUCT_END
+
+/* Diagnostic output; assertions abort so fuzzers and debuggers see them */
+#define LWIP_PLATFORM_DIAG(x)   do { printf x; } while(0)
+#define LWIP_PLATFORM_ASSERT(x) do { fprintf(stderr, "ASSERT FAIL: %s\n", x); abort(); } while(0)
+
+#define LWIP_RAND() ((u32_t)rand())
+
+#endif /* ARCH_CC_H */
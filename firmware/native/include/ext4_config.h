@@ -0,0 +1,18 @@
+#ifndef NATIVE_EXT4_CONFIG_H_
+#define NATIVE_EXT4_CONFIG_H_
+
+/*
+ * ext4_config.h for the host-native build - the firmware's lwext4
+ * configuration, but with libc errno values and assert(), so a failed
+ * assertion aborts (and shows up under a fuzzer) instead of hanging
+ */
+
+#include "../../include/ext4_config.h"
+
+#undef CONFIG_HAVE_OWN_ERRNO
+#define CONFIG_HAVE_OWN_ERRNO 0
+
+#undef CONFIG_HAVE_OWN_ASSERT
+#define CONFIG_HAVE_OWN_ASSERT 0
+
+#endif /* NATIVE_EXT4_CONFIG_H_ */
@@ -0,0 +1,26 @@
+#ifndef NATIVE_LWIPOPTS_H
+#define NATIVE_LWIPOPTS_H
+
+/*
+ * lwipopts.h for the host-native build - the firmware's options, with
+ * the few changes a hosted process needs
+ */
+
+#include "../../include/lwipopts.h"
+
+/* The harnesses talk to the server through the netif's own address;
+ * frames are looped back by netif_poll() */
+#undef LWIP_NETIF_LOOPBACK
+#define LWIP_NETIF_LOOPBACK         1
+
+/* libc has errno.h */
+#undef LWIP_PROVIDE_ERRNO
+#define LWIP_ERRNO_STDINCLUDE       1
+
+/* The pools are malloc-backed and libc malloc never fails, so nothing
+ * reclaims TIME_WAIT PCBs early the way running out of heap does on the
+ * target. Keep them short-lived so a fuzzer making thousands of
+ * connections a second does not pile them up. */
+#define TCP_MSL                     1000UL
+
+#endif /* NATIVE_LWIPOPTS_H */
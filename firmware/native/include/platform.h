@@ -0,0 +1,7 @@
+#ifndef NATIVE_PLATFORM_H
+#define NATIVE_PLATFORM_H
+
+/* Device addresses and TIMER_FREQ; only the constants are used natively */
+#include "../../include/platform.h"
+
+#endif /* NATIVE_PLATFORM_H */
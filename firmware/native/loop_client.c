@@ -0,0 +1,114 @@
+/*
+ * loop_client.c - In-process HTTP client for the native harnesses
+ *
+ * A raw-API lwIP client that connects to the server's own address, so
+ * both ends of the connection run in this process and every segment
+ * goes through the full TCP/IP path twice (out through the netif's
+ * loopback queue, back in through ip_input).
+ */
+
+#include "native.h"
+#include "timer.h"
+
+#include "lwip/tcp.h"
+#include "lwip/ip4_addr.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct loop_client {
+    const void *req;
+    u16_t req_len;
+    struct loop_response *resp;
+    char status_line[16];
+    int status_len;
+    int done;
+};
+
+static void loop_parse_status(struct loop_client *c, const struct pbuf *p) {
+    /* "HTTP/1.1 200 ..." - may arrive split across segments */
+    u16_t want = sizeof(c->status_line) - 1 - c->status_len;
+    u16_t n = pbuf_copy_partial(p, c->status_line + c->status_len, want, 0);
+
+    c->status_len += n;
+    c->status_line[c->status_len] = '\0';
+    if (c->status_len >= 12 && strncmp(c->status_line, "HTTP/", 5) == 0) {
+        const char *s = strchr(c->status_line, ' ');
+        if (s != NULL) c->resp->status = atoi(s + 1);
+    }
+}
+
+static err_t loop_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err) {
+    struct loop_client *c = arg;
+
+    if (p == NULL) {
+        tcp_arg(pcb, NULL);
+        tcp_close(pcb);
+        c->done = 1;
+        return ERR_OK;
+    }
+
+    if (c->resp->status == 0) loop_parse_status(c, p);
+    c->resp->bytes += p->tot_len;
+    tcp_recved(pcb, p->tot_len);
+    pbuf_free(p);
+    return ERR_OK;
+}
+
+static void loop_err(void *arg, err_t err) {
+    struct loop_client *c = arg;
+
+    if (c == NULL) return;
+    c->resp->reset = 1;
+    c->done = 1;
+}
+
+static err_t loop_connected(void *arg, struct tcp_pcb *pcb, err_t err) {
+    struct loop_client *c = arg;
+
+    if (tcp_write(pcb, c->req, c->req_len, TCP_WRITE_FLAG_COPY) != ERR_OK) {
+        return ERR_MEM;
+    }
+    tcp_output(pcb);
+    return ERR_OK;
+}
+
+int loop_request(const void *req, size_t len, uint32_t timeout_ms,
+                 struct loop_response *resp) {
+    struct loop_client c;
+    ip4_addr_t server;
+    struct tcp_pcb *pcb;
+
+    memset(resp, 0, sizeof(*resp));
+    memset(&c, 0, sizeof(c));
+    if (len == 0 || len > TCP_SND_BUF) return -1;
+    c.req = req;
+    c.req_len = (u16_t)len;
+    c.resp = resp;
+
+    pcb = tcp_new();
+    if (pcb == NULL) return -1;
+
+    IP4_ADDR(&server, 10, 0, 2, 15);
+    tcp_arg(pcb, &c);
+    tcp_recv(pcb, loop_recv);
+    tcp_err(pcb, loop_err);
+    if (tcp_connect(pcb, &server, 80, loop_connected) != ERR_OK) {
+        tcp_abort(pcb);
+        return -1;
+    }
+
+    uint32_t start = sys_now();
+    while (!c.done) {
+        native_stack_poll();
+        if (sys_now() - start > timeout_ms) {
+            resp->timed_out = 1;
+            /* tcp_abort() calls loop_err(); c must not be touched after */
+            tcp_arg(pcb, NULL);
+            tcp_abort(pcb);
+            return -1;
+        }
+    }
+
+    return resp->reset ? -1 : 0;
+}
@@ -0,0 +1,57 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+/*
+ * native.h - Host-native build of the firmware's HTTP/FS stack
+ *
+ * main.c, fs.c, ext4_blockdev_virtio.c, lwIP and lwext4 are compiled
+ * unchanged for the host; only the hardware underneath them is replaced:
+ *
+ *   net.c       virtio_net.h over a Unix socket speaking Spike's
+ *               --virtio-fifo framing, or no socket at all, in which case
+ *               the server is only reachable through loopback
+ *   blk.c       virtio_blk.h on a disk image file
+ *   platform.c  console, timer, heap, PLIC and HTIF stand-ins
+ *
+ * main.c is linked as it is; server.c stands in for the firmware's
+ * boot.c, and the harnesses start the stack through app.c.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Drop console output (the server logs every connection) */
+extern int native_quiet;
+
+/* Wait for a bridge on this socket path; call before virtio_net_init().
+ * Without it the netif has no link to the outside. */
+void native_net_listen(const char *path);
+
+/* Back the block device with a disk image; call before fs_init().
+ * Without it the block device is absent, as with Spike's --virtio-block
+ * left off. */
+void native_blk_open(const char *path);
+
+/* Boot like the firmware's http_boot(), without its messages, and mount
+ * disk_image up front if given. Returns 0 on success, -1 if the netif
+ * could not be set up. */
+int native_stack_init(const char *disk_image);
+
+/* One pass of the firmware's main loop; never blocks */
+void native_stack_poll(void);
+
+/* One HTTP exchange with the in-process server over loopback */
+struct loop_response {
+    int status;                 /* From the status line, 0 if none came */
+    size_t bytes;               /* Everything received, headers included */
+    int reset;                  /* Aborted or reset instead of closed */
+    int timed_out;
+};
+
+/* Send req (at most TCP_SND_BUF bytes) on a fresh connection to port 80
+ * and read until the server closes. Returns 0 if the exchange finished,
+ * -1 if it could not start, was reset or timed out. */
+int loop_request(const void *req, size_t len, uint32_t timeout_ms,
+                 struct loop_response *resp);
+
+#endif /* NATIVE_H */
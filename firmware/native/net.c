@@ -0,0 +1,254 @@
+/*
+ * net.c - virtio_net.h for the native build
+ *
+ * The netif looks the same as on Spike (address, MAC, MTU), but frames
+ * travel over a Unix socket using the --virtio-fifo framing: each
+ * Ethernet frame is preceded by its length as 2 big-endian bytes. Like
+ * Spike, we listen and a bridge connects (slirp_bridge, debug_bridge),
+ * so the usual host tools work against the native server unchanged. The
+ * shared-memory upgrade (spike_shm.h) is never offered; bridges stay on
+ * the socket stream. One bridge at a time; a new one may connect after
+ * the previous one has gone.
+ *
+ * Without native_net_listen() there is no link at all and the server
+ * can only be reached through loopback (LWIP_NETIF_LOOPBACK), which is
+ * how the in-process harnesses drive it.
+ */
+
+#include "native.h"
+#include "virtio_net.h"
+#include "console.h"
+
+#include "lwip/etharp.h"
+#include "lwip/timeouts.h"
+#include "netif/ethernet.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_FRAME_SIZE 1514
+#define RX_BUF_SIZE (2 + 0xffff)       /* Room for the largest frame a peer can announce */
+
+/* Longest the server sleeps in poll() when lwIP has no timer due sooner */
+#define MAX_IDLE_MS 100
+
+static const uint8_t mac_addr[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
+
+static struct netif native_netif;
+static struct virtio_net_stats net_stats;
+
+static const char *socket_path;
+static int listen_fd = -1;
+static int bridge_fd = -1;
+
+static uint8_t rx_buf[RX_BUF_SIZE];
+static size_t rx_len;
+
+void native_net_listen(const char *path) {
+    socket_path = path;
+}
+
+static int net_listen(void) {
+    struct sockaddr_un addr;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        console_printf("net: socket path too long: %s\n", socket_path);
+        return -1;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 1) < 0) {
+        console_printf("net: cannot listen on %s: %s\n", socket_path, strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    console_printf("net: waiting for a bridge on %s\n", socket_path);
+    return 0;
+}
+
+static void net_disconnect(void) {
+    close(bridge_fd);
+    bridge_fd = -1;
+    rx_len = 0;
+    console_printf("net: bridge disconnected\n");
+}
+
+static int write_all(int fd, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static err_t native_net_output(struct netif *netif, struct pbuf *p) {
+    uint8_t frame[2 + MAX_FRAME_SIZE];
+
+    (void)netif;
+    if (bridge_fd < 0 || p->tot_len > MAX_FRAME_SIZE) {
+        net_stats.tx_dropped++;
+        return ERR_OK;
+    }
+
+    frame[0] = p->tot_len >> 8;
+    frame[1] = p->tot_len & 0xff;
+    pbuf_copy_partial(p, frame + 2, p->tot_len, 0);
+
+    if (write_all(bridge_fd, frame, 2 + p->tot_len) < 0) {
+        net_stats.tx_dropped++;
+        net_disconnect();
+        return ERR_OK;
+    }
+
+    net_stats.tx_frames++;
+    net_stats.tx_bytes += p->tot_len;
+    return ERR_OK;
+}
+
+static void net_input_frame(const uint8_t *data, uint16_t len) {
+    struct pbuf *p;
+
+    if (len > MAX_FRAME_SIZE) {
+        net_stats.rx_dropped++;
+        return;
+    }
+
+    p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+    if (p == NULL) {
+        net_stats.rx_dropped++;
+        return;
+    }
+    pbuf_take(p, data, len);
+
+    if (native_netif.input(p, &native_netif) != ERR_OK) {
+        pbuf_free(p);
+        net_stats.rx_dropped++;
+        return;
+    }
+    net_stats.rx_frames++;
+    net_stats.rx_bytes += len;
+}
+
+/* Hand every complete frame in rx_buf to lwIP */
+static void net_input(void) {
+    size_t off = 0;
+    uint32_t batch = 0;
+
+    while (rx_len - off >= 2) {
+        uint16_t len = (rx_buf[off] << 8) | rx_buf[off + 1];
+        if (rx_len - off < 2u + len) break;
+        if (len > 0) {
+            net_input_frame(rx_buf + off + 2, len);
+            batch++;
+        }
+        off += 2 + len;
+    }
+
+    memmove(rx_buf, rx_buf + off, rx_len - off);
+    rx_len -= off;
+    if (batch > net_stats.rx_batch_max) net_stats.rx_batch_max = batch;
+}
+
+static err_t native_netif_init(struct netif *netif) {
+    netif->name[0] = 'e';
+    netif->name[1] = 't';
+    netif->mtu = 1500;
+    netif->hwaddr_len = 6;
+    memcpy(netif->hwaddr, mac_addr, 6);
+    netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP;
+    netif->output = etharp_output;
+    netif->linkoutput = native_net_output;
+
+    return ERR_OK;
+}
+
+struct netif* virtio_net_init(void) {
+    ip4_addr_t ipaddr, netmask, gateway;
+
+    if (socket_path != NULL && net_listen() != 0) {
+        return NULL;
+    }
+
+    IP4_ADDR(&ipaddr, 10, 0, 2, 15);
+    IP4_ADDR(&netmask, 255, 255, 255, 0);
+    IP4_ADDR(&gateway, 10, 0, 2, 2);
+
+    if (netif_add(&native_netif, &ipaddr, &netmask, &gateway,
+                  NULL, native_netif_init, ethernet_input) == NULL) {
+        console_printf("Failed to add netif\n");
+        return NULL;
+    }
+
+    netif_set_default(&native_netif);
+    netif_set_up(&native_netif);
+
+    console_printf("Network interface up: %d.%d.%d.%d\n",
+                   ip4_addr1(&ipaddr), ip4_addr2(&ipaddr),
+                   ip4_addr3(&ipaddr), ip4_addr4(&ipaddr));
+
+    return &native_netif;
+}
+
+/*
+ * With a socket, wait in poll() until a frame arrives or lwIP's next
+ * timer is due, so an idle server does not spin a host core the way the
+ * firmware spins the simulated one. Without one, return at once: the
+ * caller is a harness driving loopback traffic. Returns nonzero if the
+ * bridge connected or sent anything.
+ */
+int virtio_net_poll(void) {
+    netif_poll(&native_netif);
+
+    if (listen_fd < 0) return 0;
+
+    struct pollfd pfd;
+    pfd.fd = bridge_fd >= 0 ? bridge_fd : listen_fd;
+    pfd.events = POLLIN;
+
+    u32_t sleep_ms = sys_timeouts_sleeptime();
+    if (sleep_ms > MAX_IDLE_MS) sleep_ms = MAX_IDLE_MS;
+
+    if (poll(&pfd, 1, (int)sleep_ms) <= 0) return 0;
+
+    if (bridge_fd < 0) {
+        bridge_fd = accept(listen_fd, NULL, NULL);
+        if (bridge_fd >= 0) console_printf("net: bridge connected\n");
+        return 1;
+    }
+
+    ssize_t n = recv(bridge_fd, rx_buf + rx_len, sizeof(rx_buf) - rx_len, 0);
+    if (n <= 0) {
+        if (n < 0 && errno == EINTR) return 0;
+        net_disconnect();
+        return 1;
+    }
+    rx_len += n;
+    net_input();
+    return 1;
+}
+
+void virtio_net_irq_handler(void) {
+}
+
+void virtio_net_get_stats(struct virtio_net_stats *stats) {
+    *stats = net_stats;
+}
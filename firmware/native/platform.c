@@ -0,0 +1,107 @@
+/*
+ * platform.c - Console, timer, heap and PLIC stand-ins for the native build
+ *
+ * The heap is libc's: malloc/free/calloc are not replaced, so
+ * heap_get_stats() only reports allocation failures (never, in practice).
+ */
+
+#include "native.h"
+#include "console.h"
+#include "timer.h"
+#include "heap.h"
+#include "plic.h"
+#include "platform.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+int native_quiet;
+
+/* Console */
+
+void console_init(void) {
+}
+
+void console_putc(char c) {
+    if (!native_quiet) putchar(c);
+}
+
+void console_puts(const char *s) {
+    if (!native_quiet) fputs(s, stdout);
+}
+
+void console_printf(const char *fmt, ...) {
+    va_list ap;
+
+    if (native_quiet) return;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+void console_print_hex(unsigned long val) {
+    if (!native_quiet) printf("0x%lx", val);
+}
+
+/* Timer: CLOCK_MONOTONIC, in ticks of TIMER_FREQ like mtime */
+
+static uint64_t boot_ns;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Time starts at the first call, as mtime starts with the simulator;
+ * main() takes boot stamps before it gets to timer_init() */
+void timer_init(void) {
+    if (boot_ns == 0) boot_ns = monotonic_ns();
+}
+
+uint64_t timer_ticks(void) {
+    timer_init();
+    return (monotonic_ns() - boot_ns) / (1000000000ull / TIMER_FREQ);
+}
+
+uint32_t sys_now(void) {
+    timer_init();
+    return (uint32_t)((monotonic_ns() - boot_ns) / 1000000);
+}
+
+void timer_irq_handler(void) {
+}
+
+/* Heap */
+
+void heap_init(void) {
+}
+
+void heap_get_stats(struct heap_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+void warm_heap_get_stats(struct heap_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+/* lwext4 (CONFIG_USE_USER_MALLOC) */
+
+void *ext4_user_malloc(size_t size) {
+    return malloc(size);
+}
+
+void *ext4_user_calloc(size_t nmemb, size_t size) {
+    return calloc(nmemb, size);
+}
+
+void ext4_user_free(void *ptr) {
+    free(ptr);
+}
+
+/* Nothing raises interrupts natively */
+
+void plic_init(void) {
+}
@@ -0,0 +1,60 @@
+/*
+ * server.c - The firmware's web server as a host process
+ *
+ * Takes the same device options as Spike, so it can stand in for it
+ * wherever a bridge is pointed at a --virtio-fifo socket, e.g.
+ *
+ *   ./native_server --virtio-fifo=/tmp/native.sock --virtio-block=disk.img &
+ *   ../../host/slirp_bridge --socket=/tmp/native.sock --port=8080
+ *
+ * or SPIKE=firmware/native/native_server scripts/bench.sh. Any other
+ * argument (the firmware ELF Spike would load) is ignored.
+ */
+
+#include "native.h"
+#include "http_internal.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s --virtio-fifo=PATH [--virtio-block=IMAGE] [--quiet] [ELF]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    const char *fifo = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--virtio-fifo=", 14) == 0) {
+            fifo = argv[i] + 14;
+        } else if (strncmp(argv[i], "--virtio-block=", 15) == 0) {
+            native_blk_open(argv[i] + 15);
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            native_quiet = 1;
+        } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            usage(argv[0]);
+            return 0;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (fifo == NULL) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* Line-buffer the console so log files follow along */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    /* As the firmware's boot.c */
+    native_net_listen(fifo);
+    if (http_boot() != 0) {
+        return 1;
+    }
+    for (;;) {
+        http_poll();
+    }
+}
@@ -0,0 +1,54 @@
+# lwIP and lwext4 sources, relative to firmware/
+#
+# Included by the firmware Makefile and by native/Makefile, so both
+# builds always compile the same stack.
+
+# lwIP sources
+LWIP_CORE = \
+    lwip/src/core/init.c \
+    lwip/src/core/def.c \
+    lwip/src/core/mem.c \
+    lwip/src/core/memp.c \
+    lwip/src/core/pbuf.c \
+    lwip/src/core/stats.c \
+    lwip/src/core/tcp.c \
+    lwip/src/core/tcp_in.c \
+    lwip/src/core/tcp_out.c \
+    lwip/src/core/udp.c \
+    lwip/src/core/ip.c \
+    lwip/src/core/inet_chksum.c \
+    lwip/src/core/timeouts.c
+
+LWIP_IPV4 = \
+    lwip/src/core/ipv4/etharp.c \
+    lwip/src/core/ipv4/ip4.c \
+    lwip/src/core/ipv4/ip4_addr.c \
+    lwip/src/core/ipv4/ip4_frag.c \
+    lwip/src/core/ipv4/icmp.c
+
+LWIP_NETIF = \
+    lwip/src/core/netif.c \
+    lwip/src/netif/ethernet.c
+
+LWIP_SRCS = $(LWIP_CORE) $(LWIP_IPV4) $(LWIP_NETIF)
+
+# lwext4 sources
+LWEXT4_SRCS = \
+    lwext4/src/ext4.c \
+    lwext4/src/ext4_balloc.c \
+    lwext4/src/ext4_bcache.c \
+    lwext4/src/ext4_bitmap.c \
+    lwext4/src/ext4_blockdev.c \
+    lwext4/src/ext4_block_group.c \
+    lwext4/src/ext4_crc32.c \
+    lwext4/src/ext4_debug.c \
+    lwext4/src/ext4_dir.c \
+    lwext4/src/ext4_dir_idx.c \
+    lwext4/src/ext4_extent.c \
+    lwext4/src/ext4_fs.c \
+    lwext4/src/ext4_hash.c \
+    lwext4/src/ext4_ialloc.c \
+    lwext4/src/ext4_inode.c \
+    lwext4/src/ext4_super.c \
+    lwext4/src/ext4_trans.c \
+    lwext4/src/ext4_xattr.c
@@ -0,0 +1,242 @@
+/*
+ * bench.c - Microbenchmarks on the simulated core (make bench-firmware)
+ *
+ * An alternate boot target: links in place of boot.c's main(), times the
+ * building blocks of a request in isolation with mcycle/minstret, prints
+ * cycles and instructions per operation and exits through HTIF. No
+ * network is brought up, so nothing but the code under test runs and the
+ * figures are the same from run to run.
+ *
+ * The lwext4 read benchmarks need a disk with BENCH_FILE on it (the
+ * top-level "make bench-firmware" creates one); without it they are
+ * skipped.
+ */
+
+#include "http_internal.h"
+#include "fs.h"
+#include "heap.h"
+#include "timer.h"
+#include "console.h"
+#include "prof.h"
+
+#include "lwip/opt.h"
+#include "lwip/inet_chksum.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_FILE "/bench.bin"
+#define BENCH_ITERS 1000
+#define BENCH_BUF_SIZE 8192
+
+static uint8_t bench_src[BENCH_BUF_SIZE + 8] __attribute__((aligned(64)));
+static uint8_t bench_dst[BENCH_BUF_SIZE + 8] __attribute__((aligned(64)));
+
+/* Keeps the compiler from dropping or hoisting the work being timed */
+#define bench_clobber() __asm__ volatile("" ::: "memory")
+
+struct bench_mark {
+    uint64_t cycle;
+    uint64_t instret;
+};
+
+static struct bench_mark bench_start(void) {
+    struct bench_mark m;
+    bench_clobber();
+    m.instret = read_minstret();
+    m.cycle = read_mcycle();
+    return m;
+}
+
+/* One result line: per-operation cost over ops operations */
+static void bench_report(const char *name, struct bench_mark m, uint32_t ops) {
+    uint64_t cycles = read_mcycle() - m.cycle;
+    uint64_t instret = read_minstret() - m.instret;
+    bench_clobber();
+
+    char line[80];
+    int len = snprintf(line, sizeof(line), "%s", name);
+    while (len < 28) line[len++] = ' ';
+    line[len] = '\0';
+    console_printf("%s %u %lu %lu\n", line, ops,
+                   (unsigned long)(cycles / ops), (unsigned long)(instret / ops));
+}
+
+static void bench_memcpy(const char *name, size_t len, int misalign) {
+    memcpy(bench_dst, bench_src, len);     /* Warm the cache lines */
+
+    struct bench_mark m = bench_start();
+    for (int i = 0; i < BENCH_ITERS; i++) {
+        memcpy(bench_dst + misalign, bench_src, len);
+        bench_clobber();
+    }
+    bench_report(name, m, BENCH_ITERS);
+}
+
+static void bench_memset(const char *name, size_t len) {
+    struct bench_mark m = bench_start();
+    for (int i = 0; i < BENCH_ITERS; i++) {
+        memset(bench_dst, i, len);
+        bench_clobber();
+    }
+    bench_report(name, m, BENCH_ITERS);
+}
+
+static void bench_malloc(void) {
+    void *ptrs[32];
+
+    /* The same small block over and over: best case for the free list */
+    struct bench_mark m = bench_start();
+    for (int i = 0; i < BENCH_ITERS; i++) {
+        void *p = malloc(64);
+        bench_clobber();
+        free(p);
+    }
+    bench_report("malloc_free_64", m, BENCH_ITERS);
+
+    /* A connection's worth: http_state plus pbuf-sized blocks */
+    const size_t sizes[4] = {http_state_size, 1600, 256, 64};
+    m = bench_start();
+    for (int i = 0; i < BENCH_ITERS / 32; i++) {
+        for (int j = 0; j < 32; j++) ptrs[j] = malloc(sizes[j & 3]);
+        for (int j = 31; j >= 0; j--) free(ptrs[j]);
+    }
+    bench_report("malloc_free_32_lifo", m, (BENCH_ITERS / 32) * 32);
+
+    /* Freed in allocation order, leaving holes between live blocks */
+    m = bench_start();
+    for (int i = 0; i < BENCH_ITERS / 32; i++) {
+        for (int j = 0; j < 32; j++) ptrs[j] = malloc(sizes[j & 3]);
+        for (int j = 0; j < 32; j++) free(ptrs[j]);
+    }
+    bench_report("malloc_free_32_fifo", m, (BENCH_ITERS / 32) * 32);
+}
+
+static void bench_chksum(const char *name, u16_t len) {
+    volatile u16_t sum;
+
+    struct bench_mark m = bench_start();
+    for (int i = 0; i < BENCH_ITERS; i++) {
+        sum = inet_chksum(bench_src, len);
+    }
+    bench_report(name, m, BENCH_ITERS);
+    (void)sum;
+}
+
+static void bench_headers(void) {
+    char header[512];
+    char etag[40];
+
+    struct bench_mark m = bench_start();
+    for (int i = 0; i < BENCH_ITERS; i++) {
+        make_etag(etag, 4194304 + i, 1700000000);
+        http_file_header(header, "/images/photo.jpg", 4194304 + i, etag);
+        bench_clobber();
+    }
+    bench_report("header_file_200", m, BENCH_ITERS);
+
+    /* The same header through snprintf, for comparison */
+    m = bench_start();
+    for (int i = 0; i < BENCH_ITERS; i++) {
+        snprintf(header, sizeof(header),
+                 "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\n"
+                 "ETag: %s\r\n" HTTP_CACHE_CONTROL "Connection: close\r\n\r\n",
+                 "image/jpeg", 4194304 + i, etag);
+        bench_clobber();
+    }
+    bench_report("header_file_200_snprintf", m, BENCH_ITERS);
+}
+
+static void bench_mime(const char *name, const char *path) {
+    const char *volatile type;
+
+    struct bench_mark m = bench_start();
+    for (int i = 0; i < BENCH_ITERS; i++) {
+        type = get_mime_type(path);
+    }
+    bench_report(name, m, BENCH_ITERS);
+    (void)type;
+}
+
+/* Whole file front to back in chunk-sized reads. http_send_file reads
+ * two segments' worth at a time once a transfer is under way, which
+ * starts most reads part way into a block. */
+static void bench_fs_sequential(const char *name, size_t chunk) {
+    fs_file_t f = fs_open(BENCH_FILE, FS_O_RDONLY);
+    if (f == FS_INVALID_FILE) return;
+
+    uint32_t chunks = 0;
+    struct bench_mark m = bench_start();
+    while (fs_read(f, bench_dst, chunk) > 0) {
+        chunks++;
+    }
+    if (chunks) bench_report(name, m, chunks);
+    fs_close(f);
+}
+
+/* 512-byte reads at pseudo-random offsets; the same sequence every run */
+static void bench_fs_random(void) {
+    fs_file_t f = fs_open(BENCH_FILE, FS_O_RDONLY);
+    if (f == FS_INVALID_FILE) return;
+
+    int64_t size = fs_size(f);
+    if (size < 512) {
+        fs_close(f);
+        return;
+    }
+
+    uint32_t seed = 12345;
+    struct bench_mark m = bench_start();
+    for (int i = 0; i < BENCH_ITERS; i++) {
+        seed = seed * 1103515245 + 12345;
+        int64_t off = (int64_t)((seed >> 8) % (uint64_t)(size - 512)) & ~511;
+        fs_seek(f, off, FS_SEEK_SET);
+        fs_read(f, bench_dst, 512);
+    }
+    bench_report("fs_read_rand_512", m, BENCH_ITERS);
+    fs_close(f);
+}
+
+int main(void) {
+    console_init();
+    heap_init();
+    timer_init();
+
+    for (int i = 0; i < BENCH_BUF_SIZE + 8; i++) {
+        bench_src[i] = (uint8_t)(i * 7);
+    }
+
+    console_printf("\nFirmware microbenchmarks\n");
+    console_printf("bench                       ops cycles/op instret/op\n");
+
+    bench_memcpy("memcpy_64", 64, 0);
+    bench_memcpy("memcpy_1460", 1460, 0);
+    bench_memcpy("memcpy_1460_unaligned", 1460, 1);
+    bench_memcpy("memcpy_4096", 4096, 0);
+    bench_memset("memset_64", 64);
+    bench_memset("memset_4096", 4096);
+
+    bench_malloc();
+
+    bench_chksum("inet_chksum_40", 40);
+    bench_chksum("inet_chksum_1460", 1460);
+
+    bench_headers();
+    bench_mime("mime_html", "/index.html");
+    bench_mime("mime_unknown", "/data/archive.tar.zst");
+
+    if (fs_init() != 0) {
+        console_printf("(no disk: lwext4 benchmarks skipped)\n");
+    } else if (!fs_exists(BENCH_FILE)) {
+        console_printf("(%s not on disk: lwext4 benchmarks skipped)\n", BENCH_FILE);
+    } else {
+        bench_fs_sequential("fs_read_seq_4k", HTTP_BUF_SIZE);
+        bench_fs_sequential("fs_read_seq_2mss", 2 * TCP_MSS);
+        bench_fs_random();
+    }
+
+    console_printf("bench done\n");
+    htif_exit(0);
+    return 0;
+}
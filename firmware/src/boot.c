@@ -0,0 +1,21 @@
+/*
+ * boot.c - Firmware entry point
+ *
+ * Apart from main.c so that other boot targets (bench.c) and the
+ * host-native build can link the server without this main().
+ */
+
+#include "http_internal.h"
+#include "console.h"
+
+int main(void) {
+    if (http_boot() != 0) {
+        htif_exit(1);
+    }
+
+    while (1) {
+        http_poll();
+    }
+
+    return 0;
+}
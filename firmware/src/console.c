@@ -6,6 +6,14 @@
 volatile uint64_t tohost __attribute__((section(".htif")));
 volatile uint64_t fromhost __attribute__((section(".htif")));
 
+void htif_exit(int code) {
+    while (tohost) {
+        fromhost = 0;
+    }
+    tohost = (code << 1) | 1;
+    while (1);
+}
+
 void console_init(void) {
     /* No initialization needed for HTIF */
 }
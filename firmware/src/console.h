@@ -7,4 +7,7 @@ void console_puts(const char *s);
 void console_printf(const char *fmt, ...);
 void console_print_hex(unsigned long val);
 
+/* Stop the simulator with an exit code (HTIF); does not return */
+void htif_exit(int code);
+
 #endif /* CONSOLE_H */
@@ -0,0 +1,51 @@
+/*
+ * etag.h - If-None-Match matching, shared by the firmware and the host
+ * balancer (host/http_balancer.c)
+ *
+ * Header only, and needs nothing beyond memcmp() and strlen(), so the
+ * same code runs on the target and on the host.
+ */
+
+#ifndef ETAG_H
+#define ETAG_H
+
+#include <stddef.h>
+#include <string.h>
+
+/* Does an If-None-Match value (len bytes, not terminated) match etag?
+ * The value is "*", which matches any current entity, or a list of
+ * entity tags separated by commas and optional spaces. If-None-Match
+ * uses the weak comparison, so a W/ prefix on either side is ignored. */
+static inline int etag_match(const char *value, size_t len, const char *etag) {
+    const char *p = value;
+    const char *end = value + len;
+
+    if (etag[0] == 'W' && etag[1] == '/') etag += 2;
+    size_t etag_len = strlen(etag);
+    if (etag_len == 0) return 0;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p == end) break;
+
+        if (end - p >= 2 && p[0] == 'W' && p[1] == '/') p += 2;
+        const char *tag = p;
+        if (p < end && *p == '"') {
+            /* Quoted: a comma inside belongs to the tag */
+            p++;
+            while (p < end && *p != '"') p++;
+            if (p < end) p++;
+        } else {
+            while (p < end && *p != ',' && *p != ' ' && *p != '\t') p++;
+        }
+
+        size_t n = (size_t)(p - tag);
+        if (n == 1 && tag[0] == '*') return 1;
+        if (n == etag_len && memcmp(tag, etag, n) == 0) return 1;
+
+        while (p < end && *p != ',') p++;
+    }
+    return 0;
+}
+
+#endif /* ETAG_H */
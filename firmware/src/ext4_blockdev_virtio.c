@@ -15,15 +15,19 @@
 #include <ext4_blockdev.h>
 #include <ext4_errno.h>
 
+#include "ext4_blockdev_virtio.h"
 #include "virtio_blk.h"
 #include "console.h"
+#include "snapshot.h"
 
 /* Block size - ext4 typically uses 1024, 2048 or 4096 byte blocks
  * We'll use 512 to match the VirtIO sector size for simplicity */
 #define EXT4_BLOCKDEV_BSIZE 512
 
 /* Physical block buffer */
-static uint8_t blockdev_ph_bbuf[EXT4_BLOCKDEV_BSIZE];
+static uint8_t blockdev_ph_bbuf[EXT4_BLOCKDEV_BSIZE] WARM;
+
+static struct ext4_blockdev_virtio_stats bd_stats;
 
 /* Block device interface callbacks */
 
@@ -53,6 +57,8 @@ static int virtio_blockdev_bread(struct ext4_blockdev *bdev, void *buf,
         return EIO;
     }
 
+    bd_stats.disk_reads++;
+    bd_stats.blocks_read += blk_cnt;
     return EOK;
 }
 
@@ -61,10 +67,13 @@ static int virtio_blockdev_bwrite(struct ext4_blockdev *bdev, const void *buf,
 {
     (void)bdev;
 
+    snapshot_disk_written();
     if (virtio_blk_write(blk_id, buf, blk_cnt) != 0) {
         return EIO;
     }
 
+    bd_stats.disk_writes++;
+    bd_stats.blocks_written += blk_cnt;
     return EOK;
 }
 
@@ -78,8 +87,9 @@ static int virtio_blockdev_close(struct ext4_blockdev *bdev)
     return EOK;
 }
 
-/* Block device interface structure */
-static struct ext4_blockdev_iface virtio_blockdev_iface = {
+/* Block device interface structure. It and the instance below hold
+ * lwext4's cache and mount state, so they are in the snapshot region. */
+static struct ext4_blockdev_iface virtio_blockdev_iface WARM = {
     .open = virtio_blockdev_open,
     .bread = virtio_blockdev_bread,
     .bwrite = virtio_blockdev_bwrite,
@@ -96,7 +106,7 @@ static struct ext4_blockdev_iface virtio_blockdev_iface = {
 };
 
 /* Block device instance */
-static struct ext4_blockdev virtio_blockdev = {
+static struct ext4_blockdev virtio_blockdev WARM = {
     .bdif = &virtio_blockdev_iface,
     .part_offset = 0,
     .part_size = 0,  /* Will be set during init */
@@ -141,3 +151,35 @@ const char *ext4_blockdev_virtio_name(void)
 {
     return "virtio0";
 }
+
+/* lwext4 keeps no hit/miss counts, so the firmware is linked with
+ * --wrap=ext4_block_get and every cached block lookup from outside
+ * ext4_blockdev.c lands here first. A lookup that completes without a
+ * bread callback was served from the cache. */
+int __real_ext4_block_get(struct ext4_blockdev *bdev, struct ext4_block *b, uint64_t lba);
+
+int __wrap_ext4_block_get(struct ext4_blockdev *bdev, struct ext4_block *b, uint64_t lba)
+{
+    uint32_t reads = bd_stats.disk_reads;
+#ifdef BLK_TRACE
+    uint32_t sectors = bdev->lg_bsize / EXT4_BLOCKDEV_BSIZE;
+    virtio_blk_trace_lookup(lba * sectors, sectors);
+#endif
+    int r = __real_ext4_block_get(bdev, b, lba);
+    int hit = (r == EOK && bd_stats.disk_reads == reads);
+
+    bd_stats.cache_lookups++;
+    if (hit) {
+        bd_stats.cache_hits++;
+    }
+#ifdef BLK_TRACE
+    virtio_blk_trace_lookup_done(r, hit);
+#endif
+    return r;
+}
+
+void ext4_blockdev_virtio_get_stats(struct ext4_blockdev_virtio_stats *stats)
+{
+    *stats = bd_stats;
+    stats->cache_size = CONFIG_BLOCK_DEV_CACHE_SIZE;
+}
@@ -13,4 +13,17 @@ struct ext4_blockdev *ext4_blockdev_virtio_get(void);
 /* Get block device name (for registration) */
 const char *ext4_blockdev_virtio_name(void);
 
+/* lwext4 block cache effectiveness and disk traffic since boot */
+struct ext4_blockdev_virtio_stats {
+    uint32_t cache_size;        /* Blocks the cache can hold */
+    uint32_t cache_lookups;     /* ext4_block_get() calls */
+    uint32_t cache_hits;        /* ... answered without a disk read */
+    uint32_t disk_reads;        /* bread callbacks, through the cache or direct */
+    uint32_t disk_writes;
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+};
+
+void ext4_blockdev_virtio_get_stats(struct ext4_blockdev_virtio_stats *stats);
+
 #endif /* EXT4_BLOCKDEV_VIRTIO_H */
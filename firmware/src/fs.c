@@ -7,6 +7,8 @@
 #include "fs.h"
 #include "ext4_blockdev_virtio.h"
 #include "console.h"
+#include "prof.h"
+#include "snapshot.h"
 
 #include <string.h>
 
@@ -25,8 +27,14 @@ static struct {
     int in_use;
 } file_table[FS_MAX_OPEN_FILES];
 
-/* Filesystem state */
-static int fs_is_mounted = 0;
+/* Directory handle table */
+static struct {
+    ext4_dir dir;
+    int in_use;
+} dir_table[FS_MAX_OPEN_DIRS];
+
+/* Filesystem state; saved with lwext4's (open files are not) */
+static int fs_is_mounted WARM = 0;
 
 /* Find a free file handle slot */
 static int find_free_slot(void)
@@ -49,8 +57,9 @@ int fs_init(void)
 
     console_printf("fs: Initializing filesystem...\n");
 
-    /* Clear file table */
+    /* Clear file and directory tables */
     memset(file_table, 0, sizeof(file_table));
+    memset(dir_table, 0, sizeof(dir_table));
 
     /* Get block device */
     struct ext4_blockdev *bd = ext4_blockdev_virtio_get();
@@ -92,6 +101,12 @@ void fs_shutdown(void)
             file_table[i].in_use = 0;
         }
     }
+    for (int i = 0; i < FS_MAX_OPEN_DIRS; i++) {
+        if (dir_table[i].in_use) {
+            ext4_dir_close(&dir_table[i].dir);
+            dir_table[i].in_use = 0;
+        }
+    }
 
     /* Flush cache */
     ext4_cache_flush(MOUNT_POINT);
@@ -167,6 +182,8 @@ int fs_close(fs_file_t fd)
 
 ssize_t fs_read(fs_file_t fd, void *buf, size_t size)
 {
+    PROF_REGION(PROF_FS_READ);
+
     if (fd < 0 || fd >= FS_MAX_OPEN_FILES || !file_table[fd].in_use) {
         return -1;
     }
@@ -276,6 +293,63 @@ int64_t fs_stat_size(const char *path)
     return size;
 }
 
+int64_t fs_stat_mtime(const char *path)
+{
+    if (!fs_is_mounted || path == NULL) {
+        return -1;
+    }
+
+    uint32_t mtime;
+    if (ext4_mtime_get(path, &mtime) != EOK) {
+        return -1;
+    }
+
+    return (int64_t)mtime;
+}
+
+int fs_set_mtime(const char *path, int64_t mtime)
+{
+    if (!fs_is_mounted || path == NULL) {
+        return -1;
+    }
+
+    return (ext4_mtime_set(path, (uint32_t)mtime) == EOK) ? 0 : -1;
+}
+
+int fs_rename(const char *from, const char *to, const char *backup)
+{
+    if (!fs_is_mounted || from == NULL || to == NULL || backup == NULL) {
+        return -1;
+    }
+
+    if (!fs_exists(to)) {
+        return (ext4_frename(from, to) == EOK) ? 0 : -1;
+    }
+
+    /* lwext4 will not rename over an existing entry. The old file is
+     * moved aside, not removed, so that a failed second rename loses
+     * neither file. Nothing else runs between the steps, so no request
+     * sees the destination missing. */
+    if (ext4_frename(to, backup) != EOK) {
+        return -1;
+    }
+    if (ext4_frename(from, to) != EOK) {
+        return (ext4_frename(backup, to) == EOK) ? -1 : -2;
+    }
+    ext4_fremove(backup);
+    return 0;
+}
+
+int fs_remove(const char *path)
+{
+    if (!fs_is_mounted || path == NULL) {
+        return -1;
+    }
+
+    int r = ext4_fremove(path);
+    return (r == EOK) ? 0 : -1;
+}
+
 int fs_mkdir(const char *path)
 {
     if (!fs_is_mounted || path == NULL) {
@@ -286,6 +360,72 @@ int fs_mkdir(const char *path)
     return (r == EOK) ? 0 : -1;
 }
 
+fs_dir_t fs_opendir(const char *path)
+{
+    if (!fs_is_mounted || path == NULL) {
+        return FS_INVALID_DIR;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < FS_MAX_OPEN_DIRS; i++) {
+        if (!dir_table[i].in_use) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        console_printf("fs: No free directory handles\n");
+        return FS_INVALID_DIR;
+    }
+
+    /* Fails for anything but a directory */
+    if (ext4_dir_open(&dir_table[slot].dir, path) != EOK) {
+        return FS_INVALID_DIR;
+    }
+
+    dir_table[slot].in_use = 1;
+    return slot;
+}
+
+int fs_readdir(fs_dir_t dd, struct fs_dirent *ent)
+{
+    if (dd < 0 || dd >= FS_MAX_OPEN_DIRS || !dir_table[dd].in_use || ent == NULL) {
+        return -1;
+    }
+
+    /* One entry per call: lwext4 keeps the position in the handle, so
+     * a directory of any size is read with no more memory than this */
+    const ext4_direntry *de;
+    do {
+        de = ext4_dir_entry_next(&dir_table[dd].dir);
+        if (de == NULL) {
+            return 0;
+        }
+    } while (de->inode == 0);
+
+    int len = de->name_length;
+    if (len > FS_MAX_NAME) {
+        len = FS_MAX_NAME;
+    }
+    memcpy(ent->name, de->name, len);
+    ent->name[len] = '\0';
+    ent->is_dir = (de->inode_type == EXT4_DE_DIR);
+
+    return 1;
+}
+
+int fs_closedir(fs_dir_t dd)
+{
+    if (dd < 0 || dd >= FS_MAX_OPEN_DIRS || !dir_table[dd].in_use) {
+        return -1;
+    }
+
+    int r = ext4_dir_close(&dir_table[dd].dir);
+    dir_table[dd].in_use = 0;
+
+    return (r == EOK) ? 0 : -1;
+}
+
 int fs_mounted(void)
 {
     return fs_is_mounted;
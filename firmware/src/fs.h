@@ -26,15 +26,33 @@
 /* Maximum number of open files */
 #define FS_MAX_OPEN_FILES 8
 
+/* Maximum number of open directories */
+#define FS_MAX_OPEN_DIRS 4
+
 /* Maximum path length */
 #define FS_MAX_PATH 256
 
+/* Maximum length of a directory entry name */
+#define FS_MAX_NAME 255
+
 /* File handle (opaque) */
 typedef int fs_file_t;
 
 /* Invalid file handle */
 #define FS_INVALID_FILE (-1)
 
+/* Directory handle (opaque) */
+typedef int fs_dir_t;
+
+/* Invalid directory handle */
+#define FS_INVALID_DIR (-1)
+
+/* Directory entry */
+struct fs_dirent {
+    char name[FS_MAX_NAME + 1];
+    int is_dir;
+};
+
 /* Initialize the filesystem
  * Mounts the ext4 filesystem from the VirtIO block device
  * Returns: 0 on success, negative on error
@@ -107,12 +125,62 @@ int fs_exists(const char *path);
  */
 int64_t fs_stat_size(const char *path);
 
+/* Get file modification time by path
+ * path: File path
+ * Returns: Seconds since the epoch, negative on error
+ */
+int64_t fs_stat_mtime(const char *path);
+
+/* Set file modification time by path
+ * path: File path
+ * mtime: Seconds since the epoch
+ * Returns: 0 on success, negative on error
+ */
+int fs_set_mtime(const char *path, int64_t mtime);
+
+/* Rename a file, replacing the destination if it exists. The old
+ * destination is moved to backup first and removed only once from is
+ * in its place; if from cannot be moved, the old file is put back.
+ * from: Current path
+ * to: New path (its directory must exist)
+ * backup: Unused path for the old destination meanwhile
+ * Returns: 0 on success, -1 on error with from and to as they were,
+ *          -2 on error with the old destination left at backup
+ */
+int fs_rename(const char *from, const char *to, const char *backup);
+
+/* Remove a file
+ * path: File path
+ * Returns: 0 on success, negative on error
+ */
+int fs_remove(const char *path);
+
 /* Create a directory
  * path: Directory path
  * Returns: 0 on success, negative on error
  */
 int fs_mkdir(const char *path);
 
+/* Open a directory for reading
+ * path: Directory path, without a trailing slash
+ * Returns: Directory handle on success, FS_INVALID_DIR on error or if
+ *          path is not a directory
+ */
+fs_dir_t fs_opendir(const char *path);
+
+/* Read the next directory entry, in on-disk order ("." and ".." too)
+ * dd: Directory handle
+ * ent: Filled with the entry
+ * Returns: 1 if an entry was read, 0 at the end, negative on error
+ */
+int fs_readdir(fs_dir_t dd, struct fs_dirent *ent);
+
+/* Close a directory
+ * dd: Directory handle from fs_opendir
+ * Returns: 0 on success, negative on error
+ */
+int fs_closedir(fs_dir_t dd);
+
 /* Check if filesystem is mounted */
 int fs_mounted(void);
 
@@ -1,9 +1,13 @@
 #include "heap.h"
+#include "prof.h"
+#include "snapshot.h"
 #include <stdint.h>
 #include <string.h>
 
 extern char __heap_start[];
 extern char __heap_end[];
+extern char __warm_heap_start[];
+extern char __warm_heap_end[];
 
 /* Block header for free-list allocator */
 typedef struct block_header {
@@ -15,26 +19,46 @@ typedef struct block_header {
 #define HEADER_SIZE sizeof(block_header_t)
 #define ALIGN_SIZE 16
 
-static block_header_t *heap_start = NULL;
+/* One free list over a fixed range */
+struct heap_arena {
+    block_header_t *start;
+    size_t total;
+    size_t used;
+    size_t peak;
+    uint32_t failures;
+};
+
+static struct heap_arena main_heap;
+
+/* lwext4's allocations, kept apart from everything else so that they
+ * can be saved and restored with the rest of its state (snapshot.h).
+ * The arena's bookkeeping is in the snapshot region too. */
+static struct heap_arena warm_heap WARM;
 
 /* Align size to 16 bytes */
 static inline size_t align_up(size_t size) {
     return (size + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1);
 }
 
+static void arena_init(struct heap_arena *a, char *start, char *end) {
+    a->start = (block_header_t*)start;
+    a->start->size = (size_t)(end - start) - HEADER_SIZE;
+    a->start->next = NULL;
+    a->start->free = 1;
+    a->total = a->start->size;
+}
+
 void heap_init(void) {
-    heap_start = (block_header_t*)__heap_start;
-    heap_start->size = (size_t)(__heap_end - __heap_start) - HEADER_SIZE;
-    heap_start->next = NULL;
-    heap_start->free = 1;
+    arena_init(&main_heap, __heap_start, __heap_end);
+    arena_init(&warm_heap, __warm_heap_start, __warm_heap_end);
 }
 
-void *malloc(size_t size) {
+static void *arena_alloc(struct heap_arena *a, size_t size) {
     if (size == 0) return NULL;
 
     size = align_up(size);
 
-    block_header_t *current = heap_start;
+    block_header_t *current = a->start;
     block_header_t *prev = NULL;
 
     while (current != NULL) {
@@ -51,20 +75,24 @@ void *malloc(size_t size) {
                 current->next = new_block;
             }
             current->free = 0;
+            a->used += current->size;
+            if (a->used > a->peak) a->peak = a->used;
             return (char*)current + HEADER_SIZE;
         }
         prev = current;
         current = current->next;
     }
 
+    a->failures++;
     return NULL; /* Out of memory */
 }
 
-void free(void *ptr) {
+static void arena_free(struct heap_arena *a, void *ptr) {
     if (ptr == NULL) return;
 
     block_header_t *block = (block_header_t*)((char*)ptr - HEADER_SIZE);
     block->free = 1;
+    a->used -= block->size;
 
     /* Coalesce with next block if free */
     if (block->next && block->next->free) {
@@ -73,7 +101,7 @@ void free(void *ptr) {
     }
 
     /* Coalesce with previous block if free */
-    block_header_t *current = heap_start;
+    block_header_t *current = a->start;
     while (current != NULL && current->next != block) {
         current = current->next;
     }
@@ -83,6 +111,16 @@ void free(void *ptr) {
     }
 }
 
+void *malloc(size_t size) {
+    PROF_REGION(PROF_MALLOC);
+    return arena_alloc(&main_heap, size);
+}
+
+void free(void *ptr) {
+    PROF_REGION(PROF_FREE);
+    arena_free(&main_heap, ptr);
+}
+
 void *calloc(size_t nmemb, size_t size) {
     size_t total = nmemb * size;
     void *ptr = malloc(total);
@@ -113,3 +151,44 @@ void *realloc(void *ptr, size_t size) {
     }
     return new_ptr;
 }
+
+void *warm_malloc(size_t size) {
+    return arena_alloc(&warm_heap, size);
+}
+
+void *warm_calloc(size_t nmemb, size_t size) {
+    size_t total = nmemb * size;
+    void *ptr = arena_alloc(&warm_heap, total);
+    if (ptr) {
+        memset(ptr, 0, total);
+    }
+    return ptr;
+}
+
+void warm_free(void *ptr) {
+    arena_free(&warm_heap, ptr);
+}
+
+static void arena_get_stats(const struct heap_arena *a, struct heap_stats *stats) {
+    stats->total = a->total;
+    stats->used = a->used;
+    stats->peak = a->peak;
+    stats->largest_free = 0;
+    stats->free_blocks = 0;
+    stats->failures = a->failures;
+
+    for (block_header_t *b = a->start; b != NULL; b = b->next) {
+        if (b->free) {
+            stats->free_blocks++;
+            if (b->size > stats->largest_free) stats->largest_free = b->size;
+        }
+    }
+}
+
+void heap_get_stats(struct heap_stats *stats) {
+    arena_get_stats(&main_heap, stats);
+}
+
+void warm_heap_get_stats(struct heap_stats *stats) {
+    arena_get_stats(&warm_heap, stats);
+}
@@ -2,6 +2,7 @@
 #define HEAP_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 void heap_init(void);
 void *malloc(size_t size);
@@ -9,4 +10,22 @@ void free(void *ptr);
 void *calloc(size_t nmemb, size_t size);
 void *realloc(void *ptr, size_t size);
 
+/* The arena lwext4 allocates from, inside the snapshot region */
+void *warm_malloc(size_t size);
+void *warm_calloc(size_t nmemb, size_t size);
+void warm_free(void *ptr);
+
+/* Heap usage; sizes exclude block headers */
+struct heap_stats {
+    size_t total;
+    size_t used;
+    size_t peak;
+    size_t largest_free;        /* Biggest allocation that would succeed */
+    uint32_t free_blocks;       /* Fragments on the free list */
+    uint32_t failures;          /* malloc() calls that returned NULL */
+};
+
+void heap_get_stats(struct heap_stats *stats);
+void warm_heap_get_stats(struct heap_stats *stats);
+
 #endif /* HEAP_H */
@@ -0,0 +1,48 @@
+/*
+ * hist.c - Log-bucketed latency histograms
+ */
+
+#include "hist.h"
+
+static int bucket_of(uint64_t v) {
+    if (v > UINT32_MAX) v = UINT32_MAX;
+    if (v < HIST_SUB_BUCKETS) return (int)v;
+
+    int msb = 0;
+    for (uint64_t t = v; t >>= 1; ) msb++;
+    int sub = (int)(v >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+uint64_t hist_bucket_low(int i) {
+    if (i < HIST_SUB_BUCKETS) return (uint64_t)i;
+
+    int msb = i / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    int sub = i % HIST_SUB_BUCKETS;
+    return (uint64_t)(HIST_SUB_BUCKETS + sub) << (msb - HIST_SUB_BITS);
+}
+
+void hist_record(struct hist *h, uint64_t value) {
+    h->counts[bucket_of(value)]++;
+    h->total++;
+    h->sum += value;
+    if (value > h->max) h->max = value;
+}
+
+uint64_t hist_percentile(const struct hist *h, unsigned pct) {
+    if (h->total == 0) return 0;
+
+    /* Rank of the wanted recording, rounded up, 1-based */
+    uint64_t rank = ((uint64_t)h->total * pct + 99) / 100;
+    if (rank == 0) rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t high = (i + 1 < HIST_BUCKETS) ? hist_bucket_low(i + 1) - 1 : h->max;
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,35 @@
+#ifndef HIST_H
+#define HIST_H
+
+/*
+ * hist.h - Log-bucketed latency histograms
+ *
+ * HDR-style layout: values below HIST_SUB_BUCKETS get a bucket each;
+ * above that every power of two is split into HIST_SUB_BUCKETS linear
+ * buckets, so any recorded value is known to within 1/8 (12.5%) of
+ * itself. Covers the full 32-bit range in under 1 KB per histogram.
+ */
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((32 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct hist {
+    uint32_t counts[HIST_BUCKETS];
+    uint32_t total;
+    uint64_t sum;
+    uint64_t max;
+};
+
+void hist_record(struct hist *h, uint64_t value);
+
+/* Value at or below which pct percent of recordings fall (upper edge
+ * of the bucket holding it, capped at the maximum seen); 0 if empty */
+uint64_t hist_percentile(const struct hist *h, unsigned pct);
+
+/* Smallest value that lands in bucket i */
+uint64_t hist_bucket_low(int i);
+
+#endif /* HIST_H */
@@ -0,0 +1,52 @@
+#ifndef HTTP_INTERNAL_H
+#define HTTP_INTERNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * http_internal.h - What main.c offers the rest of the firmware
+ *
+ * The entry point (boot.c), the microbenchmarks (bench.c) and the
+ * host-native build (native/) link main.c as an object of its own and
+ * reach the server through these.
+ */
+
+/* Per-connection buffer for file data and generated bodies */
+#define HTTP_BUF_SIZE 4096
+
+/* Lets a caching proxy in front of the guest serve responses without
+ * asking again for this long; after that it revalidates with the ETag */
+#define HTTP_CACHE_CONTROL "Cache-Control: max-age=60\r\n"
+
+/* sizeof(struct http_state), allocated once per connection */
+extern const size_t http_state_size;
+
+/* Bring up heap, timer, PLIC, lwIP and the network interface, then start
+ * listening. The disk is not mounted yet (see http_mount_fs()).
+ * Returns: 0 on success, -1 if the network interface could not be set up
+ */
+int http_boot(void);
+
+/* One pass of the main loop: poll the network, mount the disk the first
+ * time it is idle, run lwIP timers. Never blocks. */
+void http_poll(void);
+
+/* Listen on port 80; part of http_boot() */
+void http_server_init(void);
+
+/* Mount the disk, once; later calls return at once */
+void http_mount_fs(void);
+
+/* MIME type for a path, by its extension */
+const char *get_mime_type(const char *path);
+
+/* Build a quoted ETag from file size and modification time into buf
+ * (at least 36 bytes). Returns: its length, not counting the NUL */
+int make_etag(char *buf, int64_t size, int64_t mtime);
+
+/* Headers of a 200 response for a file served from disk, into header
+ * (at least 512 bytes). Returns: their length */
+int http_file_header(char *header, const char *path, int64_t size, const char *etag);
+
+#endif /* HTTP_INTERNAL_H */
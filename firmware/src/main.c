@@ -8,15 +8,26 @@
 #include "lwip/tcp.h"
 #include "lwip/timeouts.h"
 #include "lwip/ip4_addr.h"
+#include "lwip/memp.h"
+#include "lwip/stats.h"
 
 #include "virtio_net.h"
 #include "virtio_blk.h"
+#include "ext4_blockdev_virtio.h"
 #include "fs.h"
 #include "timer.h"
 #include "heap.h"
 #include "console.h"
 #include "plic.h"
-
+#include "platform.h"
+#include "hist.h"
+#include "prof.h"
+#include "snapshot.h"
+#include "etag.h"
+#include "http_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 /* Static HTML page */
@@ -48,15 +59,21 @@ static const char html_page[] =
 static const char http_ok[] =
     "HTTP/1.1 200 OK\r\n"
     "Content-Type: text/html; charset=utf-8\r\n"
+    HTTP_CACHE_CONTROL
     "Connection: close\r\n"
     "Content-Length: ";
 
+#define HTTP_404_BODY "404 Not Found\n"
+
 static const char http_404[] =
     "HTTP/1.1 404 Not Found\r\n"
     "Content-Type: text/plain\r\n"
     "Connection: close\r\n"
     "\r\n"
-    "404 Not Found\n";
+    HTTP_404_BODY;
+
+/* The part of http_404 a HEAD request gets */
+#define HTTP_404_HEADER_LEN (sizeof(http_404) - sizeof(HTTP_404_BODY))
 
 /* MIME types */
 struct mime_type {
@@ -82,7 +99,7 @@ static const struct mime_type mime_types[] = {
 };
 
 /* Get MIME type from filename */
-static const char *get_mime_type(const char *path) {
+const char *get_mime_type(const char *path) {
     const char *dot = NULL;
     for (const char *p = path; *p; p++) {
         if (*p == '.') dot = p;
@@ -105,19 +122,249 @@ static const char *get_mime_type(const char *path) {
 }
 
 /* HTTP connection state */
-#define HTTP_BUF_SIZE 4096
 #define HTTP_PATH_SIZE 256
 
+/* Uploads are written to /.upload-N and renamed into place. Names with
+ * this prefix are reserved: they are not served, listed or uploaded to,
+ * in any directory, so no spelling of a path reaches the temp files. */
+#define HTTP_UPLOAD_PREFIX ".upload-"
+
+static int http_reserved_path(const char *path) {
+    size_t n = sizeof(HTTP_UPLOAD_PREFIX) - 1;
+    for (const char *c = path; *c; c++) {
+        if ((c == path || c[-1] == '/') && strncmp(c, HTTP_UPLOAD_PREFIX, n) == 0) return 1;
+    }
+    return 0;
+}
+
+struct http_state;
+
+/* Source of a generated response body (http_stream) */
+struct http_gen {
+    /* Fill buf with the next part of the body, at most size bytes.
+     * Returns the length written, 0 once the body is complete, or -1 if
+     * the next piece needs more than size. */
+    int (*next)(struct http_state *hs, char *buf, int size);
+    /* Release what gen_ctx holds besides its memory, or NULL */
+    void (*close)(void *ctx);
+};
+
 struct http_state {
     int sent_headers;
     int sent_body;
     fs_file_t file;
     int64_t file_size;
     int64_t bytes_sent;
+    uint32_t queued;            /* Bytes written to the connection so far */
     char path[HTTP_PATH_SIZE];
     uint8_t buf[HTTP_BUF_SIZE];
+
+    /* Phase timestamps (timer_ticks()), 0 until reached */
+    uint64_t t_accept;
+    uint64_t t_request;         /* Request line parsed */
+    uint64_t t_open;            /* Path resolved: file opened, or not */
+    uint64_t t_first_byte;      /* Headers and first body chunk queued */
+    int timing;                 /* 1: response fully queued, 2: recorded */
+
+    /* Request body being stored (PUT, POST): file is the temporary
+     * file, path the destination, buf the data not yet written */
+    int upload;                 /* 1 until the body is complete */
+    int chunked;                /* Transfer-Encoding: chunked */
+    int body_state;             /* BODY_* */
+    int64_t body_left;          /* Bytes to come, of the body or the chunk */
+    int64_t body_bytes;         /* Body bytes received so far */
+    int buf_used;
+    uint32_t unacked;           /* Received, not yet passed to tcp_recved */
+    char tmp_path[24];
+    int drain;                  /* Answered with body still to come: polls
+                                 * left to read and drop it until the FIN */
+
+    /* Generated response: the body comes from gen, chunk by chunk */
+    const struct http_gen *gen;
+    void *gen_ctx;              /* The generator's state, from malloc */
+    uint32_t gen_pos;           /* Free for the generator to use */
+    int http10;                 /* HTTP/1.0 request: no chunked framing */
 };
 
+const size_t http_state_size = sizeof(struct http_state);
+
+/* Request phases, each the time between two of the timestamps above.
+ * "send" runs until the peer has ACKed everything, FIN included, so it
+ * holds TCP backpressure and the disk reads for later chunks. */
+enum {
+    PHASE_WAIT,                 /* accept -> request parsed */
+    PHASE_LOOKUP,               /* request -> path resolved */
+    PHASE_FIRST_BYTE,           /* resolved -> first chunk queued */
+    PHASE_SEND,                 /* first chunk -> last byte ACKed */
+    PHASE_TOTAL,                /* accept -> last byte ACKed */
+    PHASE_COUNT
+};
+
+static const char *const phase_names[PHASE_COUNT] = {
+    "wait", "lookup", "first_byte", "send", "total"
+};
+
+static struct hist phase_hist[PHASE_COUNT];
+
+/* Server counters for /__stats */
+static struct {
+    uint32_t accepted;
+    uint32_t active;            /* Connections holding an http_state */
+    uint32_t aborted;           /* Reset, or refused for lack of memory */
+    uint32_t status_200;
+    uint32_t status_304;
+    uint32_t status_404;
+    uint32_t status_other;
+    uint64_t bytes_sent;
+} http_stats;
+
+static void http_count_status(int status) {
+    switch (status) {
+        case 200: http_stats.status_200++; break;
+        case 304: http_stats.status_304++; break;
+        case 404: http_stats.status_404++; break;
+        default:  http_stats.status_other++; break;
+    }
+}
+
+/* Boot phases in the order http_boot() runs them. mtime starts at zero
+ * with the simulator, so the first phase also holds everything before it.
+ * The mount is no longer on this path: it runs once the server is
+ * listening, and its own duration is kept separately. */
+enum {
+    BOOT_HEAP,
+    BOOT_TIMER,
+    BOOT_PLIC,
+    BOOT_LWIP,
+    BOOT_NET,
+    BOOT_LISTEN,
+    BOOT_PHASES
+};
+
+static const char *const boot_names[BOOT_PHASES] = {
+    "heap", "timer", "plic", "lwip", "net", "listen"
+};
+
+static struct {
+    uint64_t last;                  /* End of the latest phase */
+    uint64_t phase[BOOT_PHASES];    /* Ticks spent in each */
+    uint64_t fs_mount;              /* Ticks spent in fs_init() */
+    uint64_t fs_mounted_at;         /* mtime when the mount finished */
+    uint64_t first_response_at;     /* mtime when the first response was queued */
+} boot_time;
+
+static void boot_phase_done(int phase) {
+    uint64_t now = timer_ticks();
+    boot_time.phase[phase] = now - boot_time.last;
+    boot_time.last = now;
+}
+
+static void http_mark(uint64_t *t) {
+    if (*t == 0) *t = timer_ticks();
+}
+
+/* The whole response is queued; phases this path skipped take zero time */
+static void http_response_queued(struct http_state *hs) {
+    http_mark(&hs->t_request);
+    http_mark(&hs->t_open);
+    http_mark(&hs->t_first_byte);
+    hs->timing = 1;
+
+    if (boot_time.first_response_at == 0) {
+        boot_time.first_response_at = hs->t_first_byte;
+    }
+}
+
+/* Record the phases once everything queued has been ACKed. pcb is NULL
+ * when the peer has closed, which it only does after reading it all. */
+static void http_record_phases(struct http_state *hs, struct tcp_pcb *pcb) {
+    if (hs->timing != 1) return;
+    if (pcb != NULL && tcp_sndqueuelen(pcb) != 0) return;
+
+    uint64_t now = timer_ticks();
+    hist_record(&phase_hist[PHASE_WAIT], hs->t_request - hs->t_accept);
+    hist_record(&phase_hist[PHASE_LOOKUP], hs->t_open - hs->t_request);
+    hist_record(&phase_hist[PHASE_FIRST_BYTE], hs->t_first_byte - hs->t_open);
+    hist_record(&phase_hist[PHASE_SEND], now - hs->t_first_byte);
+    hist_record(&phase_hist[PHASE_TOTAL], now - hs->t_accept);
+    hs->timing = 2;
+}
+
+static uint64_t ticks_to_us(uint64_t ticks) {
+    return ticks * 1000000 / TIMER_FREQ;
+}
+
+/* Response writer. lwIP cuts data into segments as it is queued,
+ * appending to the last unsent segment while it has room. Queued data
+ * goes out whenever tcp_output() runs, and tcp_input() runs it after
+ * every callback, so what one callback writes leaves together when it
+ * returns. While a response is written it is corked, which only means
+ * its writes carry TCP_WRITE_FLAG_MORE and so no PSH. http_uncork()
+ * sends what is queued when the rest comes from a later callback;
+ * http_end() closes, so the FIN can ride in the last data segment. Body
+ * data goes in http_batch() sizes, which complete the last segment and
+ * then add whole segments, so a response is sent as full segments with
+ * a short one only at its end. Callbacks run one at a time, so at most
+ * one connection is corked. */
+static struct tcp_pcb *http_corked;
+
+static void http_cork(struct tcp_pcb *pcb) {
+    http_corked = pcb;
+}
+
+/* Queue response bytes; everything sent goes through here */
+static err_t http_write(struct tcp_pcb *pcb, const void *data, u16_t len) {
+    struct http_state *hs = (struct http_state *)pcb->callback_arg;
+    u8_t flags = TCP_WRITE_FLAG_COPY;
+    if (pcb == http_corked) flags |= TCP_WRITE_FLAG_MORE;
+
+    err_t err = tcp_write(pcb, data, len, flags);
+    if (err == ERR_OK) {
+        http_stats.bytes_sent += len;
+        if (hs != NULL) hs->queued += len;
+    }
+    return err;
+}
+
+/* Send what is queued; the response goes on later */
+static void http_uncork(struct tcp_pcb *pcb) {
+    http_corked = NULL;
+    tcp_output(pcb);
+}
+
+/* The response is complete: send it with the FIN. While a request
+ * body is being drained only the sending side is shut, since data
+ * arriving after tcp_close() gets a RST that can overtake the response. */
+static void http_end(struct tcp_pcb *pcb) {
+    struct http_state *hs = (struct http_state *)pcb->callback_arg;
+    http_corked = NULL;
+    if (hs != NULL && hs->drain) {
+        tcp_shutdown(pcb, 0, 1);
+    } else {
+        tcp_close(pcb);
+    }
+}
+
+/* How much body to queue next, at most max: what completes the last
+ * segment, counting segments from the start of the connection, plus as
+ * many full segments as the send buffer holds, or all of left (the rest
+ * of the body, -1 if unknown) if it fits. 0: wait for ACKs. */
+static int http_batch(struct tcp_pcb *pcb, int max, int64_t left) {
+    struct http_state *hs = (struct http_state *)pcb->callback_arg;
+    int mss = tcp_mss(pcb);
+
+    int room = tcp_sndbuf(pcb);
+    if (room > max) room = max;
+    if (tcp_sndqueuelen(pcb) > TCP_SND_QUEUELEN - 4) return 0;
+    if (left >= 0 && left <= room) return (int)left;
+
+    int tail = 0;
+    if (hs != NULL && hs->queued % mss != 0) tail = mss - hs->queued % mss;
+    if (room < tail) return 0;
+
+    return tail + (room - tail) / mss * mss;
+}
+
 /* Format a number to string */
 static int int_to_str(char *buf, int val) {
     char tmp[12];
@@ -167,6 +414,615 @@ static int int64_to_str(char *buf, int64_t val) {
     return j;
 }
 
+/* Format an unsigned value as lowercase hex */
+static int hex_to_str(char *buf, uint64_t val) {
+    char tmp[16];
+    int i = 0, j = 0;
+
+    do {
+        tmp[i++] = "0123456789abcdef"[val & 0xF];
+        val >>= 4;
+    } while (val > 0);
+
+    while (i > 0) {
+        buf[j++] = tmp[--i];
+    }
+
+    return j;
+}
+
+/* Build a quoted ETag from file size and modification time */
+int make_etag(char *buf, int64_t size, int64_t mtime) {
+    int len = 0;
+    buf[len++] = '"';
+    len += hex_to_str(buf + len, (uint64_t)size);
+    buf[len++] = '-';
+    len += hex_to_str(buf + len, (uint64_t)mtime);
+    buf[len++] = '"';
+    buf[len] = '\0';
+    return len;
+}
+
+/* Copy the value of a request header (name without colon, any case).
+ * Returns value length, or -1 if the header is absent. */
+static int get_header(const char *req, int len, const char *name, char *out, int out_size) {
+    int name_len = strlen(name);
+
+    for (int i = 0; i + name_len < len; i++) {
+        /* Header names start right after a line break */
+        if (i == 0 || req[i - 1] != '\n') continue;
+
+        int k = 0;
+        while (k < name_len) {
+            char a = req[i + k], b = name[k];
+            if (a >= 'A' && a <= 'Z') a += 'a' - 'A';
+            if (b >= 'A' && b <= 'Z') b += 'a' - 'A';
+            if (a != b) break;
+            k++;
+        }
+        if (k < name_len || req[i + k] != ':') continue;
+
+        i += name_len + 1;
+        while (i < len && req[i] == ' ') i++;
+
+        int j = 0;
+        while (i < len && req[i] != '\r' && req[i] != '\n' && j < out_size - 1) {
+            out[j++] = req[i++];
+        }
+        out[j] = '\0';
+        return j;
+    }
+
+    return -1;
+}
+
+/* Copy the value of a query parameter from the request line. Returns
+ * value length (0 for "name" alone), or -1 if the parameter is absent. */
+static int get_query_param(const char *req, int len, const char *name, char *out, int out_size) {
+    int name_len = strlen(name);
+    int i = 0;
+
+    while (i < len && req[i] != ' ') i++;   /* Past the method */
+    i++;
+    while (i < len && req[i] != '?' && req[i] != ' ' && req[i] != '\r' && req[i] != '\n') i++;
+    if (i >= len || req[i] != '?') return -1;
+
+    while (i < len && req[i] != ' ' && req[i] != '\r' && req[i] != '\n') {
+        i++;    /* Past '?' or '&' */
+        int start = i;
+        while (i < len && req[i] != '&' && req[i] != '=' && req[i] != ' ' &&
+               req[i] != '#' && req[i] != '\r' && req[i] != '\n') i++;
+        int match = (i - start == name_len && memcmp(req + start, name, name_len) == 0);
+
+        int j = 0;
+        if (i < len && req[i] == '=') {
+            i++;
+            while (i < len && req[i] != '&' && req[i] != ' ' && req[i] != '#' &&
+                   req[i] != '\r' && req[i] != '\n') {
+                if (match && j < out_size - 1) out[j++] = req[i];
+                i++;
+            }
+        }
+        if (match) {
+            out[j] = '\0';
+            return j;
+        }
+        if (i < len && req[i] != '&') break;
+    }
+
+    return -1;
+}
+
+/* Uncached response for the diagnostic endpoints; the body must fit in
+ * the TCP send buffer */
+static void http_send_text(struct tcp_pcb *pcb, const char *type, const char *body, int body_len) {
+    char header[192];
+    int len = 0;
+    const char *hdr = "HTTP/1.1 200 OK\r\n"
+                      "Cache-Control: no-store\r\n"
+                      "Connection: close\r\n"
+                      "Content-Type: ";
+    memcpy(header, hdr, strlen(hdr));
+    len += strlen(hdr);
+    memcpy(header + len, type, strlen(type));
+    len += strlen(type);
+    memcpy(header + len, "\r\nContent-Length: ", 18);
+    len += 18;
+    len += int_to_str(header + len, body_len);
+    memcpy(header + len, "\r\n\r\n", 4);
+    len += 4;
+
+    http_cork(pcb);
+    http_write(pcb, header, len);
+    http_write(pcb, body, body_len);
+    http_end(pcb);
+    http_count_status(200);
+}
+
+/* Short plain text response, for errors and uploads */
+static void http_send_status(struct tcp_pcb *pcb, int status, const char *reason, const char *body) {
+    char header[192];
+    int len = 0;
+    memcpy(header + len, "HTTP/1.1 ", 9);
+    len += 9;
+    len += int_to_str(header + len, status);
+    header[len++] = ' ';
+    memcpy(header + len, reason, strlen(reason));
+    len += strlen(reason);
+    const char *hdr = "\r\nContent-Type: text/plain\r\nConnection: close\r\nContent-Length: ";
+    memcpy(header + len, hdr, strlen(hdr));
+    len += strlen(hdr);
+    len += int_to_str(header + len, strlen(body));
+    memcpy(header + len, "\r\n\r\n", 4);
+    len += 4;
+
+    http_cork(pcb);
+    http_write(pcb, header, len);
+    http_write(pcb, body, strlen(body));
+    http_end(pcb);
+    http_count_status(status);
+}
+
+/* Reply to OPTIONS (204) or to a method the path does not take (405).
+ * Both name the allowed methods; a 405 also has a short body, unless
+ * the request was HEAD. */
+static void http_send_allow(struct tcp_pcb *pcb, int status, const char *allow, int head) {
+    char header[160];
+    int len = 0;
+    const char *line = (status == 405) ? "HTTP/1.1 405 Method Not Allowed\r\n"
+                                       : "HTTP/1.1 204 No Content\r\n";
+    memcpy(header + len, line, strlen(line));
+    len += strlen(line);
+    memcpy(header + len, "Allow: ", 7);
+    len += 7;
+    memcpy(header + len, allow, strlen(allow));
+    len += strlen(allow);
+    const char *rest = (status == 405) ? "\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n"
+                                       : "\r\nConnection: close\r\n\r\n";
+    memcpy(header + len, rest, strlen(rest));
+    len += strlen(rest);
+
+    http_cork(pcb);
+    http_write(pcb, header, len);
+    if (status == 405 && !head) {
+        http_write(pcb, "405 Method Not Allowed\n", 23);
+    }
+    http_end(pcb);
+    http_count_status(status);
+}
+
+/* Counter snapshot for host-side benchmarks (scripts/bench.sh): the
+ * harness reads it before and after a run to get instructions/request */
+static void http_send_counters(struct tcp_pcb *pcb) {
+    char body[64];
+    int body_len = 0;
+    memcpy(body, "instret ", 8);
+    body_len += 8;
+    body_len += int64_to_str(body + body_len, (int64_t)read_minstret());
+    memcpy(body + body_len, "\ncycle ", 7);
+    body_len += 7;
+    body_len += int64_to_str(body + body_len, (int64_t)read_mcycle());
+    body[body_len++] = '\n';
+
+    http_send_text(pcb, "text/plain", body, body_len);
+}
+
+/* Responses generated on the fly have no length to announce: they go
+ * out with Transfer-Encoding: chunked, or to HTTP/1.0 clients as a body
+ * ended by the close. Each chunk is generated into the connection's
+ * buffer behind room for its size line, framed in place and queued with
+ * one http_write; the next is made only when the send buffer can take
+ * it, from http_sent as ACKs come in. However long the body, the
+ * connection holds no more than hs->buf and what TCP has queued. */
+#define HTTP_CHUNK_HDR 8        /* Size line: up to 6 hex digits, CRLF */
+#define HTTP_CHUNK_FRAMING 7    /* Size line and CRLF around 256-4095 bytes */
+#define HTTP_CHUNK_MIN 512      /* Wait for ACKs rather than send less */
+#define HTTP_CHUNK_MAX ((TCP_SND_BUF < HTTP_BUF_SIZE ? TCP_SND_BUF : HTTP_BUF_SIZE) - \
+                        HTTP_CHUNK_HDR - 2)
+
+/* Drop the generator and its state; also when the connection goes */
+static void http_stream_release(struct http_state *hs) {
+    if (hs->gen != NULL && hs->gen->close != NULL && hs->gen_ctx != NULL) {
+        hs->gen->close(hs->gen_ctx);
+    }
+    free(hs->gen_ctx);
+    hs->gen_ctx = NULL;
+    hs->gen = NULL;
+}
+
+/* Finish a generated response. An incomplete one ends without the
+ * last chunk, so a client reading chunked can tell. Responses to
+ * requests for content are timed like files; the diagnostic streams
+ * return before the lookup, so t_open tells them apart. */
+static void http_stream_end(struct http_state *hs, struct tcp_pcb *pcb, int complete) {
+    if (complete && !hs->http10) {
+        http_write(pcb, "0\r\n\r\n", 5);
+    }
+    http_stream_release(hs);
+    if (complete && hs->t_open != 0) {
+        http_response_queued(hs);
+    }
+    http_end(pcb);
+}
+
+/* Queue as many chunks as the send buffer and segment queue allow */
+static void http_stream(struct http_state *hs, struct tcp_pcb *pcb) {
+    char *data = (char *)hs->buf + HTTP_CHUNK_HDR;
+
+    http_cork(pcb);
+    while (hs->gen != NULL) {
+        int room = tcp_sndbuf(pcb);
+        if (room > HTTP_BUF_SIZE) room = HTTP_BUF_SIZE;
+        room -= HTTP_CHUNK_HDR + 2;
+        if (room < HTTP_CHUNK_MIN || tcp_sndqueuelen(pcb) > TCP_SND_QUEUELEN - 4) break;
+
+        /* Aim for a chunk that ends on a segment boundary, framing and
+         * all; a piece too big for that gets all the room there is */
+        int aim = http_batch(pcb, HTTP_BUF_SIZE, -1) - HTTP_CHUNK_FRAMING;
+        int n = -1;
+        if (aim >= HTTP_CHUNK_MIN && aim < room) {
+            n = hs->gen->next(hs, data, aim);
+        }
+        if (n < 0) {
+            n = hs->gen->next(hs, data, room);
+        }
+        if (n < 0 && room < HTTP_CHUNK_MAX) break;
+        if (n <= 0) {
+            if (n < 0) {
+                console_printf("HTTP: generated piece over %d bytes, response cut short\n", room);
+            }
+            http_stream_end(hs, pcb, n == 0);
+            return;
+        }
+
+        char *chunk = data;
+        int len = n;
+        if (!hs->http10) {
+            *--chunk = '\n';
+            *--chunk = '\r';
+            for (unsigned v = n; ; v >>= 4) {
+                *--chunk = "0123456789abcdef"[v & 0xF];
+                if (v < 16) break;
+            }
+            data[n] = '\r';
+            data[n + 1] = '\n';
+            len = data + n + 2 - chunk;
+        }
+        if (http_write(pcb, chunk, len) != ERR_OK) {
+            console_printf("HTTP: no memory to queue a chunk, response cut short\n");
+            http_stream_end(hs, pcb, 0);
+            return;
+        }
+    }
+    http_uncork(pcb);
+}
+
+/* Send the headers of a generated response and start its body, unless
+ * the request was HEAD. ctx is gen's state, from malloc (or NULL); hs
+ * owns it from here. */
+static void http_stream_begin(struct http_state *hs, struct tcp_pcb *pcb, const char *type,
+                              const struct http_gen *gen, void *ctx, int head) {
+    char header[192];
+    int len = 0;
+    const char *hdr = "HTTP/1.1 200 OK\r\n"
+                      "Cache-Control: no-store\r\n"
+                      "Connection: close\r\n"
+                      "Content-Type: ";
+    memcpy(header, hdr, strlen(hdr));
+    len += strlen(hdr);
+    memcpy(header + len, type, strlen(type));
+    len += strlen(type);
+    header[len++] = '\r';
+    header[len++] = '\n';
+    if (!hs->http10) {
+        memcpy(header + len, "Transfer-Encoding: chunked\r\n", 28);
+        len += 28;
+    }
+    header[len++] = '\r';
+    header[len++] = '\n';
+
+    /* Corked until http_stream() has queued what it can after them */
+    http_cork(pcb);
+    http_write(pcb, header, len);
+    hs->sent_headers = 1;
+    http_count_status(200);
+
+    hs->gen = gen;
+    hs->gen_ctx = ctx;
+    hs->gen_pos = 0;
+    if (head) {
+        http_stream_release(hs);
+        if (hs->t_open != 0) {
+            http_response_queued(hs);
+        }
+        http_end(pcb);
+        return;
+    }
+    http_stream(hs, pcb);
+    http_mark(&hs->t_first_byte);
+}
+
+/* Whether the request line ends in HTTP/1.0 */
+static int http_request_is_10(const char *req, int len) {
+    int i = 0;
+    while (i < len && req[i] != '\r' && req[i] != '\n') i++;
+    return i >= 8 && memcmp(req + i - 8, "HTTP/1.0", 8) == 0;
+}
+
+/* Append to a /__stats section. Past the end of buf, len ends up at
+ * least size - 1 whichever count snprintf returns on truncation. */
+#define STATS_PRINTF(...) \
+    do { \
+        if (len < size - 1) len += snprintf(buf + len, size - len, __VA_ARGS__); \
+    } while (0)
+
+/* Live counters as JSON, for monitoring to scrape. Rendered a section
+ * at a time and streamed, so the document can outgrow any one buffer:
+ * returns the length of section, 0 past the last one, or -1 if it does
+ * not fit in size bytes. */
+static int http_render_stats(uint32_t section, char *buf, int size) {
+    int len = 0;
+
+    switch (section) {
+        case 0: {
+            uint32_t requests = http_stats.status_200 + http_stats.status_304 +
+                                http_stats.status_404 + http_stats.status_other;
+            STATS_PRINTF(
+                "{\n\"uptime_ms\": %u,\n"
+                "\"http\": {\"accepted\": %u, \"active\": %u, \"aborted\": %u, \"requests\": %u, "
+                "\"status\": {\"200\": %u, \"304\": %u, \"404\": %u, \"other\": %u}, \"bytes_sent\": %lu},\n",
+                sys_now(), http_stats.accepted, http_stats.active, http_stats.aborted, requests,
+                http_stats.status_200, http_stats.status_304, http_stats.status_404,
+                http_stats.status_other, (unsigned long)http_stats.bytes_sent);
+            break;
+        }
+
+        case 1:
+            STATS_PRINTF(
+                "\"tcp\": {\"xmit\": %u, \"recv\": %u, \"drop\": %u, \"memerr\": %u, \"err\": %u},\n",
+                (unsigned)lwip_stats.tcp.xmit, (unsigned)lwip_stats.tcp.recv,
+                (unsigned)lwip_stats.tcp.drop, (unsigned)lwip_stats.tcp.memerr,
+                (unsigned)lwip_stats.tcp.err);
+            break;
+
+        case 2: {
+            /* Pool names come from the same table lwIP builds memp_t from */
+            static const char *const pool_names[] = {
+#define LWIP_MEMPOOL(name, num, size, desc) #name,
+#include "lwip/priv/memp_std.h"
+            };
+            STATS_PRINTF("\"pools\": {");
+            const char *sep = "";
+            for (int i = 0; i < MEMP_MAX; i++) {
+                const struct stats_mem *m = lwip_stats.memp[i];
+                if (m == NULL) continue;
+                STATS_PRINTF("%s\"%s\": {\"used\": %u, \"max\": %u, \"avail\": %u, \"err\": %u}",
+                             sep, pool_names[i], (unsigned)m->used, (unsigned)m->max,
+                             (unsigned)m->avail, (unsigned)m->err);
+                sep = ", ";
+            }
+            STATS_PRINTF("},\n");
+            break;
+        }
+
+        case 3: {
+            struct virtio_net_stats net;
+            virtio_net_get_stats(&net);
+            STATS_PRINTF(
+                "\"virtio_net\": {\"rx_frames\": %u, \"rx_bytes\": %lu, \"rx_dropped\": %u, "
+                "\"rx_notifies\": %u, \"rx_batch_max\": %u, \"tx_frames\": %u, \"tx_bytes\": %lu, "
+                "\"tx_dropped\": %u, \"tx_notifies\": %u, \"tx_in_flight\": %u, "
+                "\"tx_in_flight_max\": %u, \"queue_size\": %u},\n",
+                net.rx_frames, (unsigned long)net.rx_bytes, net.rx_dropped, net.rx_notifies,
+                net.rx_batch_max, net.tx_frames, (unsigned long)net.tx_bytes, net.tx_dropped,
+                net.tx_notifies, net.tx_in_flight, net.tx_in_flight_max, net.queue_size);
+            break;
+        }
+
+        case 4: {
+            struct virtio_blk_stats blk;
+            virtio_blk_get_stats(&blk);
+            STATS_PRINTF(
+                "\"virtio_blk\": {\"reads\": %u, \"writes\": %u, \"flushes\": %u, \"errors\": %u, "
+                "\"notifies\": %u, \"bytes_read\": %lu, \"bytes_written\": %lu},\n",
+                blk.reads, blk.writes, blk.flushes, blk.errors, blk.notifies,
+                (unsigned long)blk.bytes_read, (unsigned long)blk.bytes_written);
+            break;
+        }
+
+        case 5: {
+            struct ext4_blockdev_virtio_stats bd;
+            ext4_blockdev_virtio_get_stats(&bd);
+            STATS_PRINTF(
+                "\"block_cache\": {\"size\": %u, \"lookups\": %u, \"hits\": %u, \"hit_pct\": %u, "
+                "\"disk_reads\": %u, \"disk_writes\": %u, \"blocks_read\": %lu, \"blocks_written\": %lu},\n",
+                bd.cache_size, bd.cache_lookups, bd.cache_hits,
+                bd.cache_lookups ? (unsigned)((uint64_t)bd.cache_hits * 100 / bd.cache_lookups) : 0,
+                bd.disk_reads, bd.disk_writes, (unsigned long)bd.blocks_read,
+                (unsigned long)bd.blocks_written);
+            break;
+        }
+
+        case 6: {
+            struct heap_stats heap, warm;
+            heap_get_stats(&heap);
+            warm_heap_get_stats(&warm);
+            STATS_PRINTF(
+                "\"heap\": {\"total\": %lu, \"used\": %lu, \"peak\": %lu, \"largest_free\": %lu, "
+                "\"free_blocks\": %u, \"failures\": %u},\n",
+                (unsigned long)heap.total, (unsigned long)heap.used, (unsigned long)heap.peak,
+                (unsigned long)heap.largest_free, heap.free_blocks, heap.failures);
+            STATS_PRINTF(
+                "\"warm_heap\": {\"total\": %lu, \"used\": %lu, \"peak\": %lu, \"failures\": %u},\n",
+                (unsigned long)warm.total, (unsigned long)warm.used, (unsigned long)warm.peak,
+                warm.failures);
+            break;
+        }
+
+        case 7:
+            STATS_PRINTF("\"boot_us\": {");
+            for (int i = 0; i < BOOT_PHASES; i++) {
+                STATS_PRINTF("\"%s\": %lu, ", boot_names[i],
+                             (unsigned long)ticks_to_us(boot_time.phase[i]));
+            }
+            STATS_PRINTF(
+                "\"fs_mount\": %lu, \"listening_at\": %lu, \"fs_mounted_at\": %lu, "
+                "\"first_response_at\": %lu},\n",
+                (unsigned long)ticks_to_us(boot_time.fs_mount),
+                (unsigned long)ticks_to_us(boot_time.last),
+                (unsigned long)ticks_to_us(boot_time.fs_mounted_at),
+                (unsigned long)ticks_to_us(boot_time.first_response_at));
+            break;
+
+        case 8:
+            STATS_PRINTF("\"latency_us\": {");
+            for (int i = 0; i < PHASE_COUNT; i++) {
+                const struct hist *h = &phase_hist[i];
+                STATS_PRINTF(
+                    "%s\n  \"%s\": {\"count\": %u, \"mean\": %lu, \"p50\": %lu, \"p90\": %lu, "
+                    "\"p99\": %lu, \"max\": %lu}",
+                    i ? "," : "", phase_names[i], h->total,
+                    (unsigned long)(h->total ? ticks_to_us(h->sum / h->total) : 0),
+                    (unsigned long)ticks_to_us(hist_percentile(h, 50)),
+                    (unsigned long)ticks_to_us(hist_percentile(h, 90)),
+                    (unsigned long)ticks_to_us(hist_percentile(h, 99)),
+                    (unsigned long)ticks_to_us(h->max));
+            }
+            STATS_PRINTF("\n}\n}\n");
+            break;
+
+        default:
+            return 0;
+    }
+
+    return len < size - 1 ? len : -1;
+}
+
+/* /__stats body: as many whole sections per chunk as fit */
+static int http_stats_next(struct http_state *hs, char *buf, int size) {
+    int len = 0;
+    for (;;) {
+        int n = http_render_stats(hs->gen_pos, buf + len, size - len);
+        if (n <= 0) return (len > 0 || n == 0) ? len : -1;
+        len += n;
+        hs->gen_pos++;
+    }
+}
+
+static const struct http_gen http_gen_stats = {http_stats_next, NULL};
+
+#ifdef BLK_TRACE
+/* /__blktrace body: whole lines of the trace ring */
+static int http_blktrace_next(struct http_state *hs, char *buf, int size) {
+    int len = 0;
+    for (;;) {
+        int n = virtio_blk_trace_line(hs->gen_ctx, buf + len, size - len);
+        if (n <= 0) return (len > 0 || n == 0) ? len : -1;
+        len += n;
+    }
+}
+
+static const struct http_gen http_gen_blktrace = {http_blktrace_next, NULL};
+#endif
+
+/* Full phase histograms on the console, one line per non-empty bucket */
+static void http_dump_latency(void) {
+    console_printf("Request latency (us), %u requests:\n", phase_hist[PHASE_TOTAL].total);
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        const struct hist *h = &phase_hist[i];
+        console_printf("%s: p50 %lu p90 %lu p99 %lu max %lu\n", phase_names[i],
+                       (unsigned long)ticks_to_us(hist_percentile(h, 50)),
+                       (unsigned long)ticks_to_us(hist_percentile(h, 90)),
+                       (unsigned long)ticks_to_us(hist_percentile(h, 99)),
+                       (unsigned long)ticks_to_us(h->max));
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            if (h->counts[b]) {
+                console_printf("  >= %lu: %u\n",
+                               (unsigned long)ticks_to_us(hist_bucket_low(b)), h->counts[b]);
+            }
+        }
+    }
+}
+
+/* Headers of a 200 response for a file served from disk */
+int http_file_header(char *header, const char *path, int64_t size, const char *etag) {
+    int len = 0;
+
+    /* HTTP status line */
+    const char *ok = "HTTP/1.1 200 OK\r\n";
+    memcpy(header + len, ok, strlen(ok));
+    len += strlen(ok);
+
+    /* Content-Type */
+    const char *ct = "Content-Type: ";
+    memcpy(header + len, ct, strlen(ct));
+    len += strlen(ct);
+    const char *mime = get_mime_type(path);
+    memcpy(header + len, mime, strlen(mime));
+    len += strlen(mime);
+    header[len++] = '\r';
+    header[len++] = '\n';
+
+    /* Content-Length */
+    const char *cl = "Content-Length: ";
+    memcpy(header + len, cl, strlen(cl));
+    len += strlen(cl);
+    len += int64_to_str(header + len, size);
+    header[len++] = '\r';
+    header[len++] = '\n';
+
+    /* Validator and freshness for caches */
+    const char *et = "ETag: ";
+    memcpy(header + len, et, strlen(et));
+    len += strlen(et);
+    memcpy(header + len, etag, strlen(etag));
+    len += strlen(etag);
+    header[len++] = '\r';
+    header[len++] = '\n';
+    memcpy(header + len, HTTP_CACHE_CONTROL, sizeof(HTTP_CACHE_CONTROL) - 1);
+    len += sizeof(HTTP_CACHE_CONTROL) - 1;
+
+    /* Connection close */
+    const char *cc = "Connection: close\r\n\r\n";
+    memcpy(header + len, cc, strlen(cc));
+    len += strlen(cc);
+
+    return len;
+}
+
+/* Mount the disk, once. This stays off the boot path so the server is
+ * listening before the disk is touched: the main loop calls it when the
+ * network is idle, and a request that may be served from disk calls it
+ * first if the loop has not got to it yet. */
+void http_mount_fs(void) {
+    static int tried;
+    if (tried) return;
+    tried = 1;
+
+    uint64_t start = timer_ticks();
+#ifdef SNAPSHOT
+    /* A saved mount, cache included, if the disk still matches it */
+    if (snapshot_restore() == 0) {
+        boot_time.fs_mounted_at = timer_ticks();
+        boot_time.fs_mount = boot_time.fs_mounted_at - start;
+        console_printf("[OK] Filesystem restored from snapshot in %lu us\n",
+                       (unsigned long)ticks_to_us(boot_time.fs_mount));
+        return;
+    }
+#endif
+    int err = fs_init();
+    boot_time.fs_mounted_at = timer_ticks();
+    boot_time.fs_mount = boot_time.fs_mounted_at - start;
+
+    if (err == 0) {
+        console_printf("[OK] Filesystem mounted (ext4) in %lu us\n",
+                       (unsigned long)ticks_to_us(boot_time.fs_mount));
+    } else {
+        console_printf("[--] No disk or filesystem not available\n");
+        console_printf("     (Will serve static HTML only)\n");
+    }
+}
+
 /* Parse URL path from HTTP request */
 static int parse_url_path(const char *req, int len, char *path, int path_size) {
     /* Find start of path (after "GET ") */
@@ -195,170 +1051,1046 @@ static int parse_url_path(const char *req, int len, char *path, int path_size) {
     return 0;
 }
 
-/* Send file chunk callback */
+/* Queue file data, in http_batch() sizes while the send buffer has
+ * room, and end the response after the last of it. Reads are sized to
+ * the segments rather than the buffer, so one may be less than
+ * HTTP_BUF_SIZE; a write lwIP cannot take is read again later. */
+static void http_send_file(struct http_state *hs, struct tcp_pcb *pcb) {
+    http_cork(pcb);
+    while (hs->file != FS_INVALID_FILE) {
+        int64_t left = hs->file_size - hs->bytes_sent;
+        ssize_t n = 0;
+        if (left > 0) {
+            int batch = http_batch(pcb, HTTP_BUF_SIZE, left);
+            if (batch == 0) break;
+            n = fs_read(hs->file, hs->buf, batch);
+            if (n > 0 && http_write(pcb, hs->buf, n) != ERR_OK) {
+                fs_seek(hs->file, hs->bytes_sent, FS_SEEK_SET);
+                break;
+            }
+        }
+        if (n > 0) hs->bytes_sent += n;
+
+        /* Done, or the file ended early */
+        if (n <= 0 || hs->bytes_sent >= hs->file_size) {
+            fs_close(hs->file);
+            hs->file = FS_INVALID_FILE;
+            http_response_queued(hs);
+            http_end(pcb);
+            return;
+        }
+    }
+    http_uncork(pcb);
+}
+
+/* Send file chunk callback; also times each response as its ACKs arrive */
 static err_t http_sent(void *arg, struct tcp_pcb *pcb, u16_t len) {
     struct http_state *hs = (struct http_state*)arg;
     (void)len;
+    PROF_REGION(PROF_HTTP_SENT);
 
-    if (hs == NULL || hs->file == FS_INVALID_FILE) return ERR_OK;
-
-    /* Read and send more data */
-    ssize_t n = fs_read(hs->file, hs->buf, HTTP_BUF_SIZE);
-    if (n > 0) {
-        hs->bytes_sent += n;
-        tcp_write(pcb, hs->buf, n, TCP_WRITE_FLAG_COPY);
-        tcp_output(pcb);
+    if (hs == NULL || hs->upload) return ERR_OK;
+    if (hs->gen != NULL) {
+        http_stream(hs, pcb);
+        return ERR_OK;
     }
-
-    /* Check if done */
-    if (n <= 0 || hs->bytes_sent >= hs->file_size) {
-        fs_close(hs->file);
-        hs->file = FS_INVALID_FILE;
-        tcp_close(pcb);
+    if (hs->file == FS_INVALID_FILE) {
+        http_record_phases(hs, pcb);
+        return ERR_OK;
     }
 
+    http_send_file(hs, pcb);
     return ERR_OK;
 }
 
-/* TCP receive callback */
-static err_t http_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err) {
-    struct http_state *hs = (struct http_state*)arg;
+/* Directory listings (autoindex), as HTML or with ?format=json as JSON.
+ * ?offset=N skips the first N entries and ?limit=M stops after M, for
+ * clients that page through a large directory; the JSON gives the next
+ * offset, or null at the end. Entries are read from lwext4 one at a time
+ * as the send buffer takes them, so a listing costs one fs_dir_t and
+ * this struct whatever the directory's size. */
+enum { DIRLIST_HEAD, DIRLIST_ENTRIES, DIRLIST_TAIL };
+
+/* What the query asks of a listing */
+struct dirlist_query {
+    int json;
+    uint32_t offset;
+    uint32_t limit;             /* 0: no limit */
+};
 
-    if (p == NULL) {
-        /* Connection closed by remote */
-        if (hs && hs->file != FS_INVALID_FILE) {
-            fs_close(hs->file);
+struct http_dirlist {
+    fs_dir_t dir;
+    int json;
+    int state;                  /* DIRLIST_* */
+    int have_entry;             /* ent read and not yet sent */
+    int more;                   /* Entries past the limit */
+    int64_t size;               /* Of ent, -1 for a directory */
+    uint32_t index;             /* Entries read, "." and ".." aside */
+    uint32_t offset;
+    uint32_t limit;
+    struct fs_dirent ent;
+    char path[HTTP_PATH_SIZE];  /* No trailing slash */
+};
+
+enum { ESC_NONE, ESC_HTML, ESC_URL, ESC_JSON };
+
+/* Append n bytes of s to buf, escaped for where they go. Returns the new
+ * length, or -1 if they do not fit (or len is already -1). */
+static int dirlist_put(char *buf, int len, int size, const char *s, int n, int esc) {
+    static const char hex[] = "0123456789ABCDEF";
+
+    for (int i = 0; i < n && len >= 0; i++) {
+        unsigned char c = s[i];
+        if (len + 6 > size) return -1;
+
+        if (esc == ESC_HTML && (c == '&' || c == '<' || c == '>' || c == '"')) {
+            const char *e = c == '&' ? "&amp;" : c == '<' ? "&lt;" : c == '>' ? "&gt;" : "&quot;";
+            memcpy(buf + len, e, strlen(e));
+            len += strlen(e);
+        } else if (esc == ESC_URL && !((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                                       (c >= '0' && c <= '9') || c == '-' || c == '.' ||
+                                       c == '_' || c == '~' || c == '/')) {
+            buf[len++] = '%';
+            buf[len++] = hex[c >> 4];
+            buf[len++] = hex[c & 0xF];
+        } else if (esc == ESC_JSON && (c == '"' || c == '\\' || c < 0x20)) {
+            buf[len++] = '\\';
+            if (c >= 0x20) {
+                buf[len++] = c;
+            } else {
+                memcpy(buf + len, "u00", 3);
+                len += 3;
+                buf[len++] = hex[c >> 4];
+                buf[len++] = hex[c & 0xF];
+            }
+        } else {
+            buf[len++] = c;
         }
-        tcp_close(pcb);
-        if (hs) free(hs);
-        return ERR_OK;
     }
+    return len;
+}
 
-    /* Acknowledge received data */
-    tcp_recved(pcb, p->tot_len);
+#define DIRLIST_TEXT(s) (len = dirlist_put(buf, len, size, s, strlen(s), ESC_NONE))
 
-    /* Check if this is a GET request */
-    char *data = (char*)p->payload;
-    int plen = p->len;
-    int is_get = (plen >= 3 && data[0] == 'G' && data[1] == 'E' && data[2] == 'T');
+static int dirlist_number(char *buf, int len, int size, int64_t val) {
+    char num[24];
+    return dirlist_put(buf, len, size, num, int64_to_str(num, val), ESC_NONE);
+}
+
+/* One piece of the listing at buf: the length it takes, or -1 */
+static int dirlist_piece(struct http_dirlist *dl, char *buf, int size) {
+    const char *path = dl->path;
+    int path_len = strlen(path);
+    const char *name = dl->ent.name;
+    int name_len = strlen(name);
+    int len = 0;
+
+    switch (dl->state) {
+        case DIRLIST_HEAD:
+            if (dl->json) {
+                DIRLIST_TEXT("{\"path\": \"");
+                len = dirlist_put(buf, len, size, path, path_len, ESC_JSON);
+                DIRLIST_TEXT("/\", \"offset\": ");
+                len = dirlist_number(buf, len, size, dl->offset);
+                DIRLIST_TEXT(", \"entries\": [");
+            } else {
+                DIRLIST_TEXT("<!DOCTYPE html>\n<html>\n<head>\n  <title>Index of ");
+                len = dirlist_put(buf, len, size, path, path_len, ESC_HTML);
+                DIRLIST_TEXT("/</title>\n</head>\n<body>\n  <h1>Index of ");
+                len = dirlist_put(buf, len, size, path, path_len, ESC_HTML);
+                DIRLIST_TEXT("/</h1>\n  <ul>\n");
+                if (path_len > 0) {
+                    int parent = path_len - 1;
+                    while (parent > 0 && path[parent] != '/') parent--;
+                    DIRLIST_TEXT("    <li><a href=\"");
+                    len = dirlist_put(buf, len, size, path, parent, ESC_URL);
+                    DIRLIST_TEXT("/\">../</a></li>\n");
+                }
+            }
+            break;
+
+        case DIRLIST_ENTRIES:
+            if (dl->json) {
+                DIRLIST_TEXT(dl->index > dl->offset ? ",\n  {\"name\": \"" : "\n  {\"name\": \"");
+                len = dirlist_put(buf, len, size, name, name_len, ESC_JSON);
+                DIRLIST_TEXT(dl->ent.is_dir ? "\", \"type\": \"dir\"" : "\", \"type\": \"file\"");
+                if (dl->size >= 0) {
+                    DIRLIST_TEXT(", \"size\": ");
+                    len = dirlist_number(buf, len, size, dl->size);
+                }
+                DIRLIST_TEXT("}");
+            } else {
+                DIRLIST_TEXT("    <li><a href=\"");
+                len = dirlist_put(buf, len, size, path, path_len, ESC_URL);
+                DIRLIST_TEXT("/");
+                len = dirlist_put(buf, len, size, name, name_len, ESC_URL);
+                DIRLIST_TEXT(dl->ent.is_dir ? "/\">" : "\">");
+                len = dirlist_put(buf, len, size, name, name_len, ESC_HTML);
+                DIRLIST_TEXT(dl->ent.is_dir ? "/</a>" : "</a>");
+                if (dl->size >= 0) {
+                    DIRLIST_TEXT(" ");
+                    len = dirlist_number(buf, len, size, dl->size);
+                }
+                DIRLIST_TEXT("</li>\n");
+            }
+            break;
+
+        default:
+            if (dl->json) {
+                DIRLIST_TEXT("\n], \"next\": ");
+                if (dl->more) {
+                    len = dirlist_number(buf, len, size, dl->offset + dl->limit);
+                } else {
+                    DIRLIST_TEXT("null");
+                }
+                DIRLIST_TEXT("}\n");
+            } else {
+                DIRLIST_TEXT("  </ul>\n");
+                if (dl->more) {
+                    DIRLIST_TEXT("  <p><a href=\"");
+                    len = dirlist_put(buf, len, size, path, path_len, ESC_URL);
+                    DIRLIST_TEXT("/?offset=");
+                    len = dirlist_number(buf, len, size, dl->offset + dl->limit);
+                    DIRLIST_TEXT("&amp;limit=");
+                    len = dirlist_number(buf, len, size, dl->limit);
+                    DIRLIST_TEXT("\">Next</a></p>\n");
+                }
+                DIRLIST_TEXT("</body>\n</html>\n");
+            }
+            break;
+    }
+
+    return len;
+}
 
-    if (!hs->sent_headers && is_get) {
-        /* Parse the URL path */
-        char path[HTTP_PATH_SIZE];
-        if (parse_url_path(data, plen, path, HTTP_PATH_SIZE) != 0) {
-            pbuf_free(p);
-            tcp_write(pcb, http_404, sizeof(http_404) - 1, TCP_WRITE_FLAG_COPY);
-            tcp_output(pcb);
-            tcp_close(pcb);
-            return ERR_OK;
+/* Read up to the next entry to list; 0 when there are no more */
+static int dirlist_read(struct http_dirlist *dl) {
+    for (;;) {
+        if (fs_readdir(dl->dir, &dl->ent) <= 0) return 0;
+
+        const char *name = dl->ent.name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        if (http_reserved_path(name)) continue;
+        if (dl->index < dl->offset) {
+            dl->index++;
+            continue;
+        }
+        if (dl->limit && dl->index >= dl->offset + dl->limit) {
+            dl->more = 1;
+            return 0;
         }
 
-        console_printf("HTTP GET: %s\n", path);
+        /* Sizes cost a lookup each, so only for entries being listed */
+        dl->size = -1;
+        if (!dl->ent.is_dir) {
+            char full[HTTP_PATH_SIZE + FS_MAX_NAME + 1];
+            int path_len = strlen(dl->path);
+            memcpy(full, dl->path, path_len);
+            full[path_len] = '/';
+            memcpy(full + path_len + 1, dl->ent.name, strlen(dl->ent.name) + 1);
+            dl->size = fs_stat_size(full);
+        }
+        return 1;
+    }
+}
 
-        pbuf_free(p);
+static int http_dirlist_next(struct http_state *hs, char *buf, int size) {
+    struct http_dirlist *dl = hs->gen_ctx;
+    int len = 0;
 
-        /* Try to serve from filesystem first */
-        int serve_from_disk = 0;
-        if (fs_mounted()) {
-            int64_t fsize = fs_stat_size(path);
-            if (fsize >= 0) {
-                hs->file = fs_open(path, FS_O_RDONLY);
-                if (hs->file != FS_INVALID_FILE) {
-                    hs->file_size = fsize;
-                    hs->bytes_sent = 0;
-                    serve_from_disk = 1;
-                    console_printf("  -> Serving from disk (%lld bytes)\n", (long long)fsize);
-                }
+    for (;;) {
+        if (dl->state == DIRLIST_ENTRIES && !dl->have_entry) {
+            if (dirlist_read(dl)) {
+                dl->have_entry = 1;
+            } else {
+                dl->state = DIRLIST_TAIL;
             }
         }
+        if (dl->state > DIRLIST_TAIL) return len;
 
-        if (serve_from_disk) {
-            /* Serve file from disk */
-            char header[512];
-            int len = 0;
-
-            /* HTTP status line */
-            const char *ok = "HTTP/1.1 200 OK\r\n";
-            memcpy(header + len, ok, strlen(ok));
-            len += strlen(ok);
-
-            /* Content-Type */
-            const char *ct = "Content-Type: ";
-            memcpy(header + len, ct, strlen(ct));
-            len += strlen(ct);
-            const char *mime = get_mime_type(path);
-            memcpy(header + len, mime, strlen(mime));
-            len += strlen(mime);
-            header[len++] = '\r';
-            header[len++] = '\n';
-
-            /* Content-Length */
-            const char *cl = "Content-Length: ";
-            memcpy(header + len, cl, strlen(cl));
-            len += strlen(cl);
-            len += int64_to_str(header + len, hs->file_size);
-            header[len++] = '\r';
-            header[len++] = '\n';
-
-            /* Connection close */
-            const char *cc = "Connection: close\r\n\r\n";
-            memcpy(header + len, cc, strlen(cc));
-            len += strlen(cc);
-
-            /* Send headers */
-            tcp_write(pcb, header, len, TCP_WRITE_FLAG_COPY);
-            hs->sent_headers = 1;
+        int n = dirlist_piece(dl, buf + len, size - len);
+        if (n < 0) return len > 0 ? len : -1;
+        len += n;
 
-            /* Set up sent callback for chunked file transfer */
-            tcp_sent(pcb, http_sent);
+        if (dl->state == DIRLIST_ENTRIES) {
+            dl->index++;
+            dl->have_entry = 0;
+        } else {
+            dl->state++;
+        }
+    }
+}
 
-            /* Read and send first chunk */
-            ssize_t n = fs_read(hs->file, hs->buf, HTTP_BUF_SIZE);
-            if (n > 0) {
-                hs->bytes_sent = n;
-                tcp_write(pcb, hs->buf, n, TCP_WRITE_FLAG_COPY);
-            }
+static void http_dirlist_close(void *ctx) {
+    struct http_dirlist *dl = ctx;
+    fs_closedir(dl->dir);
+}
+
+static const struct http_gen http_gen_dirlist = {http_dirlist_next, http_dirlist_close};
 
-            tcp_output(pcb);
+static void dirlist_parse_query(const char *req, int len, struct dirlist_query *q) {
+    char value[16];
 
-            /* If file is small enough, close now */
-            if (n <= 0 || hs->bytes_sent >= hs->file_size) {
+    q->json = get_query_param(req, len, "format", value, sizeof(value)) >= 0 &&
+              strcmp(value, "json") == 0;
+    q->offset = 0;
+    q->limit = 0;
+    if (get_query_param(req, len, "offset", value, sizeof(value)) > 0) {
+        q->offset = strtoul(value, NULL, 10);
+    }
+    if (get_query_param(req, len, "limit", value, sizeof(value)) > 0) {
+        q->limit = strtoul(value, NULL, 10);
+    }
+}
+
+/* Start listing path if it is a directory. Returns 0 if it is not (or
+ * has no handle or memory free), with nothing sent. */
+static int http_dirlist_begin(struct http_state *hs, struct tcp_pcb *pcb, const char *path,
+                              const struct dirlist_query *q, int head) {
+    char path_buf[HTTP_PATH_SIZE];
+    int path_len = strlen(path);
+    while (path_len > 1 && path[path_len - 1] == '/') path_len--;
+    memcpy(path_buf, path, path_len);
+    path_buf[path_len] = '\0';
+
+    fs_dir_t dir = fs_opendir(path_buf);
+    if (dir == FS_INVALID_DIR) return 0;
+
+    struct http_dirlist *dl = calloc(1, sizeof(*dl));
+    if (dl == NULL) {
+        fs_closedir(dir);
+        return 0;
+    }
+    dl->dir = dir;
+    memcpy(dl->path, path_buf, path_len + 1);
+    if (path_len == 1) dl->path[0] = '\0';      /* The root */
+
+    dl->json = q->json;
+    dl->offset = q->offset;
+    dl->limit = q->limit;
+
+    console_printf("  -> Directory listing\n");
+    http_mark(&hs->t_open);
+    http_stream_begin(hs, pcb, dl->json ? "application/json" : "text/html; charset=utf-8",
+                      &http_gen_dirlist, dl, head);
+    return 1;
+}
+
+/* Diagnostic actions: they reset counters, print to the console or
+ * write to disk, so a crawler or prefetcher must not set them off with
+ * a GET. They take POST only; run() writes the reply text to buf and
+ * returns its length. */
+struct http_action {
+    const char *path;
+    int (*run)(char *buf, int size);
+};
+
+static int http_action_latency_dump(char *buf, int size) {
+    http_dump_latency();
+    return snprintf(buf, size, "dumped to console\n");
+}
+
+#ifdef PROFILE
+static int http_action_prof_reset(char *buf, int size) {
+    prof_reset();
+    return snprintf(buf, size, "reset\n");
+}
+#endif
+
+#ifdef BLK_TRACE
+static int http_action_blktrace_dump(char *buf, int size) {
+    virtio_blk_trace_dump();
+    return snprintf(buf, size, "dumped to console\n");
+}
+
+static int http_action_blktrace_reset(char *buf, int size) {
+    virtio_blk_trace_reset();
+    return snprintf(buf, size, "reset\n");
+}
+#endif
+
+#ifdef SNAPSHOT
+/* Save the mounted filesystem for the next boot */
+static int http_action_snapshot_save(char *buf, int size) {
+    http_mount_fs();
+    if (snapshot_save() == 0) {
+        return snprintf(buf, size, "saved\n");
+    }
+    return snprintf(buf, size, "not saved, see console\n");
+}
+#endif
+
+static const struct http_action http_actions[] = {
+    {"/__latency/dump", http_action_latency_dump},
+#ifdef PROFILE
+    {"/__prof/reset", http_action_prof_reset},
+#endif
+#ifdef BLK_TRACE
+    {"/__blktrace/dump", http_action_blktrace_dump},
+    {"/__blktrace/reset", http_action_blktrace_reset},
+#endif
+#ifdef SNAPSHOT
+    {"/__snapshot/save", http_action_snapshot_save},
+#endif
+    {NULL, NULL}
+};
+
+static const struct http_action *http_find_action(const char *path) {
+    for (int i = 0; http_actions[i].path != NULL; i++) {
+        if (strcmp(path, http_actions[i].path) == 0) {
+            return &http_actions[i];
+        }
+    }
+    return NULL;
+}
+
+/* Methods a path can be requested with, for Allow */
+static const char *http_allowed(const char *path) {
+    if (http_find_action(path) != NULL) {
+        return "POST, OPTIONS";
+    }
+    if (strncmp(path, "/__", 3) == 0) {
+        return "GET, OPTIONS";
+    }
+    return "GET, HEAD, OPTIONS, PUT, POST";
+}
+
+/* GET and HEAD. Both resolve the path and render the same headers;
+ * HEAD stops there, without opening the file. Frees p. */
+static void http_serve(struct http_state *hs, struct tcp_pcb *pcb, struct pbuf *p, int head) {
+    char *data = (char*)p->payload;
+    int plen = p->len;
+
+    /* Parse the URL path */
+    char path[HTTP_PATH_SIZE];
+    if (parse_url_path(data, plen, path, HTTP_PATH_SIZE) != 0) {
+        pbuf_free(p);
+        http_write(pcb, http_404, head ? HTTP_404_HEADER_LEN : sizeof(http_404) - 1);
+        hs->sent_headers = 1;
+        http_response_queued(hs);
+        http_end(pcb);
+        http_count_status(404);
+        return;
+    }
+    http_mark(&hs->t_request);
+
+    console_printf("HTTP %s: %s\n", head ? "HEAD" : "GET", path);
+
+    hs->http10 = http_request_is_10(data, plen);
+
+    /* In case the path turns out to be a directory */
+    struct dirlist_query query;
+    dirlist_parse_query(data, plen, &query);
+
+    /* Conditional GET: keep the validator before the pbuf goes */
+    char if_none_match[128];
+    int if_none_match_len = get_header(data, plen, "If-None-Match", if_none_match,
+                                       sizeof(if_none_match));
+
+    pbuf_free(p);
+
+    /* The diagnostic endpoints have nothing to offer HEAD, and the
+     * actions among them take POST only */
+    if (strncmp(path, "/__", 3) == 0 && (head || http_find_action(path) != NULL)) {
+        hs->sent_headers = 1;
+        http_send_allow(pcb, 405, http_allowed(path), 1);
+        http_response_queued(hs);
+        return;
+    }
+
+    if (strcmp(path, "/__instret") == 0) {
+        hs->sent_headers = 1;
+        http_send_counters(pcb);
+        return;
+    }
+
+    /* Streamed through the connection's file buffer, idle until a file
+     * is opened */
+    if (strcmp(path, "/__stats") == 0) {
+        http_stream_begin(hs, pcb, "application/json", &http_gen_stats, NULL, 0);
+        return;
+    }
+
+#ifdef PROFILE
+    /* Region and PC sample reports */
+    if (strcmp(path, "/__prof") == 0 || strcmp(path, "/__prof/pcs") == 0) {
+        int n = 0;
+        if (strcmp(path, "/__prof") == 0) {
+            n = prof_report_regions((char *)hs->buf, HTTP_BUF_SIZE);
+        } else {
+            n = prof_report_pcs((char *)hs->buf, HTTP_BUF_SIZE);
+        }
+        hs->sent_headers = 1;
+        http_send_text(pcb, "text/plain", (const char *)hs->buf, n);
+        return;
+    }
+#endif
+
+#ifdef BLK_TRACE
+    /* Block request trace, for host/blk_replay: the whole ring as the
+     * response (POST /__blktrace/dump prints it on the console) */
+    if (strcmp(path, "/__blktrace") == 0) {
+        struct blk_trace_cursor *c = malloc(sizeof(*c));
+        hs->sent_headers = 1;
+        if (c == NULL) {
+            http_send_status(pcb, 503, "Service Unavailable", "out of memory\n");
+            return;
+        }
+        virtio_blk_trace_open(c);
+        http_stream_begin(hs, pcb, "text/plain", &http_gen_blktrace, c, 0);
+        return;
+    }
+#endif
+
+    /* Try to serve from filesystem first */
+    int serve_from_disk = 0;
+    http_mount_fs();
+    if (fs_mounted() && !http_reserved_path(path)) {
+        /* HEAD needs no more than the inode */
+        int64_t fsize = fs_stat_size(path);
+        if (fsize >= 0 && !head) {
+            hs->file = fs_open(path, FS_O_RDONLY);
+        }
+        if (fsize >= 0 && (head || hs->file != FS_INVALID_FILE)) {
+            hs->file_size = fsize;
+            hs->bytes_sent = 0;
+            serve_from_disk = 1;
+            console_printf("  -> Serving from disk (%lld bytes)\n", (long long)fsize);
+        }
+
+        /* Not a file: a directory is listed */
+        if (fsize < 0 && http_dirlist_begin(hs, pcb, path, &query, head)) {
+            return;
+        }
+    }
+
+    http_mark(&hs->t_open);
+
+    if (serve_from_disk) {
+        /* Serve file from disk */
+        char header[512];
+        int len = 0;
+
+        char etag[40];
+        make_etag(etag, hs->file_size, fs_stat_mtime(path));
+
+        if (if_none_match_len > 0 && etag_match(if_none_match, if_none_match_len, etag)) {
+            /* Client (or proxy) copy is current: headers only */
+            const char *nm = "HTTP/1.1 304 Not Modified\r\nETag: ";
+            memcpy(header + len, nm, strlen(nm));
+            len += strlen(nm);
+            memcpy(header + len, etag, strlen(etag));
+            len += strlen(etag);
+            const char *rest = "\r\n" HTTP_CACHE_CONTROL "Connection: close\r\n\r\n";
+            memcpy(header + len, rest, strlen(rest));
+            len += strlen(rest);
+
+            console_printf("  -> Not modified\n");
+            if (hs->file != FS_INVALID_FILE) {
                 fs_close(hs->file);
                 hs->file = FS_INVALID_FILE;
-                tcp_close(pcb);
             }
-        } else {
-            /* Fall back to static HTML page */
-            char header[256];
-            int len = 0;
-
-            memcpy(header + len, http_ok, sizeof(http_ok) - 1);
-            len += sizeof(http_ok) - 1;
-            len += int_to_str(header + len, sizeof(html_page) - 1);
-            header[len++] = '\r';
-            header[len++] = '\n';
-            header[len++] = '\r';
-            header[len++] = '\n';
-
-            tcp_write(pcb, header, len, TCP_WRITE_FLAG_COPY);
+            http_write(pcb, header, len);
             hs->sent_headers = 1;
+            http_response_queued(hs);
+            http_end(pcb);
+            http_count_status(304);
+            return;
+        }
+
+        len = http_file_header(header, path, hs->file_size, etag);
+
+        /* Headers, then the body in the same segments: a small file
+         * goes out whole in one, FIN included */
+        http_cork(pcb);
+        http_write(pcb, header, len);
+        hs->sent_headers = 1;
+        http_count_status(200);
+
+        if (head) {
+            http_response_queued(hs);
+            http_end(pcb);
+            return;
+        }
 
-            tcp_write(pcb, html_page, sizeof(html_page) - 1, TCP_WRITE_FLAG_COPY);
+        http_send_file(hs, pcb);
+        http_mark(&hs->t_first_byte);
+    } else {
+        /* Fall back to static HTML page */
+        char header[256];
+        int len = 0;
+
+        memcpy(header + len, http_ok, sizeof(http_ok) - 1);
+        len += sizeof(http_ok) - 1;
+        len += int_to_str(header + len, sizeof(html_page) - 1);
+        header[len++] = '\r';
+        header[len++] = '\n';
+        header[len++] = '\r';
+        header[len++] = '\n';
+
+        http_cork(pcb);
+        http_write(pcb, header, len);
+        hs->sent_headers = 1;
+
+        if (!head) {
+            http_write(pcb, html_page, sizeof(html_page) - 1);
             hs->sent_body = 1;
+        }
+        http_count_status(200);
+        http_response_queued(hs);
+
+        http_end(pcb);
+    }
+}
+
+/* OPTIONS: which methods the path takes */
+static void http_options(struct http_state *hs, struct tcp_pcb *pcb, struct pbuf *p, int head) {
+    char path[HTTP_PATH_SIZE];
+    if (parse_url_path((const char *)p->payload, p->len, path, HTTP_PATH_SIZE) != 0) {
+        path[0] = '\0';
+    }
+    pbuf_free(p);
+
+    hs->sent_headers = 1;
+    http_send_allow(pcb, 204, http_allowed(path), head);
+    http_response_queued(hs);
+}
+
+/* Any method not in the table */
+static void http_not_allowed(struct http_state *hs, struct tcp_pcb *pcb, struct pbuf *p, int head) {
+    char path[HTTP_PATH_SIZE];
+    if (parse_url_path((const char *)p->payload, p->len, path, HTTP_PATH_SIZE) != 0) {
+        path[0] = '\0';
+    }
+    pbuf_free(p);
+
+    hs->sent_headers = 1;
+    http_send_allow(pcb, 405, http_allowed(path), head);
+    http_response_queued(hs);
+}
+
+/* Request bodies (PUT, POST) are written to a temporary file as they
+ * arrive and renamed over the destination once complete, so readers
+ * never see a partial file and no body is held in RAM. Received data
+ * is only acknowledged (tcp_recved) once it has been written: whatever
+ * waits in the connection's buffer keeps the client's window smaller,
+ * so a slow disk slows the sender down rather than piling up pbufs. */
+enum {
+    BODY_DATA,                  /* body_left bytes of data */
+    BODY_CHUNK_SIZE,            /* Hex chunk size */
+    BODY_CHUNK_EXT,             /* Chunk extension, to the end of the line */
+    BODY_CHUNK_END,             /* CRLF after a chunk's data */
+    BODY_TRAILER,               /* Start of a trailer line, or the final CRLF */
+    BODY_TRAILER_LINE,          /* Rest of a trailer line */
+    BODY_DONE
+};
+
+static uint32_t upload_seq;
+
+static int http_upload_flush(struct http_state *hs) {
+    if (hs->buf_used == 0) return 0;
+    if (fs_write(hs->file, hs->buf, hs->buf_used) != hs->buf_used) return -1;
+    hs->buf_used = 0;
+    return 0;
+}
 
-            tcp_output(pcb);
-            tcp_close(pcb);
+/* Acknowledge everything received except the data still in buf */
+static void http_upload_ack(struct http_state *hs, struct tcp_pcb *pcb) {
+    uint32_t n = hs->unacked - hs->buf_used;
+    hs->unacked = hs->buf_used;
+    while (n > 0) {
+        u16_t k = n > 0xffff ? 0xffff : (u16_t)n;
+        tcp_recved(pcb, k);
+        n -= k;
+    }
+}
+
+/* Drop the temporary file of an upload that will not complete. What
+ * buf holds is dropped too, and everything received is acknowledged:
+ * closing with data unacknowledged sends a RST. pcb is NULL once the
+ * connection is gone. */
+static void http_upload_abort(struct http_state *hs, struct tcp_pcb *pcb) {
+    if (!hs->upload) return;
+    hs->buf_used = 0;
+    if (pcb != NULL) {
+        http_upload_ack(hs, pcb);
+    }
+    if (hs->file != FS_INVALID_FILE) {
+        fs_close(hs->file);
+        hs->file = FS_INVALID_FILE;
+    }
+    fs_remove(hs->tmp_path);
+    hs->upload = 0;
+}
+
+/* Drain polls: tcp_poll() interval in TCP slow timer ticks (500 ms),
+ * and how many may pass without data before the peer is given up on */
+#define HTTP_DRAIN_INTERVAL 4
+#define HTTP_DRAIN_POLLS 5
+
+static err_t http_drain_poll(void *arg, struct tcp_pcb *pcb) {
+    struct http_state *hs = (struct http_state*)arg;
+    if (hs == NULL || hs->drain == 0) return ERR_OK;
+    if (--hs->drain == 0) {
+        /* http_err() frees hs */
+        tcp_abort(pcb);
+        return ERR_ABRT;
+    }
+    return ERR_OK;
+}
+
+/* About to answer before the whole body is read (an error). The
+ * response still has to reach the client, which may be sending the
+ * rest of the body: http_end() then half-closes, and http_recv()
+ * acknowledges and drops what comes until the client's FIN. */
+static void http_drain(struct http_state *hs, struct tcp_pcb *pcb) {
+    http_upload_abort(hs, pcb);
+    hs->sent_headers = 1;
+    hs->drain = HTTP_DRAIN_POLLS;
+    tcp_poll(pcb, http_drain_poll, HTTP_DRAIN_INTERVAL);
+}
+
+/* Take len body bytes. Returns 0, or the status to fail the upload with
+ * for a malformed chunked body or a failed write. */
+static int http_upload_feed(struct http_state *hs, const uint8_t *data, int len) {
+    while (len > 0 && hs->body_state != BODY_DONE) {
+        if (hs->body_state == BODY_DATA) {
+            int n = HTTP_BUF_SIZE - hs->buf_used;
+            if (n > len) n = len;
+            if (n > hs->body_left) n = (int)hs->body_left;
+            memcpy(hs->buf + hs->buf_used, data, n);
+            hs->buf_used += n;
+            hs->body_left -= n;
+            hs->body_bytes += n;
+            data += n;
+            len -= n;
+
+            if (hs->buf_used == HTTP_BUF_SIZE && http_upload_flush(hs) != 0) {
+                return 507;
+            }
+            if (hs->body_left == 0) {
+                hs->body_state = hs->chunked ? BODY_CHUNK_END : BODY_DONE;
+            }
+            continue;
+        }
+
+        char c = (char)*data++;
+        len--;
+        switch (hs->body_state) {
+        case BODY_CHUNK_SIZE:
+        case BODY_CHUNK_EXT:
+            if (c == '\n') {
+                hs->body_state = hs->body_left ? BODY_DATA : BODY_TRAILER;
+            } else if (c == '\r' || hs->body_state == BODY_CHUNK_EXT) {
+                /* Skipped */
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                hs->body_state = BODY_CHUNK_EXT;
+            } else {
+                int v = (c >= '0' && c <= '9') ? c - '0' :
+                        (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+                        (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+                if (v < 0 || hs->body_left > (INT64_MAX >> 4)) return 400;
+                hs->body_left = hs->body_left * 16 + v;
+            }
+            break;
+        case BODY_CHUNK_END:
+            if (c == '\n') {
+                hs->body_state = BODY_CHUNK_SIZE;
+            } else if (c != '\r') {
+                return 400;
+            }
+            break;
+        case BODY_TRAILER:
+            if (c == '\n') {
+                hs->body_state = BODY_DONE;
+            } else if (c != '\r') {
+                hs->body_state = BODY_TRAILER_LINE;
+            }
+            break;
+        case BODY_TRAILER_LINE:
+            if (c == '\n') hs->body_state = BODY_TRAILER;
+            break;
         }
-    } else if (!is_get) {
+    }
+    return 0;
+}
+
+/* Body is complete and written: put it in place */
+static void http_upload_finish(struct http_state *hs, struct tcp_pcb *pcb) {
+    fs_close(hs->file);
+    hs->file = FS_INVALID_FILE;
+    hs->upload = 0;
+    hs->sent_headers = 1;
+
+    int64_t old_mtime = fs_stat_mtime(hs->path);
+    int replace = fs_exists(hs->path);
+
+    /* The old file waits here until the new one is in place */
+    char backup[sizeof(hs->tmp_path) + 4];
+    snprintf(backup, sizeof(backup), "%s-old", hs->tmp_path);
+    fs_remove(backup);
+
+    int r = fs_rename(hs->tmp_path, hs->path, backup);
+    if (r != 0) {
+        if (r == -1) {
+            fs_remove(hs->tmp_path);
+        } else {
+            /* Neither file is at the path now; keep both */
+            console_printf("  -> %s lost: old file at %s, upload at %s\n",
+                           hs->path, backup, hs->tmp_path);
+        }
+        if (replace) {
+            http_send_status(pcb, 500, "Internal Server Error", "Cannot replace the file\n");
+        } else {
+            http_send_status(pcb, 409, "Conflict", "Cannot store at this path\n");
+        }
+        http_response_queued(hs);
+        return;
+    }
+
+    /* There is no clock to stamp it with. Moving the old mtime on keeps
+     * the ETag from matching the old content when the size is the same. */
+    if (old_mtime >= 0) {
+        fs_set_mtime(hs->path, old_mtime + 1);
+    }
+
+    console_printf("  -> Stored %lld bytes\n", (long long)hs->body_bytes);
+    if (old_mtime >= 0) {
+        http_send_status(pcb, 200, "OK", "Replaced\n");
+    } else {
+        http_send_status(pcb, 201, "Created", "Created\n");
+    }
+    http_response_queued(hs);
+}
+
+/* Body data of an upload in progress, from offset bytes into p. Frees p. */
+static void http_upload_recv(struct http_state *hs, struct tcp_pcb *pcb, struct pbuf *p, u16_t offset) {
+    int status = 0;
+
+    hs->unacked += p->tot_len;
+    for (struct pbuf *q = p; q != NULL && status == 0; q = q->next) {
+        if (offset >= q->len) {
+            offset -= q->len;
+            continue;
+        }
+        status = http_upload_feed(hs, (const uint8_t *)q->payload + offset, q->len - offset);
+        offset = 0;
+    }
+    pbuf_free(p);
+
+    if (status == 0 && hs->body_state == BODY_DONE && http_upload_flush(hs) != 0) {
+        status = 507;
+    }
+    http_upload_ack(hs, pcb);
+
+    if (status != 0) {
+        http_drain(hs, pcb);
+        if (status == 507) {
+            http_send_status(pcb, 507, "Insufficient Storage", "Write failed\n");
+        } else {
+            http_send_status(pcb, 400, "Bad Request", "Malformed chunked body\n");
+        }
+        http_response_queued(hs);
+    } else if (hs->body_state == BODY_DONE) {
+        http_upload_finish(hs, pcb);
+    }
+}
+
+/* Refuse an upload before any of its body is taken; a body sent
+ * without waiting for 100 Continue is drained. Frees p. */
+static void http_upload_reject(struct http_state *hs, struct tcp_pcb *pcb, struct pbuf *p,
+                               int status, const char *reason, const char *body) {
+    tcp_recved(pcb, p->tot_len);
+    pbuf_free(p);
+    http_drain(hs, pcb);
+    http_send_status(pcb, status, reason, body);
+    http_response_queued(hs);
+}
+
+/* PUT and POST: store the request body at the path. Frees p. */
+static void http_upload(struct http_state *hs, struct tcp_pcb *pcb, struct pbuf *p, int head) {
+    /* The headers have to be in the first segment. They are copied out
+     * of the pbuf chain so they can be parsed in one piece. */
+    u16_t end = pbuf_memfind(p, "\r\n\r\n", 4, 0);
+    if (end == 0xffff || end + 4 > HTTP_BUF_SIZE) {
+        http_upload_reject(hs, pcb, p, 400, "Bad Request", "Headers not in the first segment\n");
+        return;
+    }
+    u16_t hdr_len = end + 4;
+    char *req = (char *)hs->buf;
+    pbuf_copy_partial(p, req, hdr_len, 0);
+
+    if (parse_url_path(req, hdr_len, hs->path, HTTP_PATH_SIZE) != 0) {
+        http_upload_reject(hs, pcb, p, 400, "Bad Request", "Bad request line\n");
+        return;
+    }
+    http_mark(&hs->t_request);
+    console_printf("HTTP upload: %s\n", hs->path);
+
+    if (strncmp(hs->path, "/__", 3) == 0) {
+        tcp_recved(pcb, p->tot_len);
         pbuf_free(p);
-        /* Send 404 for non-GET requests */
-        tcp_write(pcb, http_404, sizeof(http_404) - 1, TCP_WRITE_FLAG_COPY);
+        http_drain(hs, pcb);
+        http_send_allow(pcb, 405, http_allowed(hs->path), 0);
+        http_response_queued(hs);
+        return;
+    }
+    if (http_reserved_path(hs->path)) {
+        http_upload_reject(hs, pcb, p, 403, "Forbidden", "Reserved name\n");
+        return;
+    }
+
+    char value[32];
+    int64_t length = -1;
+    hs->chunked = 0;
+    if (get_header(req, hdr_len, "Transfer-Encoding", value, sizeof(value)) > 0) {
+        if (strstr(value, "chunked") == NULL) {
+            http_upload_reject(hs, pcb, p, 501, "Not Implemented", "Only chunked transfer coding\n");
+            return;
+        }
+        hs->chunked = 1;
+    } else if (get_header(req, hdr_len, "Content-Length", value, sizeof(value)) > 0) {
+        length = 0;
+        for (const char *c = value; *c; c++) {
+            if (*c < '0' || *c > '9' || length > (INT64_MAX - 9) / 10) {
+                length = -1;
+                break;
+            }
+            length = length * 10 + (*c - '0');
+        }
+    }
+    if (!hs->chunked && length < 0) {
+        http_upload_reject(hs, pcb, p, 411, "Length Required", "Content-Length or chunked body required\n");
+        return;
+    }
+    int expect_continue = get_header(req, hdr_len, "Expect", value, sizeof(value)) > 0 &&
+                          (value[0] == '1');
+
+    http_mount_fs();
+    if (!fs_mounted()) {
+        http_upload_reject(hs, pcb, p, 503, "Service Unavailable", "No filesystem\n");
+        return;
+    }
+
+    snprintf(hs->tmp_path, sizeof(hs->tmp_path), "/" HTTP_UPLOAD_PREFIX "%u", upload_seq++);
+    hs->file = fs_open(hs->tmp_path, FS_O_WRONLY | FS_O_CREAT | FS_O_TRUNC);
+    if (hs->file == FS_INVALID_FILE) {
+        http_upload_reject(hs, pcb, p, 503, "Service Unavailable", "Cannot create a file\n");
+        return;
+    }
+    http_mark(&hs->t_open);
+
+    if (expect_continue) {
+        static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        http_write(pcb, cont, sizeof(cont) - 1);
         tcp_output(pcb);
+    }
+
+    hs->upload = 1;
+    hs->body_state = hs->chunked ? BODY_CHUNK_SIZE : (length > 0 ? BODY_DATA : BODY_DONE);
+    hs->body_left = hs->chunked ? 0 : length;
+    hs->body_bytes = 0;
+    hs->buf_used = 0;
+    hs->unacked = 0;
+    http_upload_recv(hs, pcb, p, hdr_len);
+}
+
+/* POST: a diagnostic action, or else an upload like PUT. Frees p. */
+static void http_post(struct http_state *hs, struct tcp_pcb *pcb, struct pbuf *p, int head) {
+    char path[HTTP_PATH_SIZE];
+    const struct http_action *a = NULL;
+    if (parse_url_path((const char *)p->payload, p->len, path, HTTP_PATH_SIZE) == 0) {
+        a = http_find_action(path);
+    }
+    if (a == NULL) {
+        http_upload(hs, pcb, p, head);
+        return;
+    }
+
+    console_printf("HTTP POST: %s\n", path);
+    tcp_recved(pcb, p->tot_len);
+    pbuf_free(p);
+    /* Any body is of no use; read and drop it */
+    http_drain(hs, pcb);
+    int n = a->run((char *)hs->buf, HTTP_BUF_SIZE);
+    http_send_text(pcb, "text/plain", (const char *)hs->buf, n);
+}
+
+/* Request methods, matched against the start of the request */
+struct http_method {
+    const char *token;          /* Name and the space after it */
+    int len;
+    void (*handler)(struct http_state *hs, struct tcp_pcb *pcb, struct pbuf *p, int head);
+    int head;                   /* Passed to the handler: headers only */
+    int body;                   /* Takes a body, and calls tcp_recved itself */
+};
+
+static const struct http_method http_methods[] = {
+    {"GET ", 4, http_serve, 0, 0},
+    {"HEAD ", 5, http_serve, 1, 0},
+    {"OPTIONS ", 8, http_options, 0, 0},
+    {"PUT ", 4, http_upload, 0, 1},
+    {"POST ", 5, http_post, 0, 1},
+};
+
+static const struct http_method http_method_other = {"", 0, http_not_allowed, 0, 0};
+
+static const struct http_method *http_find_method(const char *req, int len) {
+    for (size_t i = 0; i < sizeof(http_methods) / sizeof(http_methods[0]); i++) {
+        const struct http_method *m = &http_methods[i];
+        if (len >= m->len && memcmp(req, m->token, m->len) == 0) {
+            return m;
+        }
+    }
+    return &http_method_other;
+}
+
+/* TCP receive callback */
+static err_t http_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err) {
+    struct http_state *hs = (struct http_state*)arg;
+    PROF_REGION(PROF_HTTP_RECV);
+
+    if (p == NULL) {
+        /* Connection closed by remote, perhaps in the middle of a body */
+        if (hs) {
+            http_upload_abort(hs, pcb);
+        }
+        if (hs && hs->file != FS_INVALID_FILE) {
+            fs_close(hs->file);
+        }
+        /* No callbacks may see hs once it is freed */
+        tcp_arg(pcb, NULL);
         tcp_close(pcb);
-    } else {
+        if (hs) {
+            http_record_phases(hs, NULL);
+            http_stream_release(hs);
+            free(hs);
+            http_stats.active--;
+        }
+        return ERR_OK;
+    }
+
+    if (hs->upload) {
+        http_upload_recv(hs, pcb, p, 0);
+        return ERR_OK;
+    }
+
+    if (hs->sent_headers) {
+        /* Only the first segment of a request is looked at */
+        if (hs->drain) {
+            hs->drain = HTTP_DRAIN_POLLS;
+        }
+        tcp_recved(pcb, p->tot_len);
         pbuf_free(p);
+        return ERR_OK;
     }
 
+    const struct http_method *m = http_find_method((const char *)p->payload, p->len);
+    if (!m->body) {
+        /* Acknowledge received data */
+        tcp_recved(pcb, p->tot_len);
+    }
+    m->handler(hs, pcb, p, m->head);
     return ERR_OK;
 }
 
@@ -367,11 +2099,15 @@ static void http_err(void *arg, err_t err) {
     struct http_state *hs = (struct http_state*)arg;
     (void)err;
     if (hs) {
+        http_upload_abort(hs, NULL);
         if (hs->file != FS_INVALID_FILE) {
             fs_close(hs->file);
         }
+        http_stream_release(hs);
         free(hs);
+        http_stats.active--;
     }
+    http_stats.aborted++;
 }
 
 /* TCP accept callback */
@@ -382,21 +2118,27 @@ static err_t http_accept(void *arg, struct tcp_pcb *newpcb, err_t err) {
     struct http_state *hs = (struct http_state*)calloc(1, sizeof(struct http_state));
     if (hs == NULL) {
         tcp_abort(newpcb);
+        http_stats.aborted++;
         return ERR_MEM;
     }
 
     hs->file = FS_INVALID_FILE;
+    hs->t_accept = timer_ticks();
 
     tcp_arg(newpcb, hs);
     tcp_recv(newpcb, http_recv);
+    tcp_sent(newpcb, http_sent);
     tcp_err(newpcb, http_err);
 
+    http_stats.accepted++;
+    http_stats.active++;
+
     console_printf("HTTP: new connection\n");
     return ERR_OK;
 }
 
 /* Initialize HTTP server */
-static void http_server_init(void) {
+void http_server_init(void) {
     struct tcp_pcb *pcb;
 
     pcb = tcp_new();
@@ -421,20 +2163,8 @@ static void http_server_init(void) {
     console_printf("HTTP server listening on port 80\n");
 }
 
-/* HTIF exit */
-extern volatile uint64_t tohost;
-extern volatile uint64_t fromhost;
-
-static void htif_exit(int code) {
-    while (tohost) {
-        fromhost = 0;
-    }
-    tohost = (code << 1) | 1;
-    while (1);
-}
-
-/* Main entry point */
-int main(void) {
+/* Bring everything up in order, timing each phase */
+int http_boot(void) {
     console_init();
     console_printf("\n");
     console_printf("========================================\n");
@@ -444,60 +2174,65 @@ int main(void) {
 
     /* Initialize heap */
     heap_init();
+    boot_phase_done(BOOT_HEAP);
     console_printf("[OK] Heap initialized\n");
 
     /* Initialize timer */
     timer_init();
+    boot_phase_done(BOOT_TIMER);
     console_printf("[OK] Timer initialized\n");
 
     /* Initialize PLIC */
     plic_init();
+    boot_phase_done(BOOT_PLIC);
     console_printf("[OK] PLIC initialized\n");
 
     /* Initialize lwIP */
     lwip_init();
+    boot_phase_done(BOOT_LWIP);
     console_printf("[OK] lwIP initialized\n");
 
     /* Initialize network interface */
     struct netif *netif = virtio_net_init();
     if (netif == NULL) {
         console_printf("[FAIL] Network init failed\n");
-        htif_exit(1);
+        return -1;
     }
+    boot_phase_done(BOOT_NET);
     console_printf("[OK] Network interface ready\n");
 
-    /* Initialize filesystem (optional - will work without disk) */
-    if (fs_init() == 0) {
-        console_printf("[OK] Filesystem mounted (ext4)\n");
-    } else {
-        console_printf("[--] No disk or filesystem not available\n");
-        console_printf("     (Will serve static HTML only)\n");
-    }
-
-    /* Start HTTP server */
+    /* Start HTTP server. The filesystem (optional - will work without
+     * disk) is mounted later, see http_mount_fs(). */
     http_server_init();
+    boot_phase_done(BOOT_LISTEN);
+
+    console_printf("Boot (us):");
+    for (int i = 0; i < BOOT_PHASES; i++) {
+        console_printf(" %s %lu", boot_names[i], (unsigned long)ticks_to_us(boot_time.phase[i]));
+    }
+    console_printf(", listening at %lu\n", (unsigned long)ticks_to_us(boot_time.last));
 
     console_printf("\n");
     console_printf("System ready! Access http://localhost:8080 from host.\n");
     console_printf("Entering main loop...\n");
     console_printf("\n");
 
-    /* Main loop */
-    uint32_t last_time = 0;
-    while (1) {
-        /* Poll for network activity */
-        virtio_net_poll();
+#ifdef PROFILE
+    prof_init();
+    console_printf("[OK] Profiling enabled, see /__prof\n");
+#endif
 
-        /* Handle lwIP timers */
-        sys_check_timeouts();
+    return 0;
+}
 
-        /* Periodic status (every 10 seconds) */
-        uint32_t now = sys_now();
-        if (now - last_time >= 10000) {
-            console_printf("Uptime: %u seconds\n", now / 1000);
-            last_time = now;
-        }
+/* Status used to be printed from the main loop every 10 seconds; it is
+ * now served on demand as JSON from /__stats. */
+void http_poll(void) {
+    /* Poll for network activity; mount the disk in the first lull */
+    if (!virtio_net_poll()) {
+        http_mount_fs();
     }
 
-    return 0;
+    /* Handle lwIP timers */
+    sys_check_timeouts();
 }
@@ -0,0 +1,205 @@
+/*
+ * prof.c - Per-region cycle accounting and timer-driven PC sampling
+ *
+ * Only built into the firmware when PROFILE is defined (make PROFILE=1).
+ */
+
+#ifdef PROFILE
+
+#include "prof.h"
+#include "platform.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef PROFILE_HZ
+#define PROFILE_HZ 0
+#endif
+
+#define PROF_HIST_BUCKETS 32        /* Bucket b counts calls of 2^b..2^(b+1)-1 cycles */
+#define PROF_PC_SLOTS 1024          /* Power of two */
+
+struct prof_stats {
+    uint64_t calls;
+    uint64_t cycles;
+    uint64_t instret;
+    uint64_t max_cycles;
+    uint32_t hist[PROF_HIST_BUCKETS];
+};
+
+struct prof_pc {
+    uint64_t pc;
+    uint32_t count;
+};
+
+static const char *const region_names[PROF_NUM_REGIONS] = {
+    [PROF_NET_INPUT] = "net_input",
+    [PROF_NET_OUTPUT] = "net_output",
+    [PROF_HTTP_RECV] = "http_recv",
+    [PROF_HTTP_SENT] = "http_sent",
+    [PROF_FS_READ] = "fs_read",
+    [PROF_BLK_REQUEST] = "blk_request",
+    [PROF_MALLOC] = "malloc",
+    [PROF_FREE] = "free",
+    [PROF_CHECKSUM] = "checksum",
+};
+
+static struct prof_stats regions[PROF_NUM_REGIONS];
+
+/* Written from the timer interrupt only */
+static struct prof_pc pcs[PROF_PC_SLOTS];
+static uint64_t samples;
+static uint64_t samples_dropped;
+
+static int log2_bucket(uint64_t v) {
+    int b = 0;
+    while (v >>= 1) b++;
+    return b < PROF_HIST_BUCKETS ? b : PROF_HIST_BUCKETS - 1;
+}
+
+void prof_end(struct prof_mark *m) {
+    uint64_t cycles = read_mcycle() - m->cycle;
+    uint64_t instret = read_minstret() - m->instret;
+    struct prof_stats *s = &regions[m->region];
+
+    s->calls++;
+    s->cycles += cycles;
+    s->instret += instret;
+    if (cycles > s->max_cycles) s->max_cycles = cycles;
+    s->hist[log2_bucket(cycles)]++;
+}
+
+/* lwIP computes every checksum through LWIP_CHKSUM, which lwipopts.h
+ * points here when profiling */
+unsigned short lwip_standard_chksum(const void *dataptr, int len);
+
+unsigned short prof_chksum(const void *dataptr, int len) {
+    PROF_REGION(PROF_CHECKSUM);
+    return lwip_standard_chksum(dataptr, len);
+}
+
+#if PROFILE_HZ > 0
+static inline void arm_sample_timer(void) {
+    MMIO_WRITE64(CLINT_MTIMECMP, MMIO_READ64(CLINT_MTIME) + TIMER_FREQ / PROFILE_HZ);
+}
+#endif
+
+void prof_sample(uint64_t pc) {
+#if PROFILE_HZ > 0
+    uint32_t slot = (uint32_t)((pc >> 1) * 2654435761u) & (PROF_PC_SLOTS - 1);
+
+    samples++;
+    for (int i = 0; i < PROF_PC_SLOTS; i++) {
+        struct prof_pc *e = &pcs[(slot + i) & (PROF_PC_SLOTS - 1)];
+        if (e->count == 0) {
+            e->pc = pc;
+            e->count = 1;
+            break;
+        }
+        if (e->pc == pc) {
+            e->count++;
+            break;
+        }
+        if (i == PROF_PC_SLOTS - 1) {
+            samples_dropped++;
+        }
+    }
+
+    /* Re-arm from now rather than from the last deadline, so a slow
+     * handler can never leave the timer permanently pending */
+    arm_sample_timer();
+#else
+    (void)pc;
+#endif
+}
+
+void prof_init(void) {
+#if PROFILE_HZ > 0
+    arm_sample_timer();
+
+    /* The rest of the firmware polls and has never taken an interrupt;
+     * keep it that way and let only the sampling timer through */
+    __asm__ volatile("csrc mie, %0" :: "r"(1UL << 11));
+    __asm__ volatile("csrs mie, %0" :: "r"(1UL << 7));
+    __asm__ volatile("csrs mstatus, %0" :: "r"(1UL << 3));
+#endif
+}
+
+void prof_reset(void) {
+    memset(regions, 0, sizeof(regions));
+    memset(pcs, 0, sizeof(pcs));
+    samples = 0;
+    samples_dropped = 0;
+}
+
+int prof_report_regions(char *buf, int size) {
+    int len = snprintf(buf, size, "region         calls        cycles       instret    avg_cycles    max_cycles\n");
+
+    for (int r = 0; r < PROF_NUM_REGIONS && len < size - 1; r++) {
+        const struct prof_stats *s = &regions[r];
+        int name_len = strlen(region_names[r]);
+
+        len += snprintf(buf + len, size - len, "%s", region_names[r]);
+        for (int i = name_len; i < 12 && len < size - 1; i++) {
+            buf[len++] = ' ';
+        }
+        buf[len] = '\0';
+        len += snprintf(buf + len, size - len, "%8lu %13lu %13lu %13lu %13lu\n",
+                        (unsigned long)s->calls, (unsigned long)s->cycles,
+                        (unsigned long)s->instret,
+                        (unsigned long)(s->calls ? s->cycles / s->calls : 0),
+                        (unsigned long)s->max_cycles);
+    }
+
+    /* Histograms: "log2(cycles):calls" for each non-empty bucket */
+    for (int r = 0; r < PROF_NUM_REGIONS && len < size - 1; r++) {
+        const struct prof_stats *s = &regions[r];
+        if (s->calls == 0) continue;
+
+        len += snprintf(buf + len, size - len, "\nhist %s", region_names[r]);
+        for (int b = 0; b < PROF_HIST_BUCKETS && len < size - 1; b++) {
+            if (s->hist[b]) {
+                len += snprintf(buf + len, size - len, " %d:%u", b, s->hist[b]);
+            }
+        }
+    }
+    if (len < size - 1) {
+        buf[len++] = '\n';
+        buf[len] = '\0';
+    }
+
+    return len;
+}
+
+/* Busiest sampled addresses first, as many as fit */
+int prof_report_pcs(char *buf, int size) {
+    int len = snprintf(buf, size, "hz %d samples %lu dropped %lu\n",
+                       PROFILE_HZ, (unsigned long)samples, (unsigned long)samples_dropped);
+
+    /* Repeated selection is quadratic but needs no extra memory, and
+     * the output is capped at a few hundred lines anyway */
+    uint32_t prev_count = UINT32_MAX;
+    uint64_t prev_pc = 0;
+    while (len < size - 24) {
+        const struct prof_pc *best = NULL;
+        for (int i = 0; i < PROF_PC_SLOTS; i++) {
+            const struct prof_pc *e = &pcs[i];
+            if (e->count == 0) continue;
+            /* Order by count descending, then address ascending */
+            if (e->count > prev_count || (e->count == prev_count && e->pc <= prev_pc)) continue;
+            if (!best || e->count > best->count ||
+                (e->count == best->count && e->pc < best->pc)) {
+                best = e;
+            }
+        }
+        if (!best) break;
+
+        len += snprintf(buf + len, size - len, "%lx %u\n", (unsigned long)best->pc, best->count);
+        prev_count = best->count;
+        prev_pc = best->pc;
+    }
+
+    return len;
+}
+
+#endif /* PROFILE */
@@ -0,0 +1,96 @@
+#ifndef PROF_H
+#define PROF_H
+
+/*
+ * prof.h - Cycle accounting for hot regions and a PC sampler
+ *
+ * Build with "make PROFILE=1" to compile the probes in. Each probed
+ * function opens a region with PROF_REGION(); mcycle and minstret are
+ * read on entry and again when the function returns (whichever return
+ * it takes), and the difference goes into that region's totals and a
+ * log2 histogram of cycles per call. Regions are inclusive: time spent
+ * in fs_read is also counted in the http_sent call that made it.
+ *
+ * "make PROFILE=1 PROFILE_HZ=N" additionally samples mepc from the
+ * machine timer interrupt N times per second of mtime. The counts are
+ * reported by address; scripts/prof_resolve.sh maps them onto function
+ * names from firmware.dump.
+ *
+ * Without PROFILE every probe compiles to nothing.
+ */
+
+#include <stdint.h>
+
+/* Retired instructions and cycles since reset (always 0 in the
+ * host-native build, which has no access to the counters) */
+#if defined(__riscv)
+static inline uint64_t read_minstret(void) {
+    uint64_t val;
+    __asm__ volatile("csrr %0, minstret" : "=r"(val));
+    return val;
+}
+
+static inline uint64_t read_mcycle(void) {
+    uint64_t val;
+    __asm__ volatile("csrr %0, mcycle" : "=r"(val));
+    return val;
+}
+#else
+static inline uint64_t read_minstret(void) { return 0; }
+static inline uint64_t read_mcycle(void) { return 0; }
+#endif
+
+enum prof_region {
+    PROF_NET_INPUT,
+    PROF_NET_OUTPUT,
+    PROF_HTTP_RECV,
+    PROF_HTTP_SENT,
+    PROF_FS_READ,
+    PROF_BLK_REQUEST,
+    PROF_MALLOC,
+    PROF_FREE,
+    PROF_CHECKSUM,
+    PROF_NUM_REGIONS
+};
+
+#ifdef PROFILE
+
+struct prof_mark {
+    int region;
+    uint64_t cycle;
+    uint64_t instret;
+};
+
+static inline struct prof_mark prof_begin(int region) {
+    struct prof_mark m;
+    m.region = region;
+    m.instret = read_minstret();
+    m.cycle = read_mcycle();
+    return m;
+}
+
+void prof_end(struct prof_mark *m);
+
+/* Runs prof_end() when the enclosing scope is left */
+#define PROF_REGION(r) \
+    struct prof_mark prof_mark_ __attribute__((cleanup(prof_end), unused)) = prof_begin(r)
+
+void prof_init(void);
+void prof_reset(void);
+void prof_sample(uint64_t pc);
+
+/* Text reports for the /__prof and /__prof/pcs endpoints. Output is cut
+ * short rather than overflowing buf; returns the length written. */
+int prof_report_regions(char *buf, int size);
+int prof_report_pcs(char *buf, int size);
+
+#else
+
+#define PROF_REGION(r) do { } while (0)
+
+static inline void prof_init(void) { }
+static inline void prof_sample(uint64_t pc) { (void)pc; }
+
+#endif /* PROFILE */
+
+#endif /* PROF_H */
@@ -0,0 +1,235 @@
+/*
+ * snapshot.c - Save and restore the mounted filesystem state
+ *
+ * Only built into the firmware when SNAPSHOT is defined (make SNAPSHOT=1).
+ *
+ * The snapshot takes the last sectors of the disk: a header sector, then
+ * the snapshot region byte for byte. The filesystem has to end before
+ * them, e.g. "mkfs.ext4 disk.img 15M" on a 16 MB image; saving refuses
+ * to write over a filesystem that does not.
+ */
+
+#ifdef SNAPSHOT
+
+#include "snapshot.h"
+#include "virtio_blk.h"
+#include "fs.h"
+#include "heap.h"
+#include "console.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SNAPSHOT_MAGIC   0x4d524157     /* "WARM" */
+#define SNAPSHOT_VERSION 1              /* Bump when the header changes */
+#define SECTOR_SIZE      512
+#define BUILD_ID_SIZE    32
+
+extern char __warm_start[];
+extern char __warm_end[];
+extern char __build_id_start[];
+extern char __build_id_end[];
+
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t region_start;      /* __warm_start and its size when saved */
+    uint64_t region_size;
+    uint64_t capacity;          /* Disk size in sectors */
+    uint32_t region_crc;
+    uint32_t sblock_crc;        /* The ext4 superblock on disk when saved */
+    uint8_t build_id[BUILD_ID_SIZE];
+    uint32_t header_crc;        /* Of everything above */
+};
+
+static uint8_t sector_buf[2 * SECTOR_SIZE];
+
+/* 1 while the disk holds a snapshot header, so the first write through
+ * lwext4 knows to discard it */
+static int snapshot_live;
+
+/* CRC-32 (IEEE), four bits at a time */
+static uint32_t crc32(uint32_t crc, const void *data, size_t len) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+    const uint8_t *p = data;
+
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ table[crc & 15];
+        crc = (crc >> 4) ^ table[crc & 15];
+    }
+    return ~crc;
+}
+
+static uint64_t region_size(void) {
+    return (uint64_t)(__warm_end - __warm_start);
+}
+
+/* First sector of the snapshot area, or 0 if the disk is too small */
+static uint64_t snapshot_lba(void) {
+    uint64_t sectors = 1 + region_size() / SECTOR_SIZE;
+    uint64_t capacity = virtio_blk_capacity();
+    return capacity > sectors ? capacity - sectors : 0;
+}
+
+/* The descriptor of the ELF build-id note, zero padded */
+static void build_id(uint8_t *out) {
+    memset(out, 0, BUILD_ID_SIZE);
+    if (__build_id_end - __build_id_start < 12) return;
+
+    const uint32_t *note = (const uint32_t *)__build_id_start;
+    uint32_t namesz = note[0];
+    uint32_t descsz = note[1];
+    const char *desc = __build_id_start + 12 + ((namesz + 3) & ~3u);
+    if (descsz > BUILD_ID_SIZE) descsz = BUILD_ID_SIZE;
+    if (desc + descsz <= __build_id_end) {
+        memcpy(out, desc, descsz);
+    }
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Checksum of the ext4 superblock (bytes 1024-2047) as it is on disk,
+ * and how many bytes of the disk the filesystem covers */
+static int read_sblock(uint32_t *crc, uint64_t *fs_bytes) {
+    if (virtio_blk_read(2, sector_buf, 2) != 0) {
+        return -1;
+    }
+
+    uint64_t blocks = le32(sector_buf + 0x04);
+    if (le32(sector_buf + 0x60) & 0x80) {       /* INCOMPAT_64BIT */
+        blocks |= (uint64_t)le32(sector_buf + 0x150) << 32;
+    }
+    *fs_bytes = blocks << (10 + le32(sector_buf + 0x18));
+    *crc = crc32(0, sector_buf, 2 * SECTOR_SIZE);
+    return 0;
+}
+
+static int write_header(const struct snapshot_header *h, uint64_t lba) {
+    memset(sector_buf, 0, SECTOR_SIZE);
+    if (h != NULL) {
+        memcpy(sector_buf, h, sizeof(*h));
+    }
+    return virtio_blk_write(lba, sector_buf, 1);
+}
+
+int snapshot_save(void) {
+    if (!fs_mounted()) {
+        console_printf("snapshot: filesystem not mounted\n");
+        return -1;
+    }
+
+    uint64_t lba = snapshot_lba();
+    struct snapshot_header h;
+    uint64_t fs_bytes;
+    memset(&h, 0, sizeof(h));
+    if (lba == 0 || read_sblock(&h.sblock_crc, &fs_bytes) != 0) {
+        console_printf("snapshot: disk too small or unreadable\n");
+        return -1;
+    }
+    if (fs_bytes > lba * SECTOR_SIZE) {
+        console_printf("snapshot: filesystem covers the last %lu sectors, not saving\n",
+                       (unsigned long)(virtio_blk_capacity() - lba));
+        return -1;
+    }
+
+    h.magic = SNAPSHOT_MAGIC;
+    h.version = SNAPSHOT_VERSION;
+    h.region_start = (uint64_t)(uintptr_t)__warm_start;
+    h.region_size = region_size();
+    h.capacity = virtio_blk_capacity();
+    h.region_crc = crc32(0, __warm_start, h.region_size);
+    build_id(h.build_id);
+    h.header_crc = crc32(0, &h, offsetof(struct snapshot_header, header_crc));
+
+    /* The header goes last, so a save cut short leaves no snapshot */
+    if (write_header(NULL, lba) != 0 ||
+        virtio_blk_write(lba + 1, __warm_start, h.region_size / SECTOR_SIZE) != 0 ||
+        write_header(&h, lba) != 0 ||
+        virtio_blk_flush() != 0) {
+        console_printf("snapshot: write failed\n");
+        return -1;
+    }
+
+    snapshot_live = 1;
+    console_printf("snapshot: saved %lu KB at sector %lu\n",
+                   (unsigned long)(h.region_size / 1024), (unsigned long)lba);
+    return 0;
+}
+
+int snapshot_restore(void) {
+    if (!virtio_blk_available() && virtio_blk_init() != 0) {
+        return -1;
+    }
+
+    uint64_t lba = snapshot_lba();
+    struct snapshot_header h;
+    if (lba == 0 || virtio_blk_read(lba, sector_buf, 1) != 0) {
+        return -1;
+    }
+    memcpy(&h, sector_buf, sizeof(h));
+    if (h.magic != SNAPSHOT_MAGIC) {
+        return -1;
+    }
+
+    /* Whatever happens next, a write must not leave this header behind */
+    snapshot_live = 1;
+
+    uint8_t id[BUILD_ID_SIZE];
+    build_id(id);
+    if (h.version != SNAPSHOT_VERSION ||
+        h.header_crc != crc32(0, &h, offsetof(struct snapshot_header, header_crc)) ||
+        h.region_start != (uint64_t)(uintptr_t)__warm_start ||
+        h.region_size != region_size() ||
+        h.capacity != virtio_blk_capacity() ||
+        memcmp(h.build_id, id, BUILD_ID_SIZE) != 0) {
+        console_printf("snapshot: taken by another build, ignored\n");
+        return -1;
+    }
+
+    uint32_t sblock_crc;
+    uint64_t fs_bytes;
+    if (read_sblock(&sblock_crc, &fs_bytes) != 0 || sblock_crc != h.sblock_crc) {
+        console_printf("snapshot: disk changed since it was taken, ignored\n");
+        return -1;
+    }
+
+    /* Read into the heap first: a bad copy must not touch the region */
+    uint8_t *copy = malloc(h.region_size);
+    if (copy == NULL) {
+        console_printf("snapshot: no memory to read it\n");
+        return -1;
+    }
+    if (virtio_blk_read(lba + 1, copy, h.region_size / SECTOR_SIZE) != 0 ||
+        crc32(0, copy, h.region_size) != h.region_crc) {
+        console_printf("snapshot: checksum mismatch, ignored\n");
+        free(copy);
+        return -1;
+    }
+
+    memcpy(__warm_start, copy, h.region_size);
+    free(copy);
+    console_printf("snapshot: restored %lu KB\n", (unsigned long)(h.region_size / 1024));
+    return 0;
+}
+
+void snapshot_disk_written(void) {
+    if (!snapshot_live) return;
+    snapshot_live = 0;
+
+    uint64_t lba = snapshot_lba();
+    if (lba != 0 && write_header(NULL, lba) == 0) {
+        console_printf("snapshot: disk written, snapshot discarded\n");
+    }
+}
+
+#endif /* SNAPSHOT */
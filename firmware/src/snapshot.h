@@ -0,0 +1,43 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * snapshot.h - Save and restore the mounted filesystem state
+ *
+ * link.ld gathers everything lwext4 keeps between calls into one range,
+ * __warm_start to __warm_end: lwext4's own statics, variables tagged
+ * WARM below, and the arena lwext4 allocates from (heap.c). With the
+ * disk mounted and its block cache filled, "make SNAPSHOT=1" firmware
+ * can write that range to the end of the disk (POST /__snapshot/save) and
+ * copy it back on the next boot instead of mounting.
+ *
+ * A snapshot is only used by the same binary (ELF build-id), on a disk
+ * whose superblock has not changed since the save; anything else falls
+ * back to a normal mount. The first write through lwext4 after a save or
+ * restore discards the snapshot, as the disk no longer matches it.
+ */
+
+/* Place a variable in the snapshot region */
+#define WARM __attribute__((section(".warm")))
+
+#ifdef SNAPSHOT
+
+/* Bring the filesystem up from the snapshot on disk. Returns 0 if it
+ * was restored (fs_mounted() is then true), -1 if there is none or it
+ * does not match, with nothing changed. */
+int snapshot_restore(void);
+
+/* Write the current state to the disk. Returns 0 on success, -1 if the
+ * filesystem is not mounted or the disk has no room past its end. */
+int snapshot_save(void);
+
+/* Called on every block write made by lwext4 */
+void snapshot_disk_written(void);
+
+#else
+
+static inline void snapshot_disk_written(void) { }
+
+#endif /* SNAPSHOT */
+
+#endif /* SNAPSHOT_H */
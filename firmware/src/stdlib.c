@@ -100,21 +100,22 @@ void abort(void) {
     while (1);
 }
 
-/* Memory allocation wrappers for lwext4 */
-extern void *malloc(size_t size);
-extern void free(void *ptr);
-extern void *calloc(size_t nmemb, size_t size);
+/* Memory allocation wrappers for lwext4, from the arena that is saved
+ * with the rest of its state (snapshot.h) */
+extern void *warm_malloc(size_t size);
+extern void warm_free(void *ptr);
+extern void *warm_calloc(size_t nmemb, size_t size);
 
 void *ext4_user_malloc(size_t size) {
-    return malloc(size);
+    return warm_malloc(size);
 }
 
 void *ext4_user_calloc(size_t nmemb, size_t size) {
-    return calloc(nmemb, size);
+    return warm_calloc(nmemb, size);
 }
 
 void ext4_user_free(void *ptr) {
-    free(ptr);
+    warm_free(ptr);
 }
 
 /* Simple qsort implementation (shell sort) */
@@ -24,6 +24,11 @@ uint32_t sys_now(void) {
     return sys_now_ms;
 }
 
+/* Raw CLINT mtime, TIMER_FREQ ticks per second */
+uint64_t timer_ticks(void) {
+    return MMIO_READ64(CLINT_MTIME);
+}
+
 void timer_irq_handler(void) {
     /* Not used in polling mode */
 }
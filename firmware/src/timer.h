@@ -5,6 +5,7 @@
 
 void timer_init(void);
 uint32_t sys_now(void);
+uint64_t timer_ticks(void);
 void timer_irq_handler(void);
 
 #endif /* TIMER_H */
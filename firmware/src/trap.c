@@ -1,6 +1,7 @@
 #include "platform.h"
 #include "plic.h"
 #include "console.h"
+#include "prof.h"
 
 /* Forward declarations for device handlers */
 extern void virtio_net_irq_handler(void);
@@ -42,6 +43,8 @@ void trap_handler(void) {
                 }
                 plic_complete(irq);
             }
+        } else if (code == 7) { /* Machine timer interrupt: PC sampler */
+            prof_sample(mepc);
         }
     } else {
         /* Exception */
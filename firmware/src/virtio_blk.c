@@ -8,6 +8,9 @@
 #include "virtio_blk.h"
 #include "platform.h"
 #include "console.h"
+#include "prof.h"
+#include "timer.h"
+#include <stdio.h>
 #include <string.h>
 
 /* VirtIO MMIO register offsets */
@@ -129,6 +132,160 @@ static int blk_initialized = 0;
 static uint64_t blk_capacity = 0;
 static uint32_t blk_sector_size = VIRTIO_BLK_SECTOR_SIZE;
 
+static struct virtio_blk_stats blk_stats;
+
+/*
+ * Request trace (make BLK_TRACE=1). Every device request, and every
+ * lwext4 block cache lookup reported by ext4_blockdev_virtio.c, goes
+ * into a RAM ring with its mtime start and duration; once full, the
+ * oldest entries are overwritten. virtio_blk_trace_dump() prints the
+ * ring on the console for host/blk_replay.
+ */
+struct blk_trace_entry {
+    uint64_t sector;
+    uint64_t start;             /* mtime */
+    uint32_t duration;          /* mtime ticks */
+    uint16_t count;             /* Sectors */
+    uint8_t type;               /* TRACE_* */
+    uint8_t flags;              /* TRACE_F_* */
+};
+
+#define TRACE_READ      'R'
+#define TRACE_WRITE     'W'
+#define TRACE_FLUSH     'F'
+#define TRACE_LOOKUP    'C'
+
+#define TRACE_F_HIT     0x01    /* Lookup answered from the cache */
+#define TRACE_F_FILL    0x02    /* Read made to fill the cache on a lookup miss */
+#define TRACE_F_ERROR   0x04
+
+#ifdef BLK_TRACE
+
+#ifndef BLK_TRACE_ENTRIES
+#define BLK_TRACE_ENTRIES 8192  /* Power of two; 24 bytes each */
+#endif
+
+static struct blk_trace_entry trace_ring[BLK_TRACE_ENTRIES];
+static uint32_t trace_recorded;             /* Free-running */
+static struct blk_trace_entry *trace_lookup;    /* Open lookup, if any */
+
+static struct blk_trace_entry *trace_begin(int type, uint64_t sector, uint32_t count) {
+    struct blk_trace_entry *e = &trace_ring[trace_recorded++ & (BLK_TRACE_ENTRIES - 1)];
+
+    e->sector = sector;
+    e->count = count;
+    e->type = type;
+    e->flags = (type == TRACE_READ && trace_lookup) ? TRACE_F_FILL : 0;
+    e->duration = 0;
+    e->start = timer_ticks();
+    return e;
+}
+
+static void trace_end(struct blk_trace_entry *e, int r) {
+    e->duration = (uint32_t)(timer_ticks() - e->start);
+    if (r != 0) e->flags |= TRACE_F_ERROR;
+}
+
+void virtio_blk_trace_lookup(uint64_t sector, uint32_t count) {
+    trace_lookup = trace_begin(TRACE_LOOKUP, sector, count);
+}
+
+void virtio_blk_trace_lookup_done(int r, int hit) {
+    if (trace_lookup == NULL) return;
+    trace_end(trace_lookup, r);
+    if (hit) trace_lookup->flags |= TRACE_F_HIT;
+    trace_lookup = NULL;
+}
+
+void virtio_blk_trace_reset(void) {
+    trace_recorded = 0;
+    trace_lookup = NULL;
+}
+
+enum { CURSOR_BEGIN, CURSOR_ENTRIES, CURSOR_END, CURSOR_DONE };
+
+void virtio_blk_trace_open(struct blk_trace_cursor *c) {
+    uint32_t n = trace_recorded < BLK_TRACE_ENTRIES ? trace_recorded : BLK_TRACE_ENTRIES;
+    c->next = trace_recorded - n;
+    c->end = trace_recorded;
+    c->state = CURSOR_BEGIN;
+}
+
+/* Oldest first, one "type sector count start duration flags" line each,
+ * between begin/end markers so blk_replay can pick it out of a log */
+int virtio_blk_trace_line(struct blk_trace_cursor *c, char *buf, int size) {
+    char line[80];
+    int len;
+
+    /* Requests made while a cursor is open overwrite the oldest entries */
+    if (c->state == CURSOR_ENTRIES && trace_recorded - c->next > BLK_TRACE_ENTRIES) {
+        c->next = trace_recorded - BLK_TRACE_ENTRIES;
+    }
+
+    switch (c->state) {
+        case CURSOR_BEGIN:
+            len = snprintf(line, sizeof(line), "blktrace begin entries %u overwritten %u hz %u\n",
+                           c->end - c->next, c->next, (unsigned)TIMER_FREQ);
+            break;
+        case CURSOR_ENTRIES: {
+            if (c->next == c->end) {
+                c->state = CURSOR_END;
+                return virtio_blk_trace_line(c, buf, size);
+            }
+            const struct blk_trace_entry *e = &trace_ring[c->next & (BLK_TRACE_ENTRIES - 1)];
+            char flags[4];
+            int f = 0;
+
+            if (e->flags & TRACE_F_HIT) flags[f++] = 'h';
+            if (e->flags & TRACE_F_FILL) flags[f++] = 'f';
+            if (e->flags & TRACE_F_ERROR) flags[f++] = 'e';
+            if (f == 0) flags[f++] = '-';
+            flags[f] = '\0';
+
+            len = snprintf(line, sizeof(line), "%c %lu %u %lu %u %s\n", e->type,
+                           (unsigned long)e->sector, (unsigned)e->count,
+                           (unsigned long)e->start, e->duration, flags);
+            break;
+        }
+        case CURSOR_END:
+            len = snprintf(line, sizeof(line), "blktrace end\n");
+            break;
+        default:
+            return 0;
+    }
+
+    if (len >= size) return -1;
+    memcpy(buf, line, len);
+    buf[len] = '\0';
+    if (c->state == CURSOR_ENTRIES) {
+        c->next++;
+    } else {
+        c->state++;
+    }
+    return len;
+}
+
+void virtio_blk_trace_dump(void) {
+    struct blk_trace_cursor c;
+    char line[80];
+
+    virtio_blk_trace_open(&c);
+    while (virtio_blk_trace_line(&c, line, sizeof(line)) > 0) {
+        console_printf("%s", line);
+    }
+}
+
+#else
+
+static inline struct blk_trace_entry *trace_begin(int type, uint64_t sector, uint32_t count) {
+    return NULL;
+}
+
+static inline void trace_end(struct blk_trace_entry *e, int r) {
+}
+
+#endif /* BLK_TRACE */
+
 /* MMIO access macros */
 #define BLK_READ32(off)     MMIO_READ32(VIRTIO_BLOCK_BASE + (off))
 #define BLK_WRITE32(off, v) MMIO_WRITE32(VIRTIO_BLOCK_BASE + (off), (v))
@@ -171,6 +328,8 @@ static int wait_for_completion(void) {
 
 /* Submit a block I/O request */
 static int submit_request(uint32_t type, uint64_t sector, void *buf, uint32_t len) {
+    PROF_REGION(PROF_BLK_REQUEST);
+
     if (!blk_initialized) {
         return -1;
     }
@@ -183,6 +342,7 @@ static int submit_request(uint32_t type, uint64_t sector, void *buf, uint32_t le
     /* Get three free descriptors for: header, data, status */
     if (req_queue.num_free < 3) {
         console_printf("virtio-blk: no free descriptors\n");
+        blk_stats.errors++;
         return -1;
     }
 
@@ -225,6 +385,7 @@ static int submit_request(uint32_t type, uint64_t sector, void *buf, uint32_t le
 
     /* Notify device */
     BLK_WRITE32(VIRTIO_MMIO_QUEUE_NOTIFY, QUEUE_REQUEST);
+    blk_stats.notifies++;
 
     /* Wait for completion */
     wait_for_completion();
@@ -239,9 +400,17 @@ static int submit_request(uint32_t type, uint64_t sector, void *buf, uint32_t le
     /* Check status */
     if (req_status != VIRTIO_BLK_S_OK) {
         console_printf("virtio-blk: I/O error, status=%d\n", req_status);
+        blk_stats.errors++;
         return -1;
     }
 
+    if (type == VIRTIO_BLK_T_IN) {
+        blk_stats.reads++;
+        blk_stats.bytes_read += len;
+    } else {
+        blk_stats.writes++;
+        blk_stats.bytes_written += len;
+    }
     return 0;
 }
 
@@ -342,7 +511,10 @@ int virtio_blk_read(uint64_t sector, void *buf, uint32_t count) {
         uint32_t n = (count > MAX_SECTORS_PER_REQ) ? MAX_SECTORS_PER_REQ : count;
         uint32_t len = n * blk_sector_size;
 
-        if (submit_request(VIRTIO_BLK_T_IN, sector, data_buffer, len) != 0) {
+        struct blk_trace_entry *te = trace_begin(TRACE_READ, sector, n);
+        int r = submit_request(VIRTIO_BLK_T_IN, sector, data_buffer, len);
+        trace_end(te, r);
+        if (r != 0) {
             return -1;
         }
 
@@ -373,7 +545,10 @@ int virtio_blk_write(uint64_t sector, const void *buf, uint32_t count) {
 
         memcpy(data_buffer, p, len);
 
-        if (submit_request(VIRTIO_BLK_T_OUT, sector, data_buffer, len) != 0) {
+        struct blk_trace_entry *te = trace_begin(TRACE_WRITE, sector, n);
+        int r = submit_request(VIRTIO_BLK_T_OUT, sector, data_buffer, len);
+        trace_end(te, r);
+        if (r != 0) {
             return -1;
         }
 
@@ -419,11 +594,14 @@ int virtio_blk_flush(void) {
     req_queue.descs[desc1].flags = VRING_DESC_F_WRITE;
     req_queue.descs[desc1].next = 0;
 
+    struct blk_trace_entry *te = trace_begin(TRACE_FLUSH, 0, 0);
+
     /* Submit */
     req_queue.avail.ring[req_queue.avail.idx % QUEUE_SIZE] = head;
     mb();
     req_queue.avail.idx++;
     BLK_WRITE32(VIRTIO_MMIO_QUEUE_NOTIFY, QUEUE_REQUEST);
+    blk_stats.notifies++;
 
     /* Wait */
     wait_for_completion();
@@ -434,7 +612,13 @@ int virtio_blk_flush(void) {
     req_queue.free_head = desc0;
     req_queue.num_free += 2;
 
-    return (req_status == VIRTIO_BLK_S_OK) ? 0 : -1;
+    trace_end(te, req_status != VIRTIO_BLK_S_OK);
+    if (req_status != VIRTIO_BLK_S_OK) {
+        blk_stats.errors++;
+        return -1;
+    }
+    blk_stats.flushes++;
+    return 0;
 }
 
 uint64_t virtio_blk_capacity(void) {
@@ -448,3 +632,7 @@ uint32_t virtio_blk_sector_size(void) {
 int virtio_blk_available(void) {
     return blk_initialized;
 }
+
+void virtio_blk_get_stats(struct virtio_blk_stats *stats) {
+    *stats = blk_stats;
+}
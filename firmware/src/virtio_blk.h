@@ -46,4 +46,42 @@ uint32_t virtio_blk_sector_size(void);
 /* Check if block device is available */
 int virtio_blk_available(void);
 
+/* Driver counters since boot */
+struct virtio_blk_stats {
+    uint32_t reads;             /* Requests, not sectors */
+    uint32_t writes;
+    uint32_t flushes;
+    uint32_t errors;
+    uint32_t notifies;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+};
+
+void virtio_blk_get_stats(struct virtio_blk_stats *stats);
+
+#ifdef BLK_TRACE
+/* Request trace (make BLK_TRACE=1). The block device adapter brackets
+ * each lwext4 cache lookup with these, so reads made to fill the cache
+ * can be told apart from direct ones. */
+void virtio_blk_trace_lookup(uint64_t sector, uint32_t count);
+void virtio_blk_trace_lookup_done(int r, int hit);
+
+/* Print the ring on the console, oldest entry first */
+void virtio_blk_trace_dump(void);
+void virtio_blk_trace_reset(void);
+
+/* The same text a line at a time, for a streamed response */
+struct blk_trace_cursor {
+    uint32_t next;              /* Entry to format next */
+    uint32_t end;               /* trace_recorded when opened */
+    int state;                  /* Begin marker, entries, end marker, done */
+};
+
+void virtio_blk_trace_open(struct blk_trace_cursor *c);
+
+/* Format the next line into buf. Returns its length, 0 after the end
+ * marker, or -1 (cursor unchanged) if it needs more than size bytes. */
+int virtio_blk_trace_line(struct blk_trace_cursor *c, char *buf, int size);
+#endif
+
 #endif /* VIRTIO_BLK_H */
@@ -9,6 +9,7 @@
 #include "platform.h"
 #include "console.h"
 #include "plic.h"
+#include "prof.h"
 
 #include "lwip/netif.h"
 #include "lwip/etharp.h"
@@ -111,6 +112,8 @@ static struct virtqueue rx_queue __attribute__((aligned(4096)));
 /* Network interface */
 static struct netif virtio_netif;
 
+static struct virtio_net_stats net_stats;
+
 /* MAC address: locally administered, unicast */
 static const uint8_t mac_addr[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
 
@@ -241,14 +244,17 @@ static int virtio_init(void) {
 /* Send Ethernet frame via TX queue */
 static err_t virtio_net_output(struct netif *netif, struct pbuf *p) {
     (void)netif;
+    PROF_REGION(PROF_NET_OUTPUT);
 
     if (p->tot_len > BUF_SIZE - 2) {
         console_printf("TX: frame too large (%d bytes)\n", p->tot_len);
+        net_stats.tx_dropped++;
         return ERR_MEM;
     }
 
     if (tx_queue.num_free == 0) {
         console_printf("TX: no free descriptors\n");
+        net_stats.tx_dropped++;
         return ERR_MEM;
     }
 
@@ -284,11 +290,26 @@ static err_t virtio_net_output(struct netif *netif, struct pbuf *p) {
     /* Notify device */
     VIRTIO_WRITE32(VIRTIO_MMIO_QUEUE_NOTIFY, QUEUE_TX);
 
+    net_stats.tx_frames++;
+    net_stats.tx_bytes += p->tot_len;
+    net_stats.tx_notifies++;
+    uint32_t in_flight = QUEUE_SIZE - tx_queue.num_free;
+    if (in_flight > net_stats.tx_in_flight_max) {
+        net_stats.tx_in_flight_max = in_flight;
+    }
+
     return ERR_OK;
 }
 
 /* Process received frames */
 static void virtio_net_input(struct netif *netif) {
+    PROF_REGION(PROF_NET_INPUT);
+
+    uint32_t batch = (uint16_t)(rx_queue.used.idx - rx_queue.last_used_idx);
+    if (batch > net_stats.rx_batch_max) {
+        net_stats.rx_batch_max = batch;
+    }
+
     while (rx_queue.last_used_idx != rx_queue.used.idx) {
         uint16_t used_idx = rx_queue.last_used_idx % QUEUE_SIZE;
         uint16_t desc_idx = rx_queue.used.ring[used_idx].id;
@@ -296,6 +317,7 @@ static void virtio_net_input(struct netif *netif) {
 
         uint8_t *buf = rx_buffers[desc_idx % (QUEUE_SIZE / 2)];
 
+        int delivered = 0;
         if (len >= 2) {
             /* Extract frame length from prefix */
             uint16_t frame_len = (buf[0] << 8) | buf[1];
@@ -310,10 +332,18 @@ static void virtio_net_input(struct netif *netif) {
                     /* Pass to lwIP */
                     if (netif->input(p, netif) != ERR_OK) {
                         pbuf_free(p);
+                    } else {
+                        delivered = 1;
+                        net_stats.rx_bytes += frame_len;
                     }
                 }
             }
         }
+        if (delivered) {
+            net_stats.rx_frames++;
+        } else {
+            net_stats.rx_dropped++;
+        }
 
         /* Return buffer to available ring */
         rx_queue.descs[desc_idx].addr = (uint64_t)(uintptr_t)buf;
@@ -329,6 +359,7 @@ static void virtio_net_input(struct netif *netif) {
 
     /* Notify device that we've returned buffers */
     VIRTIO_WRITE32(VIRTIO_MMIO_QUEUE_NOTIFY, QUEUE_RX);
+    net_stats.rx_notifies++;
 }
 
 /* Process completed TX buffers */
@@ -407,7 +438,7 @@ struct netif* virtio_net_init(void) {
 }
 
 /* Poll for network activity (call from main loop) */
-void virtio_net_poll(void) {
+int virtio_net_poll(void) {
     /* Check for interrupts and process */
     uint32_t status = VIRTIO_READ32(VIRTIO_MMIO_INTERRUPT_STATUS);
     if (status) {
@@ -415,4 +446,12 @@ void virtio_net_poll(void) {
         virtio_net_tx_complete();
         virtio_net_input(&virtio_netif);
     }
+    return status != 0;
+}
+
+/* Snapshot of the driver counters */
+void virtio_net_get_stats(struct virtio_net_stats *stats) {
+    *stats = net_stats;
+    stats->tx_in_flight = QUEUE_SIZE - tx_queue.num_free;
+    stats->queue_size = QUEUE_SIZE;
 }
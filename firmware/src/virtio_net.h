@@ -6,10 +6,29 @@
 /* Initialize VirtIO network interface */
 struct netif* virtio_net_init(void);
 
-/* Poll for network activity (call from main loop) */
-void virtio_net_poll(void);
+/* Poll for network activity (call from main loop). Returns nonzero if
+ * the device had anything to report, 0 if it was idle. */
+int virtio_net_poll(void);
 
 /* Interrupt handler (called from trap handler) */
 void virtio_net_irq_handler(void);
 
+/* Driver counters since boot */
+struct virtio_net_stats {
+    uint32_t rx_frames;
+    uint32_t rx_dropped;        /* No pbuf, bad length, or rejected by lwIP */
+    uint32_t rx_notifies;
+    uint32_t rx_batch_max;      /* Most frames taken from the used ring at once */
+    uint32_t tx_frames;
+    uint32_t tx_dropped;        /* Too large or no free descriptor */
+    uint32_t tx_notifies;
+    uint32_t tx_in_flight;      /* Descriptors the device still holds */
+    uint32_t tx_in_flight_max;
+    uint32_t queue_size;
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+};
+
+void virtio_net_get_stats(struct virtio_net_stats *stats);
+
 #endif /* VIRTIO_NET_H */
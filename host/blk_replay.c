@@ -0,0 +1,542 @@
+/*
+ * blk_replay.c - Offline replay of the firmware's block request trace
+ *
+ * Reads a trace from a BLK_TRACE=1 firmware (the body of GET /__blktrace,
+ * or a Spike console log after POST /__blktrace/dump) and replays it through a model of the
+ * guest's block layers for every combination of:
+ *
+ *   --cache=N      lwext4 block cache size in blocks
+ *                  (CONFIG_BLOCK_DEV_CACHE_SIZE in ext4_config.h)
+ *   --bsize=B      block size the adapter reads the disk in, in bytes
+ *                  (EXT4_BLOCKDEV_BSIZE in ext4_blockdev_virtio.c)
+ *   --readahead=K  adapter blocks fetched past the end of each read
+ *
+ * The model has two levels, like the firmware:
+ *
+ *   1. lwext4's cache. Each traced cache lookup is replayed against an
+ *      LRU of N blocks; a miss reads the block through level 2. Reads
+ *      the trace marks as cache fills are dropped, since the model makes
+ *      its own; direct reads (lwext4 bypasses the cache for whole file
+ *      blocks) go straight to level 2.
+ *   2. The adapter. Reads are widened to whole B-byte blocks plus K
+ *      blocks of read-ahead, and the last range fetched is kept, so a
+ *      read inside it costs nothing. Writes are widened the same way; a
+ *      partial block costs an extra read first.
+ *
+ * Device time is estimated from the trace itself: a least-squares fit of
+ * read duration against size (a fixed cost per request plus a cost per
+ * sector). The firmware's own settings should land close to the traced
+ * figures, which is a check on the model. With --image the modelled
+ * reads are also issued against the disk image with pread(), after
+ * dropping it from the page cache, and timed. Writes are never replayed,
+ * so the image is not modified.
+ *
+ * The model starts with empty caches. Record from boot (the ring holds
+ * the mount too) or expect some extra misses up front; entries the ring
+ * overwrote are reported and lost.
+ *
+ * Build: gcc -O2 -o blk_replay blk_replay.c
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define SECTOR_SIZE 512
+#define MAX_SECTORS_PER_REQ 128     /* virtio_blk.c splits larger reads */
+#define MAX_CONFIGS 16
+#define LINE_SIZE 256
+
+#define TRACE_F_HIT 0x01
+#define TRACE_F_FILL 0x02
+#define TRACE_F_ERROR 0x04
+
+typedef struct TraceEntry {
+    char type;                  /* R, W, F (device) or C (cache lookup) */
+    uint8_t flags;
+    uint32_t count;             /* Sectors */
+    uint64_t sector;
+    uint64_t start;             /* mtime ticks */
+    uint32_t duration;
+} TraceEntry;
+
+typedef struct Trace {
+    TraceEntry *entries;
+    size_t len;
+    uint32_t overwritten;
+    uint32_t hz;
+} Trace;
+
+/* Device cost model, in ticks: fixed + per_sector * sectors */
+typedef struct CostModel {
+    double read_fixed;
+    double read_per_sector;
+    double write_fixed;
+    double write_per_sector;
+    double flush;
+} CostModel;
+
+typedef struct SimResult {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t reads;             /* Device requests */
+    uint64_t read_sectors;
+    uint64_t writes;
+    uint64_t write_sectors;
+    uint64_t flushes;
+    uint64_t out_of_range;      /* Requests past the end of --image */
+    double ticks;               /* Estimated device time */
+    double host_ns;             /* Measured against --image */
+} SimResult;
+
+/* Level 1: LRU of lwext4 blocks keyed by first sector */
+typedef struct BlockCache {
+    uint64_t *sector;
+    uint64_t *used;             /* Last use; 0 = empty */
+    int size;
+    uint64_t clock;
+} BlockCache;
+
+/* Level 2: the adapter's read-ahead window */
+typedef struct Adapter {
+    uint32_t block_sectors;
+    uint32_t readahead;
+    uint64_t win_start;
+    uint64_t win_end;           /* Empty when equal */
+    int image_fd;
+    uint64_t image_sectors;
+    uint8_t *buf;
+    const CostModel *cost;
+    SimResult *res;
+} Adapter;
+
+static int parse_list(const char *s, int *out, const char *name) {
+    int n = 0;
+    char *end;
+
+    while (*s) {
+        if (n == MAX_CONFIGS) {
+            fprintf(stderr, "Too many values for %s (max %d)\n", name, MAX_CONFIGS);
+            return -1;
+        }
+        long v = strtol(s, &end, 10);
+        if (end == s || v < 0) {
+            fprintf(stderr, "Bad value for %s: %s\n", name, s);
+            return -1;
+        }
+        out[n++] = (int)v;
+        s = (*end == ',') ? end + 1 : end;
+        if (*end && *end != ',') {
+            fprintf(stderr, "Bad value for %s: %s\n", name, end);
+            return -1;
+        }
+    }
+    return n;
+}
+
+/* Keep the last dump in the log; each one is a complete snapshot */
+static int load_trace(FILE *f, Trace *t) {
+    char line[LINE_SIZE];
+    size_t cap = 0;
+    int in_dump = 0, found = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        /* Console lines may carry a prefix (timestamps, tee'd logs) */
+        char *p = strstr(line, "blktrace begin");
+        if (p) {
+            unsigned entries = 0, overwritten = 0, hz = 0;
+            sscanf(p, "blktrace begin entries %u overwritten %u hz %u", &entries, &overwritten, &hz);
+            t->len = 0;
+            t->overwritten = overwritten;
+            t->hz = hz ? hz : 10000000;
+            in_dump = 1;
+            found = 1;
+            continue;
+        }
+        if (!in_dump) continue;
+        if (strstr(line, "blktrace end")) {
+            in_dump = 0;
+            continue;
+        }
+
+        TraceEntry e;
+        char type, flags[8];
+        unsigned long sector, start;
+        unsigned count, duration;
+        if (sscanf(line, " %c %lu %u %lu %u %7s", &type, &sector, &count, &start, &duration, flags) != 6 ||
+            !strchr("RWFC", type)) {
+            continue;
+        }
+        e.type = type;
+        e.sector = sector;
+        e.count = count;
+        e.start = start;
+        e.duration = duration;
+        e.flags = 0;
+        if (strchr(flags, 'h')) e.flags |= TRACE_F_HIT;
+        if (strchr(flags, 'f')) e.flags |= TRACE_F_FILL;
+        if (strchr(flags, 'e')) e.flags |= TRACE_F_ERROR;
+
+        if (t->len == cap) {
+            cap = cap ? cap * 2 : 4096;
+            t->entries = realloc(t->entries, cap * sizeof(TraceEntry));
+            if (!t->entries) {
+                perror("realloc");
+                return -1;
+            }
+        }
+        t->entries[t->len++] = e;
+    }
+
+    if (!found) {
+        fprintf(stderr, "No \"blktrace begin\" found; save GET /__blktrace or a console log after POST /__blktrace/dump\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Least-squares fit of duration = fixed + per_sector * count */
+static void fit(const Trace *t, char type, double *fixed, double *per_sector) {
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+    for (size_t i = 0; i < t->len; i++) {
+        const TraceEntry *e = &t->entries[i];
+        if (e->type != type || (e->flags & TRACE_F_ERROR)) continue;
+        n++;
+        sx += e->count;
+        sy += e->duration;
+        sxx += (double)e->count * e->count;
+        sxy += (double)e->count * e->duration;
+    }
+
+    *fixed = 0;
+    *per_sector = 0;
+    if (n == 0) return;
+
+    double den = n * sxx - sx * sx;
+    if (den > 0) {
+        *per_sector = (n * sxy - sx * sy) / den;
+        *fixed = (sy - *per_sector * sx) / n;
+    }
+    /* All requests the same size, or a nonsensical slope */
+    if (den <= 0 || *per_sector < 0 || *fixed < 0) {
+        *per_sector = sx > 0 ? sy / sx : 0;
+        *fixed = 0;
+    }
+}
+
+static void build_cost_model(const Trace *t, CostModel *cm) {
+    uint64_t flushes = 0, flush_ticks = 0;
+
+    fit(t, 'R', &cm->read_fixed, &cm->read_per_sector);
+    fit(t, 'W', &cm->write_fixed, &cm->write_per_sector);
+    if (cm->write_fixed == 0 && cm->write_per_sector == 0) {
+        cm->write_fixed = cm->read_fixed;
+        cm->write_per_sector = cm->read_per_sector;
+    }
+
+    for (size_t i = 0; i < t->len; i++) {
+        if (t->entries[i].type == 'F') {
+            flushes++;
+            flush_ticks += t->entries[i].duration;
+        }
+    }
+    cm->flush = flushes ? (double)flush_ticks / flushes : 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* One device read, split like virtio_blk_read() */
+static void device_read(Adapter *a, uint64_t sector, uint64_t count) {
+    while (count > 0) {
+        uint32_t n = count > MAX_SECTORS_PER_REQ ? MAX_SECTORS_PER_REQ : (uint32_t)count;
+
+        a->res->reads++;
+        a->res->read_sectors += n;
+        a->res->ticks += a->cost->read_fixed + a->cost->read_per_sector * n;
+
+        if (a->image_fd >= 0) {
+            if (sector + n > a->image_sectors) {
+                a->res->out_of_range++;
+            } else {
+                uint64_t t0 = now_ns();
+                if (pread(a->image_fd, a->buf, (size_t)n * SECTOR_SIZE,
+                          (off_t)sector * SECTOR_SIZE) != (ssize_t)n * SECTOR_SIZE) {
+                    a->res->out_of_range++;
+                }
+                a->res->host_ns += now_ns() - t0;
+            }
+        }
+        sector += n;
+        count -= n;
+    }
+}
+
+static void adapter_read(Adapter *a, uint64_t sector, uint32_t count) {
+    if (sector >= a->win_start && sector + count <= a->win_end) return;
+
+    uint64_t bs = a->block_sectors;
+    uint64_t start = sector / bs * bs;
+    uint64_t end = (sector + count + bs - 1) / bs * bs;
+
+    /* Read-ahead stops at the end of the disk, when known */
+    uint64_t ra_end = end + (uint64_t)a->readahead * bs;
+    if (a->image_sectors && ra_end > a->image_sectors) ra_end = a->image_sectors;
+    if (ra_end > end) end = ra_end;
+
+    device_read(a, start, end - start);
+    a->win_start = start;
+    a->win_end = end;
+}
+
+static void adapter_write(Adapter *a, uint64_t sector, uint32_t count) {
+    uint64_t bs = a->block_sectors;
+    uint64_t start = sector / bs * bs;
+    uint64_t end = (sector + count + bs - 1) / bs * bs;
+
+    /* Partial blocks are read first, unless the window has them */
+    int head_partial = sector != start;
+    int tail_partial = sector + count != end;
+    if ((head_partial || tail_partial) && !(start >= a->win_start && end <= a->win_end)) {
+        if (head_partial) device_read(a, start, bs);
+        if (tail_partial && (end - bs != start || !head_partial)) device_read(a, end - bs, bs);
+    }
+
+    for (uint64_t s = start; s < end; ) {
+        uint32_t n = end - s > MAX_SECTORS_PER_REQ ? MAX_SECTORS_PER_REQ : (uint32_t)(end - s);
+        a->res->writes++;
+        a->res->write_sectors += n;
+        a->res->ticks += a->cost->write_fixed + a->cost->write_per_sector * n;
+        s += n;
+    }
+    /* Write-through: the window's copy stays valid */
+}
+
+/* Returns 1 on a hit */
+static int cache_lookup(BlockCache *c, uint64_t sector) {
+    int victim = 0;
+
+    c->clock++;
+    for (int i = 0; i < c->size; i++) {
+        if (c->used[i] && c->sector[i] == sector) {
+            c->used[i] = c->clock;
+            return 1;
+        }
+        if (c->used[i] < c->used[victim]) victim = i;
+    }
+    if (c->size > 0) {
+        c->sector[victim] = sector;
+        c->used[victim] = c->clock;
+    }
+    return 0;
+}
+
+static void simulate(const Trace *t, const CostModel *cm, int cache_size, int bsize,
+                     int readahead, int image_fd, uint64_t image_sectors, SimResult *res) {
+    BlockCache cache = {0};
+    Adapter a = {0};
+
+    memset(res, 0, sizeof(*res));
+    cache.size = cache_size;
+    cache.sector = calloc(cache_size ? cache_size : 1, sizeof(uint64_t));
+    cache.used = calloc(cache_size ? cache_size : 1, sizeof(uint64_t));
+    a.block_sectors = bsize / SECTOR_SIZE;
+    a.readahead = readahead;
+    a.image_fd = image_fd;
+    a.image_sectors = image_sectors;
+    a.cost = cm;
+    a.res = res;
+    a.buf = malloc((size_t)MAX_SECTORS_PER_REQ * SECTOR_SIZE);
+
+#ifdef POSIX_FADV_DONTNEED
+    if (image_fd >= 0) posix_fadvise(image_fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+    for (size_t i = 0; i < t->len; i++) {
+        const TraceEntry *e = &t->entries[i];
+
+        switch (e->type) {
+        case 'C':
+            res->lookups++;
+            if (cache_lookup(&cache, e->sector)) {
+                res->hits++;
+            } else {
+                adapter_read(&a, e->sector, e->count);
+            }
+            break;
+        case 'R':
+            if (!(e->flags & TRACE_F_FILL)) adapter_read(&a, e->sector, e->count);
+            break;
+        case 'W':
+            adapter_write(&a, e->sector, e->count);
+            break;
+        case 'F':
+            res->flushes++;
+            res->ticks += cm->flush;
+            break;
+        }
+    }
+
+    free(cache.sector);
+    free(cache.used);
+    free(a.buf);
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [options] TRACE\n", prog);
+    printf("  TRACE               GET /__blktrace output, or a console log (- for stdin)\n");
+    printf("Options:\n");
+    printf("  --cache=N[,N...]    lwext4 cache sizes in blocks (default: 8)\n");
+    printf("  --bsize=B[,B...]    Adapter block sizes in bytes (default: 512)\n");
+    printf("  --readahead=K[,K...] Adapter blocks read ahead (default: 0)\n");
+    printf("  --image=FILE        Also time the modelled reads against a disk image\n");
+    printf("  --help              Show this help\n");
+    printf("\nExample:\n");
+    printf("  %s --cache=8,16,32,64 --bsize=512,4096 --readahead=0,8 spike.log\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int caches[MAX_CONFIGS] = {8}, ncaches = 1;
+    int bsizes[MAX_CONFIGS] = {512}, nbsizes = 1;
+    int readaheads[MAX_CONFIGS] = {0}, nreadaheads = 1;
+    const char *trace_path = NULL;
+    const char *image_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--cache=", 8) == 0) {
+            if ((ncaches = parse_list(argv[i] + 8, caches, "--cache")) <= 0) return 1;
+        } else if (strncmp(argv[i], "--bsize=", 8) == 0) {
+            if ((nbsizes = parse_list(argv[i] + 8, bsizes, "--bsize")) <= 0) return 1;
+        } else if (strncmp(argv[i], "--readahead=", 12) == 0) {
+            if ((nreadaheads = parse_list(argv[i] + 12, readaheads, "--readahead")) <= 0) return 1;
+        } else if (strncmp(argv[i], "--image=", 8) == 0) {
+            image_path = argv[i] + 8;
+        } else if (strcmp(argv[i], "--help") == 0) {
+            usage(argv[0]);
+            return 0;
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        } else {
+            trace_path = argv[i];
+        }
+    }
+
+    if (!trace_path) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (int i = 0; i < nbsizes; i++) {
+        if (bsizes[i] < SECTOR_SIZE || bsizes[i] % SECTOR_SIZE) {
+            fprintf(stderr, "--bsize must be a multiple of %d: %d\n", SECTOR_SIZE, bsizes[i]);
+            return 1;
+        }
+    }
+
+    FILE *f = strcmp(trace_path, "-") == 0 ? stdin : fopen(trace_path, "r");
+    if (!f) {
+        perror(trace_path);
+        return 1;
+    }
+    Trace trace = {0};
+    if (load_trace(f, &trace) < 0) return 1;
+    if (f != stdin) fclose(f);
+
+    int image_fd = -1;
+    uint64_t image_sectors = 0;
+    if (image_path) {
+        struct stat st;
+        image_fd = open(image_path, O_RDONLY);
+        if (image_fd < 0 || fstat(image_fd, &st) < 0) {
+            perror(image_path);
+            return 1;
+        }
+        image_sectors = (uint64_t)st.st_size / SECTOR_SIZE;
+    }
+
+    /* What the firmware actually did */
+    uint64_t lookups = 0, hits = 0, reads = 0, fills = 0, read_sectors = 0;
+    uint64_t writes = 0, flushes = 0, errors = 0, device_ticks = 0;
+    for (size_t i = 0; i < trace.len; i++) {
+        const TraceEntry *e = &trace.entries[i];
+        if (e->flags & TRACE_F_ERROR) errors++;
+        switch (e->type) {
+        case 'C':
+            lookups++;
+            if (e->flags & TRACE_F_HIT) hits++;
+            break;
+        case 'R':
+            reads++;
+            read_sectors += e->count;
+            if (e->flags & TRACE_F_FILL) fills++;
+            device_ticks += e->duration;
+            break;
+        case 'W':
+            writes++;
+            device_ticks += e->duration;
+            break;
+        case 'F':
+            flushes++;
+            device_ticks += e->duration;
+            break;
+        }
+    }
+
+    CostModel cm;
+    build_cost_model(&trace, &cm);
+    double ticks_per_us = trace.hz / 1e6;
+
+    printf("Trace: %zu entries", trace.len);
+    if (trace.overwritten) printf(" (%u older ones overwritten)", trace.overwritten);
+    printf(", %lu errors\n", (unsigned long)errors);
+    printf("  cache lookups %lu, hits %.1f%%\n", (unsigned long)lookups,
+           lookups ? 100.0 * hits / lookups : 0.0);
+    printf("  device reads %lu (%lu cache fills, %lu direct), %lu sectors; writes %lu; flushes %lu\n",
+           (unsigned long)reads, (unsigned long)fills, (unsigned long)(reads - fills),
+           (unsigned long)read_sectors, (unsigned long)writes, (unsigned long)flushes);
+    printf("  device time %.1f ms\n", device_ticks / ticks_per_us / 1000);
+    printf("  read cost model: %.1f us + %.3f us/sector\n\n",
+           cm.read_fixed / ticks_per_us, cm.read_per_sector / ticks_per_us);
+
+    printf("%6s %6s %4s %7s %8s %10s %7s %10s %8s", "cache", "bsize", "ra", "hit%",
+           "reads", "sectors", "writes", "est_ms", "vs_trace");
+    if (image_fd >= 0) printf(" %9s", "image_ms");
+    printf("\n");
+
+    for (int ci = 0; ci < ncaches; ci++) {
+        for (int bi = 0; bi < nbsizes; bi++) {
+            for (int ri = 0; ri < nreadaheads; ri++) {
+                SimResult r;
+                simulate(&trace, &cm, caches[ci], bsizes[bi], readaheads[ri],
+                         image_fd, image_sectors, &r);
+
+                double est_ms = r.ticks / ticks_per_us / 1000;
+                printf("%6d %6d %4d %6.1f%% %8lu %10lu %7lu %10.1f %7.2fx", caches[ci], bsizes[bi],
+                       readaheads[ri], r.lookups ? 100.0 * r.hits / r.lookups : 0.0,
+                       (unsigned long)r.reads, (unsigned long)r.read_sectors,
+                       (unsigned long)r.writes, est_ms,
+                       device_ticks ? r.ticks / device_ticks : 0.0);
+                if (image_fd >= 0) {
+                    printf(" %9.1f", r.host_ns / 1e6);
+                    if (r.out_of_range) printf("  (%lu past end)", (unsigned long)r.out_of_range);
+                }
+                printf("\n");
+            }
+        }
+    }
+
+    if (image_fd >= 0) close(image_fd);
+    free(trace.entries);
+    return 0;
+}
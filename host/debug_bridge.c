@@ -3,6 +3,17 @@
  *
  * Connects to Spike's Unix domain socket and prints/echoes Ethernet frames.
  * Does not provide actual network connectivity - use slirp_bridge for that.
+ * With --pcap, frames in both directions are also recorded to a pcapng file.
+ *
+ * It can also drive the guest directly at the Ethernet layer, without
+ * SLIRP or the host kernel in the path:
+ *   --replay=FILE  re-sends the host-to-guest frames of a pcap/pcapng
+ *                  capture with their original spacing (or faster)
+ *   --load=N       runs N concurrent HTTP GET flows against the guest
+ *                  through a minimal built-in TCP client and reports
+ *                  throughput and latency percentiles (--json for a
+ *                  machine-readable copy; scripts/bench.sh uses it)
+ * Both are deterministic: the same options send the same frames.
  *
  * Build: gcc -O2 -o debug_bridge debug_bridge.c
  */
@@ -14,21 +25,83 @@
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/select.h>
+#include <arpa/inet.h>
 #include <fcntl.h>
 
+#include "spike_shm.h"
+#include "pcapng.h"
+
 #define MAX_FRAME_SIZE 2048
+#define SEND_BUF_SIZE (256 * 1024)
 #define DEFAULT_SOCKET_PATH "/tmp/spike_fifo.sock"
 
+/* Load generator tuning */
+#define DEFAULT_REQUESTS 1000
+#define TCP_RTO_INIT_NS 1000000000LL        /* SYN / request retransmit */
+#define TCP_MAX_RETRIES 6
+#define FLOW_TIMEOUT_NS 30000000000LL       /* Give up without progress */
+#define FLOW_RETRY_NS 10000000LL            /* Back-off after a reset */
+#define LOCAL_PORT_FIRST 10000
+#define LOCAL_PORT_LAST 65000
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+
+enum { MODE_MONITOR, MODE_REPLAY, MODE_LOAD };
+
 static int spike_fd = -1;
 static volatile int running = 1;
+static PcapWriter *pcap = NULL;
+static int mode = MODE_MONITOR;
+static int verbose = 0;
 
 /* Receive buffer */
-static uint8_t recv_buf[MAX_FRAME_SIZE * 4];
+static uint8_t recv_buf[MAX_FRAME_SIZE * 32];
 static size_t recv_buf_len = 0;
 
+/* Frames queued for Spike, flushed from the main loop */
+static uint8_t send_buf[SEND_BUF_SIZE];
+static size_t send_buf_len = 0;
+
+/* Addresses; the gateway side is what SLIRP would present */
+static const uint8_t gateway_mac[6] = {0x52, 0x54, 0x00, 0x12, 0x35, 0x02};
+static const uint8_t gateway_ip[4] = {10, 0, 2, 2};
+static uint8_t guest_mac[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
+static uint8_t guest_ip[4] = {10, 0, 2, 15};
+static uint16_t guest_port = 80;
+static int guest_mac_known = 0;
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, v >> 16);
+    put16(p + 2, v & 0xFFFF);
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return ((uint32_t)get16(p) << 16) | get16(p + 2);
+}
+
 /* Print hex dump */
 static void hex_dump(const uint8_t *data, size_t len) {
     for (size_t i = 0; i < len; i++) {
@@ -99,6 +172,44 @@ static void print_ethernet(const uint8_t *frame, size_t len) {
     }
 }
 
+/* Send whatever Spike will take now; the rest stays queued */
+static void flush_send_buf(void) {
+    size_t off = 0;
+    while (off < send_buf_len) {
+        ssize_t n = send(spike_fd, send_buf + off, send_buf_len - off, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("send");
+                running = 0;
+            }
+            break;
+        }
+        off += n;
+    }
+    memmove(send_buf, send_buf + off, send_buf_len - off);
+    send_buf_len -= off;
+}
+
+static int send_space(size_t len) {
+    return send_buf_len + 2 + len <= SEND_BUF_SIZE;
+}
+
+/* Queue one length-prefixed frame. Returns -1 (frame dropped) only if
+ * Spike is not draining the socket. */
+static int send_frame(const uint8_t *frame, size_t len) {
+    if (!send_space(len)) {
+        flush_send_buf();
+        if (!send_space(len)) return -1;
+    }
+
+    put16(send_buf + send_buf_len, len);
+    memcpy(send_buf + send_buf_len + 2, frame, len);
+    send_buf_len += 2 + len;
+    pcapng_write(pcap, frame, len, PCAPNG_OUT);
+    return 0;
+}
+
 /* Create ARP reply for gateway IP */
 static void send_arp_reply(const uint8_t *request, size_t len) {
     if (len < 42) return;
@@ -153,18 +264,821 @@ static void send_arp_reply(const uint8_t *request, size_t len) {
     /* Target = requester */
     memcpy(reply + 32, arp + 8, 10);   /* Original sender MAC+IP */
 
-    /* Send with length prefix */
+    if (send_frame(reply, reply_len) < 0) {
+        fprintf(stderr, "send ARP reply: send buffer full\n");
+    }
+}
+
+/* Ask the guest for its MAC; the reply is picked up in handle_frame() */
+static void send_arp_request(void) {
+    uint8_t req[42];
+
+    memset(req, 0xFF, 6);
+    memcpy(req + 6, gateway_mac, 6);
+    put16(req + 12, 0x0806);
+    put16(req + 14, 1);                /* Ethernet */
+    put16(req + 16, 0x0800);           /* IPv4 */
+    req[18] = 6;
+    req[19] = 4;
+    put16(req + 20, 1);                /* Request */
+    memcpy(req + 22, gateway_mac, 6);
+    memcpy(req + 28, gateway_ip, 4);
+    memset(req + 32, 0, 6);
+    memcpy(req + 38, guest_ip, 4);
+    send_frame(req, sizeof(req));
+}
+
+/*
+ * Replay
+ *
+ * The capture is loaded whole and only frames sent towards the guest are
+ * kept: pcapng direction flags decide when present, otherwise frames whose
+ * source MAC is the guest's are dropped. Timing is taken from the capture
+ * and scaled by --replay-speed (0 sends as fast as Spike reads).
+ */
+
+typedef struct ReplayFrame {
+    int64_t ts;         /* Capture time, ns */
+    uint32_t len;
+    const uint8_t *data;
+} ReplayFrame;
+
+static const char *replay_path = NULL;
+static double replay_speed = 1.0;
+static int replay_loops = 1;
+static uint8_t *replay_file = NULL;
+static ReplayFrame *replay_frames = NULL;
+static size_t replay_count = 0;
+static size_t replay_next = 0;
+static int64_t replay_start = 0;
+static int64_t replay_done = 0;
+static uint64_t replay_sent = 0;
+static uint64_t replay_bytes = 0;
+static uint64_t frames_received = 0;
+
+static void replay_add(int64_t ts, const uint8_t *data, uint32_t len, int direction) {
+    if (direction == PCAPNG_IN) return;
+    if (direction == 0 && len >= 12 && memcmp(data + 6, guest_mac, 6) == 0) return;
+    if (len < 14 || len > MAX_FRAME_SIZE) return;
+
+    replay_frames[replay_count].ts = ts;
+    replay_frames[replay_count].len = len;
+    replay_frames[replay_count].data = data;
+    replay_count++;
+}
+
+/* Timestamp units to ns for a pcapng if_tsresol value */
+static int64_t tsresol_to_ns(uint64_t ts, uint8_t resol) {
+    if (resol & 0x80) {
+        int shift = resol & 0x7F;
+        return shift >= 30 ? (int64_t)(ts >> (shift - 30)) :
+               (int64_t)((ts * 1000000000ULL) >> shift);
+    }
+    int64_t ns = (int64_t)ts;
+    for (int i = resol; i < 9; i++) ns *= 10;
+    for (int i = 9; i < resol; i++) ns /= 10;
+    return ns;
+}
+
+static int parse_pcapng(const uint8_t *d, size_t size) {
+    uint8_t tsresol[16];
+    uint16_t linktype[16];
+    int ifaces = 0;
+    size_t off = 0;
+
+    while (off + 12 <= size) {
+        uint32_t type, len;
+        memcpy(&type, d + off, 4);
+        memcpy(&len, d + off + 4, 4);
+        if (len < 12 || len % 4 || off + len > size) {
+            fprintf(stderr, "Truncated pcapng block at offset %zu\n", off);
+            return -1;
+        }
+        const uint8_t *b = d + off;
+
+        if (type == 0x0A0D0D0A) {
+            uint32_t magic;
+            memcpy(&magic, b + 8, 4);
+            if (magic != 0x1A2B3C4D) {
+                fprintf(stderr, "Byte-swapped pcapng files are not supported\n");
+                return -1;
+            }
+            ifaces = 0;
+        } else if (type == 1 && ifaces < 16 && len >= 20) {
+            memcpy(&linktype[ifaces], b + 8, 2);
+            tsresol[ifaces] = 6;
+            for (size_t o = 16; o + 4 <= len - 4;) {
+                uint16_t code, olen;
+                memcpy(&code, b + o, 2);
+                memcpy(&olen, b + o + 2, 2);
+                if (code == 0) break;
+                if (code == 9 && olen >= 1) tsresol[ifaces] = b[o + 4];
+                o += 4 + ((olen + 3) & ~3);
+            }
+            ifaces++;
+        } else if (type == 6 && len >= 32) {
+            uint32_t iface, hi, lo, caplen;
+            memcpy(&iface, b + 8, 4);
+            memcpy(&hi, b + 12, 4);
+            memcpy(&lo, b + 16, 4);
+            memcpy(&caplen, b + 20, 4);
+            if (iface >= (uint32_t)ifaces || linktype[iface] != 1 || 28 + caplen > len - 4) {
+                off += len;
+                continue;
+            }
+
+            int direction = 0;
+            for (size_t o = 28 + ((caplen + 3) & ~3); o + 4 <= len - 4;) {
+                uint16_t code, olen;
+                memcpy(&code, b + o, 2);
+                memcpy(&olen, b + o + 2, 2);
+                if (code == 0) break;
+                if (code == 2 && olen == 4) {
+                    uint32_t flags;
+                    memcpy(&flags, b + o + 4, 4);
+                    direction = flags & 3;
+                }
+                o += 4 + ((olen + 3) & ~3);
+            }
+
+            uint64_t ts = ((uint64_t)hi << 32) | lo;
+            replay_add(tsresol_to_ns(ts, tsresol[iface]), b + 28, caplen, direction);
+        } else if (type == 3 && len >= 16 && ifaces > 0 && linktype[0] == 1) {
+            /* Simple Packet Block: no timestamp, reuse the previous one */
+            uint32_t orig;
+            memcpy(&orig, b + 8, 4);
+            uint32_t caplen = orig < len - 16 ? orig : len - 16;
+            int64_t ts = replay_count ? replay_frames[replay_count - 1].ts : 0;
+            replay_add(ts, b + 12, caplen, 0);
+        }
+        off += len;
+    }
+    return 0;
+}
+
+static int parse_pcap(const uint8_t *d, size_t size) {
+    uint32_t magic, linktype;
+    memcpy(&magic, d, 4);
+    memcpy(&linktype, d + 20, 4);
+    int64_t unit = magic == 0xA1B23C4D ? 1 : 1000;
+
+    if (linktype != 1) {
+        fprintf(stderr, "Capture is not Ethernet (linktype %u)\n", linktype);
+        return -1;
+    }
+
+    for (size_t off = 24; off + 16 <= size;) {
+        uint32_t sec, frac, caplen;
+        memcpy(&sec, d + off, 4);
+        memcpy(&frac, d + off + 4, 4);
+        memcpy(&caplen, d + off + 8, 4);
+        if (off + 16 + caplen > size) break;
+        replay_add((int64_t)sec * 1000000000LL + frac * unit, d + off + 16, caplen, 0);
+        off += 16 + caplen;
+    }
+    return 0;
+}
+
+static int load_replay(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    off_t size = lseek(fd, 0, SEEK_END);
+    replay_file = malloc(size > 0 ? size : 1);
+    if (size < 24 || !replay_file || pread(fd, replay_file, size, 0) != size) {
+        fprintf(stderr, "Cannot read capture %s\n", path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    /* Every record takes at least 16 bytes */
+    replay_frames = calloc(size / 16 + 1, sizeof(ReplayFrame));
+    if (!replay_frames) return -1;
+
+    uint32_t magic;
+    memcpy(&magic, replay_file, 4);
+    int ret;
+    if (magic == 0x0A0D0D0A) {
+        ret = parse_pcapng(replay_file, size);
+    } else if (magic == 0xA1B2C3D4 || magic == 0xA1B23C4D) {
+        ret = parse_pcap(replay_file, size);
+    } else {
+        fprintf(stderr, "%s is not a pcap or pcapng file\n", path);
+        ret = -1;
+    }
+    if (ret < 0) return -1;
+
+    if (replay_count == 0) {
+        fprintf(stderr, "%s has no frames towards the guest\n", path);
+        return -1;
+    }
+    printf("Replaying %zu frames from %s (", replay_count, path);
+    if (replay_speed > 0) {
+        printf("speed x%.2f", replay_speed);
+    } else {
+        printf("unpaced");
+    }
+    printf(", %d pass%s)\n", replay_loops, replay_loops == 1 ? "" : "es");
+    return 0;
+}
+
+/* Send every frame that is due; returns ns until the next one (-1: done) */
+static int64_t replay_tick(int64_t now) {
+    if (replay_done) return -1;
+    if (replay_start == 0) replay_start = now;
+
+    while (replay_next < replay_count) {
+        const ReplayFrame *f = &replay_frames[replay_next];
+        if (replay_speed > 0) {
+            int64_t due = replay_start +
+                          (int64_t)((f->ts - replay_frames[0].ts) / replay_speed);
+            if (due > now) return due - now;
+        }
+        if (!send_space(f->len)) return 0;  /* Wait for Spike to drain */
+
+        send_frame(f->data, f->len);
+        replay_sent++;
+        replay_bytes += f->len;
+        replay_next++;
+
+        if (replay_next == replay_count && --replay_loops > 0) {
+            replay_next = 0;
+            replay_start = now;
+        }
+    }
+
+    replay_done = now;
+    return -1;
+}
+
+static void replay_report(void) {
+    double secs = ((replay_done ? replay_done : now_ns()) - replay_start) / 1e9;
+    printf("\nReplay: %lu frames, %lu bytes in %.3f s", (unsigned long)replay_sent,
+           (unsigned long)replay_bytes, secs);
+    if (secs > 0) {
+        printf(" (%.0f frames/s, %.2f MB/s)", replay_sent / secs, replay_bytes / secs / 1e6);
+    }
+    printf("\nReceived %lu frames from the guest\n", (unsigned long)frames_received);
+}
+
+/*
+ * Load generator
+ *
+ * Each flow is one HTTP/1.0 GET over a fresh TCP connection from the
+ * gateway address: SYN, request on the handshake ACK, then in-order data
+ * until the guest's FIN, which is answered with FIN|ACK. Out-of-order data
+ * only triggers a duplicate ACK; the guest's own retransmission fills the
+ * gap. ACKs are coalesced to one per flow per receive batch. Local ports
+ * advance on every connection so a new SYN never lands on a guest TIME_WAIT
+ * socket, and ISNs come from a counter, so runs are repeatable.
+ *
+ * With --instret, a single probe flow fetches the firmware's /__instret
+ * counters before and after the run. The first probe also waits out the
+ * guest's boot: SYNs refused before the server listens are not counted.
+ */
+
+enum { FLOW_IDLE, FLOW_SYN_SENT, FLOW_ESTABLISHED };
+enum { PHASE_PROBE_BEFORE, PHASE_RUN, PHASE_PROBE_AFTER, PHASE_DONE };
+
+#define PROBE_PATH "/__instret"
+#define PROBE_RETRY_NS 100000000LL
+
+typedef struct Flow {
+    int state;
+    uint16_t port;
+    uint32_t iss;
+    uint32_t snd_una;
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    int retries;
+    int ack_pending;
+    int got_fin;
+    int64_t rto;
+    int64_t retransmit_at;      /* SYN or request unacknowledged */
+    int64_t start_at;           /* FLOW_IDLE: when to connect again */
+    int64_t give_up_at;
+    int64_t t_start;
+    int64_t t_connect;
+    int64_t t_first_byte;
+    uint64_t rx_bytes;
+    uint8_t status_line[12];    /* "HTTP/1.x NNN" */
+    int status_len;
+    const char *request;
+    size_t request_len;
+    char *capture;              /* Response kept here if set (probe only) */
+    size_t capture_size;
+    size_t capture_len;
+} Flow;
+
+static int load_flows = 0;
+static long load_requests = DEFAULT_REQUESTS;
+static double load_duration = 0;
+static const char *load_path = "/";
+static char load_request[512];
+static size_t load_request_len;
+static const char *json_path = NULL;
+static int use_instret = 0;
+
+static Flow *flows = NULL;
+static Flow *probe = NULL;      /* flows[load_flows] */
+static char probe_request[128];
+static char probe_response[512];
+static int phase = PHASE_RUN;
+static int32_t flow_by_port[65536];
+static int *ack_list = NULL;
+static int ack_count = 0;
+static uint16_t next_port = LOCAL_PORT_FIRST;
+static uint32_t conn_serial = 0;
+static uint16_t ip_id = 0;
+static int64_t load_start = 0;
+static int64_t load_end = 0;
+static int64_t load_stop = 0;
+static int64_t arp_sent_at = 0;
+
+/* Results */
+static long started = 0;
+static long completed = 0;
+static long resets = 0;
+static long timeouts = 0;
+static long status_class[6];
+static uint64_t rx_total = 0;
+static uint32_t *lat_connect, *lat_first, *lat_total;  /* us */
+static size_t lat_count = 0, lat_cap = 0;
+static int64_t instret_before = -1, instret_after = -1;
+static int64_t cycle_before = -1, cycle_after = -1;
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *p, size_t len) {
+    for (size_t i = 0; i + 1 < len; i += 2) sum += get16(p + i);
+    if (len & 1) sum += p[len - 1] << 8;
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum) {
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum & 0xFFFF;
+}
+
+static void tcp_send(Flow *f, uint8_t flags, uint32_t seq, const void *data, size_t len) {
     uint8_t frame[MAX_FRAME_SIZE];
-    frame[0] = (reply_len >> 8) & 0xFF;
-    frame[1] = reply_len & 0xFF;
-    memcpy(frame + 2, reply, reply_len);
+    size_t opt_len = (flags & TCP_SYN) ? 4 : 0;
+    size_t tcp_len = 20 + opt_len + len;
+    uint8_t *ip = frame + 14;
+    uint8_t *tcp = ip + 20;
+
+    memcpy(frame, guest_mac, 6);
+    memcpy(frame + 6, gateway_mac, 6);
+    put16(frame + 12, 0x0800);
+
+    ip[0] = 0x45;
+    ip[1] = 0;
+    put16(ip + 2, 20 + tcp_len);
+    put16(ip + 4, ip_id++);
+    put16(ip + 6, 0x4000);              /* Don't fragment */
+    ip[8] = 64;
+    ip[9] = 6;
+    put16(ip + 10, 0);
+    memcpy(ip + 12, gateway_ip, 4);
+    memcpy(ip + 16, guest_ip, 4);
+    put16(ip + 10, csum_fold(csum_add(0, ip, 20)));
+
+    put16(tcp, f->port);
+    put16(tcp + 2, guest_port);
+    put32(tcp + 4, seq);
+    put32(tcp + 8, (flags & TCP_ACK) ? f->rcv_nxt : 0);
+    tcp[12] = ((20 + opt_len) / 4) << 4;
+    tcp[13] = flags;
+    put16(tcp + 14, 65535);
+    put32(tcp + 16, 0);                 /* Checksum, urgent pointer */
+    if (opt_len) {
+        tcp[20] = 2;                    /* MSS */
+        tcp[21] = 4;
+        put16(tcp + 22, 1460);
+    }
+    memcpy(tcp + 20 + opt_len, data, len);
+
+    uint32_t sum = csum_add(0, ip + 12, 8) + 6 + tcp_len;
+    put16(tcp + 16, csum_fold(csum_add(sum, tcp, tcp_len)));
+
+    send_frame(frame, 14 + 20 + tcp_len);
+}
+
+static int can_start(int64_t now) {
+    if (load_duration > 0) return now < load_end;
+    return started < load_requests;
+}
+
+static void flow_start(Flow *f, int64_t now) {
+    f->port = next_port;
+    next_port = next_port == LOCAL_PORT_LAST ? LOCAL_PORT_FIRST : next_port + 1;
+    flow_by_port[f->port] = f - flows;
+
+    f->iss = 0x10000000u + conn_serial++ * 0x9E3779B1u;
+    f->snd_una = f->iss;
+    f->snd_nxt = f->iss + 1;
+    f->rcv_nxt = 0;
+    f->state = FLOW_SYN_SENT;
+    f->retries = 0;
+    f->ack_pending = 0;
+    f->got_fin = 0;
+    f->rto = TCP_RTO_INIT_NS;
+    f->retransmit_at = now + f->rto;
+    f->give_up_at = now + FLOW_TIMEOUT_NS;
+    f->t_start = now;
+    f->t_first_byte = 0;
+    f->rx_bytes = 0;
+    f->status_len = 0;
+    f->capture_len = 0;
+    if (f != probe) started++;
+
+    tcp_send(f, TCP_SYN, f->iss, NULL, 0);
+}
+
+static void flow_stop(Flow *f, int64_t restart_at) {
+    flow_by_port[f->port] = -1;
+    f->state = FLOW_IDLE;
+    f->start_at = restart_at;
+}
+
+static void record_latency(const Flow *f, int64_t now) {
+    if (lat_count == lat_cap) {
+        lat_cap = lat_cap ? lat_cap * 2 : 1024;
+        lat_connect = realloc(lat_connect, lat_cap * sizeof(uint32_t));
+        lat_first = realloc(lat_first, lat_cap * sizeof(uint32_t));
+        lat_total = realloc(lat_total, lat_cap * sizeof(uint32_t));
+        if (!lat_connect || !lat_first || !lat_total) {
+            fprintf(stderr, "Out of memory for latency samples\n");
+            exit(1);
+        }
+    }
+    int64_t first = f->t_first_byte ? f->t_first_byte : now;
+    lat_connect[lat_count] = (f->t_connect - f->t_start) / 1000;
+    lat_first[lat_count] = (first - f->t_start) / 1000;
+    lat_total[lat_count] = (now - f->t_start) / 1000;
+    lat_count++;
+}
+
+/* Pull "name N" out of the probe response; -1 if missing */
+static int64_t probe_counter(const char *name) {
+    const char *p = strstr(probe_response, "\r\n\r\n");
+    if (!p || strncmp(probe_response + 9, "200", 3) != 0) return -1;
+    p = strstr(p, name);
+    if (!p) return -1;
+    return strtoll(p + strlen(name) + 1, NULL, 10);
+}
+
+static void probe_complete(int64_t now) {
+    probe->capture[probe->capture_len] = '\0';
+    flow_stop(probe, now);
+
+    if (phase == PHASE_PROBE_BEFORE) {
+        instret_before = probe_counter("instret");
+        cycle_before = probe_counter("cycle");
+        if (instret_before < 0) {
+            fprintf(stderr, "Guest has no %s; instructions/request not reported\n", PROBE_PATH);
+        }
+        printf("Guest is serving, starting load\n");
+        phase = PHASE_RUN;
+    } else {
+        instret_after = probe_counter("instret");
+        cycle_after = probe_counter("cycle");
+        phase = PHASE_DONE;
+    }
+}
+
+static void flow_complete(Flow *f, int64_t now) {
+    if (f == probe) {
+        probe_complete(now);
+        return;
+    }
+
+    int status = 0;
+    if (f->status_len == 12) {
+        status = (f->status_line[9] - '0') * 100 + (f->status_line[10] - '0') * 10 +
+                 (f->status_line[11] - '0');
+    }
+    status_class[status >= 100 && status < 600 ? status / 100 : 0]++;
+    completed++;
+    rx_total += f->rx_bytes;
+    record_latency(f, now);
+    flow_stop(f, now);
+}
 
-    ssize_t sent = send(spike_fd, frame, reply_len + 2, 0);
-    if (sent < 0) {
-        perror("send ARP reply");
+static void queue_ack(Flow *f) {
+    if (!f->ack_pending) {
+        f->ack_pending = 1;
+        ack_list[ack_count++] = f - flows;
     }
 }
 
+/* A TCP segment from the guest to the gateway address */
+static void load_tcp_input(const uint8_t *tcp, size_t tcp_len, int64_t now) {
+    if (tcp_len < 20 || get16(tcp) != guest_port) return;
+    size_t hdr_len = (tcp[12] >> 4) * 4;
+    if (hdr_len < 20 || hdr_len > tcp_len) return;
+
+    int32_t idx = flow_by_port[get16(tcp + 2)];
+    if (idx < 0) return;
+    Flow *f = &flows[idx];
+
+    uint8_t flags = tcp[13];
+    uint32_t seq = get32(tcp + 4);
+    uint32_t ack = get32(tcp + 8);
+    const uint8_t *data = tcp + hdr_len;
+    size_t len = tcp_len - hdr_len;
+
+    if (flags & TCP_RST) {
+        if (f == probe) {
+            /* Guest still booting (or out of PCBs): ask again shortly */
+            flow_stop(f, now + PROBE_RETRY_NS);
+            return;
+        }
+        /* Usually the guest is out of PCBs; try the request again */
+        resets++;
+        started--;
+        flow_stop(f, now + FLOW_RETRY_NS);
+        return;
+    }
+
+    if (f->state == FLOW_SYN_SENT) {
+        if ((flags & (TCP_SYN | TCP_ACK)) != (TCP_SYN | TCP_ACK) || ack != f->iss + 1) return;
+        f->rcv_nxt = seq + 1;
+        f->snd_una = ack;
+        f->state = FLOW_ESTABLISHED;
+        f->t_connect = now;
+        f->retries = 0;
+        f->rto = TCP_RTO_INIT_NS;
+
+        tcp_send(f, TCP_ACK | TCP_PSH, f->snd_una, f->request, f->request_len);
+        f->snd_nxt = f->snd_una + f->request_len;
+        f->retransmit_at = now + f->rto;
+        f->give_up_at = now + FLOW_TIMEOUT_NS;
+        return;
+    }
+    if (f->state != FLOW_ESTABLISHED) return;
+
+    if ((flags & TCP_ACK) && (int32_t)(ack - f->snd_una) > 0 &&
+        (int32_t)(ack - f->snd_nxt) <= 0) {
+        f->snd_una = ack;
+        f->give_up_at = now + FLOW_TIMEOUT_NS;
+    }
+
+    if (len == 0 && !(flags & TCP_FIN)) return;
+    if (seq != f->rcv_nxt || f->got_fin) {
+        queue_ack(f);   /* Duplicate ACK */
+        return;
+    }
+
+    if (len > 0) {
+        if (!f->t_first_byte) f->t_first_byte = now;
+        for (size_t i = 0; f->status_len < 12 && i < len; i++) {
+            f->status_line[f->status_len++] = data[i];
+        }
+        if (f->capture) {
+            size_t room = f->capture_size - 1 - f->capture_len;
+            size_t n = len < room ? len : room;
+            memcpy(f->capture + f->capture_len, data, n);
+            f->capture_len += n;
+        }
+        f->rx_bytes += len;
+        f->rcv_nxt += len;
+    }
+    if (flags & TCP_FIN) {
+        f->rcv_nxt++;
+        f->got_fin = 1;
+    }
+    f->give_up_at = now + FLOW_TIMEOUT_NS;
+    queue_ack(f);
+}
+
+/* Answer everything received in this batch: one ACK per flow */
+static void load_flush_acks(int64_t now) {
+    for (int i = 0; i < ack_count; i++) {
+        Flow *f = &flows[ack_list[i]];
+        f->ack_pending = 0;
+        if (f->state != FLOW_ESTABLISHED) continue;
+
+        if (f->got_fin) {
+            tcp_send(f, TCP_FIN | TCP_ACK, f->snd_nxt, NULL, 0);
+            flow_complete(f, now);
+        } else {
+            tcp_send(f, TCP_ACK, f->snd_nxt, NULL, 0);
+        }
+    }
+    ack_count = 0;
+}
+
+/* Retransmit or give up on one flow; returns 1 while it is in progress */
+static int flow_tick(Flow *f, int64_t now) {
+    if (f->state == FLOW_IDLE) return 0;
+
+    if (now >= f->give_up_at) {
+        if (f != probe) timeouts++;
+        flow_stop(f, now);
+        return 0;
+    }
+    if (f->snd_una != f->snd_nxt && now >= f->retransmit_at) {
+        if (++f->retries > TCP_MAX_RETRIES) {
+            if (f != probe) timeouts++;
+            flow_stop(f, now);
+            return 0;
+        }
+        if (f->state == FLOW_SYN_SENT) {
+            tcp_send(f, TCP_SYN, f->iss, NULL, 0);
+        } else {
+            tcp_send(f, TCP_ACK | TCP_PSH, f->snd_una, f->request, f->request_len);
+        }
+        f->rto *= 2;
+        f->retransmit_at = now + f->rto;
+    }
+    return 1;
+}
+
+/* Start flows and retransmit; returns 0 once the run is over */
+static int load_tick(int64_t now) {
+    if (!guest_mac_known) {
+        if (now - arp_sent_at >= TCP_RTO_INIT_NS) {
+            send_arp_request();
+            arp_sent_at = now;
+        }
+        return 1;
+    }
+
+    if (phase == PHASE_PROBE_BEFORE || phase == PHASE_PROBE_AFTER) {
+        if (!flow_tick(probe, now) && now >= probe->start_at) {
+            flow_start(probe, now);
+        }
+        return 1;
+    }
+    if (phase == PHASE_DONE) return 0;
+
+    if (load_start == 0) {
+        load_start = now;
+        load_end = now + (int64_t)(load_duration * 1e9);
+    }
+
+    int active = 0;
+    for (int i = 0; i < load_flows; i++) {
+        Flow *f = &flows[i];
+        if (flow_tick(f, now)) {
+            active++;
+        } else if (now >= f->start_at && can_start(now)) {
+            flow_start(f, now);
+            active++;
+        }
+    }
+    if (active > 0 || can_start(now)) return 1;
+
+    load_stop = now;
+    if (use_instret) {
+        phase = PHASE_PROBE_AFTER;
+        probe->start_at = now;
+        return 1;
+    }
+    return 0;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Latency percentiles in ms */
+typedef struct Percentiles {
+    double p50, p90, p99, max;
+} Percentiles;
+
+static Percentiles percentiles(uint32_t *v, size_t n) {
+    qsort(v, n, sizeof(uint32_t), cmp_u32);
+    Percentiles p = {v[n * 50 / 100] / 1000.0, v[n * 90 / 100] / 1000.0,
+                     v[n * 99 / 100] / 1000.0, v[n - 1] / 1000.0};
+    return p;
+}
+
+static void json_percentiles(FILE *f, const char *name, const Percentiles *p, int last) {
+    fprintf(f, "    \"%s\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}%s\n",
+            name, p->p50, p->p90, p->p99, p->max, last ? "" : ",");
+}
+
+static void write_json(const char *path, double secs, const Percentiles *lat) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return;
+    }
+
+    fprintf(f, "{\n  \"path\": \"");
+    for (const char *c = load_path; *c; c++) {
+        if (*c == '"' || *c == '\\') fputc('\\', f);
+        if ((unsigned char)*c >= 0x20) fputc(*c, f);
+    }
+    fprintf(f, "\",\n");
+    fprintf(f, "  \"flows\": %d,\n", load_flows);
+    fprintf(f, "  \"completed\": %ld,\n", completed);
+    fprintf(f, "  \"resets\": %ld,\n", resets);
+    fprintf(f, "  \"timeouts\": %ld,\n", timeouts);
+    fprintf(f, "  \"status\": {\"2xx\": %ld, \"3xx\": %ld, \"4xx\": %ld, \"5xx\": %ld, "
+               "\"other\": %ld},\n", status_class[2], status_class[3], status_class[4],
+            status_class[5], status_class[0] + status_class[1]);
+    fprintf(f, "  \"bytes\": %lu,\n", (unsigned long)rx_total);
+    fprintf(f, "  \"duration_s\": %.6f,\n", secs);
+    fprintf(f, "  \"requests_per_s\": %.3f,\n", secs > 0 ? completed / secs : 0.0);
+    fprintf(f, "  \"mb_per_s\": %.6f,\n", secs > 0 ? rx_total / secs / 1e6 : 0.0);
+    if (lat_count > 0) {
+        fprintf(f, "  \"latency_ms\": {\n");
+        json_percentiles(f, "connect", &lat[0], 0);
+        json_percentiles(f, "first_byte", &lat[1], 0);
+        json_percentiles(f, "total", &lat[2], 1);
+        fprintf(f, "  },\n");
+    } else {
+        fprintf(f, "  \"latency_ms\": null,\n");
+    }
+    if (instret_before >= 0 && instret_after >= instret_before) {
+        int64_t instret = instret_after - instret_before;
+        fprintf(f, "  \"guest\": {\"instret\": %lld, \"cycles\": %lld, "
+                   "\"instret_per_request\": %.1f}\n", (long long)instret,
+                (long long)(cycle_after - cycle_before),
+                completed > 0 ? (double)instret / completed : 0.0);
+    } else {
+        fprintf(f, "  \"guest\": null\n");
+    }
+    fprintf(f, "}\n");
+
+    if (fclose(f) != 0) perror(path);
+}
+
+static void load_report(int64_t now) {
+    int64_t stop = load_stop ? load_stop : now;
+    double secs = load_start ? (stop - load_start) / 1e9 : 0;
+    Percentiles lat[3] = {{0}};
+
+    printf("\nLoad: %d flows, %ld requests completed in %.3f s\n", load_flows, completed, secs);
+    printf("  Status: 2xx %ld, 3xx %ld, 4xx %ld, 5xx %ld, unparsed %ld\n",
+           status_class[2], status_class[3], status_class[4], status_class[5], status_class[0]);
+    printf("  Resets: %ld, timeouts: %ld\n", resets, timeouts);
+    if (secs > 0) {
+        printf("  Throughput: %.1f req/s, %.3f MB/s\n", completed / secs, rx_total / secs / 1e6);
+    }
+    if (lat_count > 0) {
+        lat[0] = percentiles(lat_connect, lat_count);
+        lat[1] = percentiles(lat_first, lat_count);
+        lat[2] = percentiles(lat_total, lat_count);
+        printf("  Latency (ms)      p50       p90       p99       max\n");
+        const char *names[3] = {"connect", "first byte", "total"};
+        for (int i = 0; i < 3; i++) {
+            printf("  %-12s %9.2f %9.2f %9.2f %9.2f\n", names[i],
+                   lat[i].p50, lat[i].p90, lat[i].p99, lat[i].max);
+        }
+    }
+    if (instret_before >= 0 && instret_after >= instret_before && completed > 0) {
+        printf("  Guest: %.0f instructions/request\n",
+               (double)(instret_after - instret_before) / completed);
+    }
+
+    if (json_path) {
+        write_json(json_path, secs, lat);
+    }
+}
+
+static int load_init(void) {
+    load_request_len = snprintf(load_request, sizeof(load_request),
+                                "GET %s HTTP/1.0\r\nHost: %d.%d.%d.%d\r\n\r\n", load_path,
+                                guest_ip[0], guest_ip[1], guest_ip[2], guest_ip[3]);
+    if (load_request_len >= sizeof(load_request)) {
+        fprintf(stderr, "Request path too long\n");
+        return -1;
+    }
+
+    flows = calloc(load_flows + 1, sizeof(Flow));
+    ack_list = calloc(load_flows + 1, sizeof(int));
+    if (!flows || !ack_list) return -1;
+    for (int i = 0; i < 65536; i++) flow_by_port[i] = -1;
+    for (int i = 0; i < load_flows; i++) {
+        flows[i].request = load_request;
+        flows[i].request_len = load_request_len;
+    }
+
+    probe = &flows[load_flows];
+    probe->request = probe_request;
+    probe->request_len = snprintf(probe_request, sizeof(probe_request),
+                                  "GET %s HTTP/1.0\r\n\r\n", PROBE_PATH);
+    probe->capture = probe_response;
+    probe->capture_size = sizeof(probe_response);
+    if (use_instret) phase = PHASE_PROBE_BEFORE;
+
+    printf("Load: %d concurrent flows, GET %s from %d.%d.%d.%d:%u, ", load_flows, load_path,
+           guest_ip[0], guest_ip[1], guest_ip[2], guest_ip[3], guest_port);
+    if (load_duration > 0) {
+        printf("for %.1f s\n", load_duration);
+    } else {
+        printf("%ld requests\n", load_requests);
+    }
+    return 0;
+}
+
 /* Connect to Spike */
 static int connect_to_spike(const char *path) {
     int fd = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -198,6 +1112,59 @@ static int connect_to_spike(const char *path) {
     return -1;
 }
 
+/* Dispatch one frame from Spike */
+static void handle_frame(const uint8_t *frame, size_t len, int64_t now) {
+    pcapng_write(pcap, frame, len, PCAPNG_IN);
+    frames_received++;
+
+    if (mode == MODE_MONITOR || verbose) {
+        printf("\n=== RX Frame (%zu bytes) ===\n", len);
+        print_ethernet(frame, len);
+        hex_dump(frame, len > 64 ? 64 : len);
+    }
+    if (len < 14) return;
+
+    uint16_t ethertype = get16(frame + 12);
+    if (ethertype == 0x0806 && len >= 42) {
+        /* Auto-respond to ARP requests, learn the guest from replies */
+        const uint8_t *arp = frame + 14;
+        if (get16(arp + 6) == 2 && memcmp(arp + 14, guest_ip, 4) == 0) {
+            if (!guest_mac_known) {
+                memcpy(guest_mac, arp + 8, 6);
+                guest_mac_known = 1;
+                printf("Guest %d.%d.%d.%d is at %02x:%02x:%02x:%02x:%02x:%02x\n",
+                       guest_ip[0], guest_ip[1], guest_ip[2], guest_ip[3], guest_mac[0],
+                       guest_mac[1], guest_mac[2], guest_mac[3], guest_mac[4], guest_mac[5]);
+            }
+        } else {
+            send_arp_reply(frame, len);
+        }
+        return;
+    }
+
+    if (mode != MODE_LOAD || ethertype != 0x0800 || len < 34) return;
+
+    const uint8_t *ip = frame + 14;
+    size_t ihl = (ip[0] & 0x0F) * 4;
+    size_t ip_len = get16(ip + 2);
+    if ((ip[0] >> 4) != 4 || ihl < 20 || ip_len < ihl || 14 + ip_len > len) return;
+    if (ip[9] != 6 || memcmp(ip + 12, guest_ip, 4) != 0 ||
+        memcmp(ip + 16, gateway_ip, 4) != 0) {
+        return;
+    }
+    load_tcp_input(ip + ihl, ip_len - ihl, now);
+}
+
+/* Spike offered its shared-memory transport; stay on the socket */
+static void decline_shm(void) {
+    struct spike_shm_reply reply = {.zero = {0, 0}, .magic = SPIKE_SHM_MAGIC};
+    reply.status = EOPNOTSUPP;
+    if (send_buf_len + sizeof(reply) <= SEND_BUF_SIZE) {
+        memcpy(send_buf + send_buf_len, &reply, sizeof(reply));
+        send_buf_len += sizeof(reply);
+    }
+}
+
 /* Handle input from Spike */
 static void handle_spike_input(void) {
     ssize_t n = recv(spike_fd, recv_buf + recv_buf_len,
@@ -215,12 +1182,22 @@ static void handle_spike_input(void) {
     }
 
     recv_buf_len += n;
+    int64_t now = now_ns();
 
     /* Process complete frames */
     size_t offset = 0;
     while (offset + 2 <= recv_buf_len) {
         uint16_t frame_len = (recv_buf[offset] << 8) | recv_buf[offset + 1];
 
+        if (frame_len == 0 && recv_buf_len - offset < sizeof(struct spike_shm_hello)) {
+            break;  /* Possibly a shared-memory offer, wait for all of it */
+        }
+        if (frame_len == 0 && memcmp(recv_buf + offset + 2, SPIKE_SHM_MAGIC, 4) == 0) {
+            decline_shm();
+            offset += sizeof(struct spike_shm_hello);
+            continue;
+        }
+
         if (frame_len == 0 || frame_len > MAX_FRAME_SIZE) {
             fprintf(stderr, "Invalid frame length: %u\n", frame_len);
             recv_buf_len = 0;
@@ -231,21 +1208,14 @@ static void handle_spike_input(void) {
             break;
         }
 
-        const uint8_t *frame = recv_buf + offset + 2;
-
-        printf("\n=== RX Frame (%u bytes) ===\n", frame_len);
-        print_ethernet(frame, frame_len);
-        hex_dump(frame, frame_len > 64 ? 64 : frame_len);
-
-        /* Auto-respond to ARP requests */
-        uint16_t ethertype = (frame[12] << 8) | frame[13];
-        if (ethertype == 0x0806) {
-            send_arp_reply(frame, frame_len);
-        }
-
+        handle_frame(recv_buf + offset + 2, frame_len, now);
         offset += 2 + frame_len;
     }
 
+    if (mode == MODE_LOAD) {
+        load_flush_acks(now);
+    }
+
     if (offset > 0 && offset < recv_buf_len) {
         memmove(recv_buf, recv_buf + offset, recv_buf_len - offset);
         recv_buf_len -= offset;
@@ -263,6 +1233,28 @@ static void usage(const char *prog) {
     printf("Usage: %s [options]\n", prog);
     printf("Options:\n");
     printf("  --socket=PATH   Spike VirtIO socket path (default: %s)\n", DEFAULT_SOCKET_PATH);
+    printf("  --pcap=FILE     Record all frames to a pcapng file\n");
+    printf("  --pcap-snaplen=N\n");
+    printf("                  Truncate captured frames to N bytes (default: %d)\n",
+           PCAPNG_DEFAULT_SNAPLEN);
+    printf("  --pcap-rotate=MB[,FILES]\n");
+    printf("                  Cycle through FILES capture files (default: 8) of\n");
+    printf("                  at most MB megabytes each, named FILE.0, FILE.1, ...\n");
+    printf("  --replay=FILE   Send the host-to-guest frames of a pcap/pcapng file\n");
+    printf("  --replay-speed=X\n");
+    printf("                  Replay X times faster than captured (default: 1,\n");
+    printf("                  0 = as fast as Spike reads)\n");
+    printf("  --replay-loop=N Replay the capture N times (default: 1)\n");
+    printf("  --load=N        Run N concurrent HTTP GET flows against the guest\n");
+    printf("  --requests=M    Stop after M requests (default: %d)\n", DEFAULT_REQUESTS);
+    printf("  --duration=SEC  Run for SEC seconds instead of a request count\n");
+    printf("  --path=PATH     URL path to request (default: /)\n");
+    printf("  --instret       Read the guest's instruction counter before and after\n");
+    printf("                  the run (waits for the guest's HTTP server first)\n");
+    printf("  --json=FILE     Also write the load results as JSON\n");
+    printf("  --target=IP[:PORT]\n");
+    printf("                  Guest address (default: 10.0.2.15:80)\n");
+    printf("  --verbose       Print frames in replay and load modes too\n");
     printf("  --help          Show this help\n");
     printf("\nThis is a debug bridge that prints packets but does not provide\n");
     printf("actual network connectivity. For full networking, use slirp_bridge.\n");
@@ -270,10 +1262,62 @@ static void usage(const char *prog) {
 
 int main(int argc, char *argv[]) {
     const char *socket_path = DEFAULT_SOCKET_PATH;
+    const char *pcap_path = NULL;
+    uint32_t pcap_snaplen = PCAPNG_DEFAULT_SNAPLEN;
+    uint64_t pcap_rotate_mb = 0;
+    int pcap_rotate_files = 8;
 
     for (int i = 1; i < argc; i++) {
         if (strncmp(argv[i], "--socket=", 9) == 0) {
             socket_path = argv[i] + 9;
+        } else if (strncmp(argv[i], "--pcap=", 7) == 0) {
+            pcap_path = argv[i] + 7;
+        } else if (strncmp(argv[i], "--pcap-snaplen=", 15) == 0) {
+            pcap_snaplen = strtoul(argv[i] + 15, NULL, 10);
+        } else if (strncmp(argv[i], "--pcap-rotate=", 14) == 0) {
+            char *end;
+            pcap_rotate_mb = strtoull(argv[i] + 14, &end, 10);
+            if (*end == ',') {
+                pcap_rotate_files = atoi(end + 1);
+            }
+            if (pcap_rotate_mb == 0 || pcap_rotate_files <= 0) {
+                fprintf(stderr, "Invalid --pcap-rotate: %s\n", argv[i] + 14);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--replay=", 9) == 0) {
+            replay_path = argv[i] + 9;
+            mode = MODE_REPLAY;
+        } else if (strncmp(argv[i], "--replay-speed=", 15) == 0) {
+            replay_speed = atof(argv[i] + 15);
+        } else if (strncmp(argv[i], "--replay-loop=", 14) == 0) {
+            replay_loops = atoi(argv[i] + 14);
+        } else if (strncmp(argv[i], "--load=", 7) == 0) {
+            load_flows = atoi(argv[i] + 7);
+            mode = MODE_LOAD;
+        } else if (strncmp(argv[i], "--requests=", 11) == 0) {
+            load_requests = atol(argv[i] + 11);
+        } else if (strncmp(argv[i], "--duration=", 11) == 0) {
+            load_duration = atof(argv[i] + 11);
+        } else if (strncmp(argv[i], "--path=", 7) == 0) {
+            load_path = argv[i] + 7;
+        } else if (strcmp(argv[i], "--instret") == 0) {
+            use_instret = 1;
+        } else if (strncmp(argv[i], "--json=", 7) == 0) {
+            json_path = argv[i] + 7;
+        } else if (strncmp(argv[i], "--target=", 9) == 0) {
+            char addr[64];
+            snprintf(addr, sizeof(addr), "%s", argv[i] + 9);
+            char *colon = strchr(addr, ':');
+            if (colon) {
+                *colon = '\0';
+                guest_port = atoi(colon + 1);
+            }
+            if (inet_pton(AF_INET, addr, guest_ip) != 1 || guest_port == 0) {
+                fprintf(stderr, "Invalid --target: %s\n", argv[i] + 9);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = 1;
         } else if (strcmp(argv[i], "--help") == 0) {
             usage(argv[0]);
             return 0;
@@ -284,6 +1328,16 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (replay_path && load_flows > 0) {
+        fprintf(stderr, "--replay and --load are mutually exclusive\n");
+        return 1;
+    }
+    if ((mode == MODE_LOAD && load_flows <= 0) || load_requests <= 0 ||
+        replay_speed < 0 || replay_loops <= 0) {
+        fprintf(stderr, "Invalid load or replay parameters\n");
+        return 1;
+    }
+
     printf("=====================================\n");
     printf("  Debug Bridge for Spike VirtIO\n");
     printf("=====================================\n");
@@ -299,6 +1353,23 @@ int main(int argc, char *argv[]) {
     signal(SIGTERM, signal_handler);
     signal(SIGPIPE, SIG_IGN);
 
+    if (pcap_path) {
+        pcap = pcapng_open(pcap_path, "spike-virtio", pcap_snaplen,
+                           pcap_rotate_mb, pcap_rotate_files);
+        if (!pcap) {
+            fprintf(stderr, "Failed to open capture %s\n", pcap_path);
+            return 1;
+        }
+        printf("Capturing to %s%s\n", pcap_path, pcap_rotate_mb ? ".N" : "");
+    }
+
+    if (mode == MODE_REPLAY && load_replay(replay_path) < 0) {
+        return 1;
+    }
+    if (mode == MODE_LOAD && load_init() < 0) {
+        return 1;
+    }
+
     spike_fd = connect_to_spike(socket_path);
     if (spike_fd < 0) {
         return 1;
@@ -307,13 +1378,33 @@ int main(int argc, char *argv[]) {
     printf("Bridge running! Press Ctrl+C to stop\n\n");
 
     while (running) {
-        fd_set rfds;
-        struct timeval tv = {.tv_sec = 0, .tv_usec = 100000};
+        fd_set rfds, wfds;
+        int64_t wait_ns = 100000000LL;
+        int64_t now = now_ns();
+
+        if (mode == MODE_REPLAY) {
+            int64_t next = replay_tick(now);
+            if (next >= 0 && next < wait_ns) {
+                wait_ns = next;
+            } else if (next < 0 && now - replay_done >= 1000000000LL) {
+                break;  /* Done; the guest has had a second to answer */
+            }
+        } else if (mode == MODE_LOAD) {
+            if (!load_tick(now)) break;
+            wait_ns = 10000000LL;
+        }
 
         FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
         FD_SET(spike_fd, &rfds);
+        if (send_buf_len > 0) {
+            flush_send_buf();
+            if (send_buf_len > 0) FD_SET(spike_fd, &wfds);
+        }
 
-        int ret = select(spike_fd + 1, &rfds, NULL, NULL, &tv);
+        struct timeval tv = {.tv_sec = wait_ns / 1000000000LL,
+                             .tv_usec = (wait_ns % 1000000000LL) / 1000};
+        int ret = select(spike_fd + 1, &rfds, &wfds, NULL, &tv);
         if (ret < 0) {
             if (errno == EINTR) continue;
             perror("select");
@@ -323,10 +1414,29 @@ int main(int argc, char *argv[]) {
         if (FD_ISSET(spike_fd, &rfds)) {
             handle_spike_input();
         }
+        if (send_buf_len > 0) {
+            flush_send_buf();
+        }
+
+        pcapng_tick(pcap);
+    }
+
+    if (send_buf_len > 0) {
+        flush_send_buf();
+    }
+
+    if (mode == MODE_REPLAY) {
+        replay_report();
+    } else if (mode == MODE_LOAD) {
+        load_report(now_ns());
     }
 
     printf("\nShutting down...\n");
     if (spike_fd >= 0) close(spike_fd);
+    if (pcap) {
+        printf("Captured %lu frames\n", (unsigned long)pcap->frames);
+        pcapng_close(pcap);
+    }
     printf("Done.\n");
 
     return 0;
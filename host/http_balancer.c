@@ -0,0 +1,1241 @@
+/*
+ * http_balancer.c - HTTP load balancer in front of several Spike guests
+ *
+ * Accepts HTTP connections on one host port and spreads them across the
+ * per-guest ports exposed by slirp_bridge (or any other HTTP backends).
+ * Backends are picked by least connections or by a consistent hash of
+ * the request path, and are health checked with HEAD / so unresponsive
+ * guests are ejected until they answer again.
+ *
+ * With --cache, GET responses the guests mark cacheable are kept in host
+ * memory and served from there; only misses and revalidations (sent as
+ * conditional requests) reach the much slower simulated guests.
+ *
+ * Build: gcc -O2 -o http_balancer http_balancer.c
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+
+#include "../firmware/src/etag.h"
+
+#define MAX_BACKENDS 64
+#define MAX_EPOLL_EVENTS 64
+#define PROXY_BUF_SIZE 16384
+#define HASH_VNODES 64
+#define CONNECT_ATTEMPTS 3
+#define DEFAULT_LISTEN_PORT 8000
+#define DEFAULT_CHECK_INTERVAL_MS 5000
+#define DEFAULT_CHECK_TIMEOUT_MS 10000
+#define CHECK_FALL 2    /* Consecutive failures before ejection */
+#define CHECK_RISE 1    /* Consecutive successes before reinstatement */
+#define CACHE_BUCKETS 1024
+#define CACHE_MAX_OBJECT (4 * 1024 * 1024)
+
+enum { POLICY_LEASTCONN, POLICY_HASH };
+enum { EP_LISTEN, EP_CLIENT, EP_BACKEND, EP_CHECK };
+enum { CONN_READ_HEADERS, CONN_CONNECTING, CONN_PROXY, CONN_CACHE };
+enum { CACHE_BYPASS, CACHE_FILL, CACHE_REVALIDATE };
+
+/* epoll user data: which kind of fd fired and who owns it */
+typedef struct Endpoint {
+    int kind;
+    void *owner;
+} Endpoint;
+
+typedef struct Backend {
+    const char *spec;
+    struct sockaddr_in addr;
+    int healthy;
+    int active;             /* Proxied connections currently open */
+    int fails;              /* Consecutive failed checks */
+    int rises;              /* Consecutive passed checks while ejected */
+    uint64_t served;
+
+    /* In-flight health check */
+    int check_fd;
+    int check_sent;
+    int64_t check_deadline;
+    int64_t next_check;
+    char check_buf[32];
+    size_t check_len;
+    Endpoint check_ep;
+} Backend;
+
+/* One cached response: status line, headers and body as the guest sent
+ * them. Entries are reference counted so eviction cannot pull one out
+ * from under a connection that is still sending it. */
+typedef struct CacheEntry {
+    char *key;              /* Request target, query included */
+    uint8_t *data;
+    size_t len;
+    char etag[128];
+    char last_modified[64];
+    int64_t expires;        /* Serve without asking until then (ms) */
+    int refs;
+    int dead;               /* Unlinked; freed when refs drops to 0 */
+    struct CacheEntry *hash_next;
+    struct CacheEntry *lru_prev;
+    struct CacheEntry *lru_next;
+} CacheEntry;
+
+typedef struct Buffer {
+    uint8_t data[PROXY_BUF_SIZE];
+    size_t start;
+    size_t end;
+} Buffer;
+
+typedef struct Conn {
+    int state;
+    int client_fd;
+    int backend_fd;
+    uint32_t client_events;
+    uint32_t backend_events;
+    int client_eof;
+    int backend_eof;
+    int attempts;
+    int closed;
+    struct Conn *next_dead;
+    Backend *backend;
+    char path[256];
+
+    /* Cache use for this request */
+    int cache_mode;
+    int hold_down;          /* Revalidating: keep the reply until its status is known */
+    char *cache_key;
+    CacheEntry *hit;        /* Entry being served or revalidated */
+    size_t hit_off;
+    uint8_t *capture;       /* Copy of the reply being cached */
+    size_t capture_len;
+    size_t capture_size;
+
+    Buffer up;              /* Client -> backend */
+    Buffer down;            /* Backend -> client */
+    Endpoint client_ep;
+    Endpoint backend_ep;
+} Conn;
+
+typedef struct HashPoint {
+    uint32_t hash;
+    int backend;
+} HashPoint;
+
+/* Global state */
+static Backend backends[MAX_BACKENDS];
+static int backend_count = 0;
+static HashPoint hash_ring[MAX_BACKENDS * HASH_VNODES];
+static int hash_ring_len = 0;
+static int policy = POLICY_LEASTCONN;
+static int check_interval_ms = DEFAULT_CHECK_INTERVAL_MS;
+static int check_timeout_ms = DEFAULT_CHECK_TIMEOUT_MS;
+static int epoll_fd = -1;
+static Conn *dead_conns = NULL;     /* Closed this batch, freed after it */
+static size_t cache_limit = 0;      /* Bytes; 0 disables the cache */
+static size_t cache_used = 0;
+static int64_t cache_default_ttl_ms = 0;
+static CacheEntry *cache_table[CACHE_BUCKETS];
+static CacheEntry *lru_head = NULL;
+static CacheEntry *lru_tail = NULL;
+static uint64_t cache_hits = 0;
+static uint64_t cache_misses = 0;
+static uint64_t cache_revalidated = 0;
+static volatile int running = 1;
+
+static const char http_503[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Type: text/plain\r\n"
+    "Connection: close\r\n"
+    "Content-Length: 24\r\n"
+    "\r\n"
+    "No healthy backend left\n";
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Register or update an fd in the epoll set, skipping no-op changes */
+static void ep_update(int fd, Endpoint *ep, uint32_t *cur, uint32_t events) {
+    if (*cur == events) return;
+
+    struct epoll_event ev = {.events = events, .data.ptr = ep};
+    int op = *cur ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (!events) op = EPOLL_CTL_DEL;
+    if (epoll_ctl(epoll_fd, op, fd, &ev) < 0 && op != EPOLL_CTL_DEL) {
+        perror("epoll_ctl");
+    }
+    *cur = events;
+}
+
+/* Start a non-blocking connect; returns fd or -1 */
+static int connect_nonblocking(const struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    set_nonblocking(fd);
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 &&
+        errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* FNV-1a, used for the consistent hash ring */
+static uint32_t hash_bytes(const char *s, size_t len, uint32_t h) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int cmp_hash_point(const void *a, const void *b) {
+    uint32_t ha = ((const HashPoint *)a)->hash;
+    uint32_t hb = ((const HashPoint *)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+/* Place HASH_VNODES points per backend on the ring */
+static void build_hash_ring(void) {
+    hash_ring_len = 0;
+    for (int b = 0; b < backend_count; b++) {
+        for (int v = 0; v < HASH_VNODES; v++) {
+            char key[96];
+            int n = snprintf(key, sizeof(key), "%s#%d", backends[b].spec, v);
+            hash_ring[hash_ring_len].hash = hash_bytes(key, n, 2166136261u);
+            hash_ring[hash_ring_len].backend = b;
+            hash_ring_len++;
+        }
+    }
+    qsort(hash_ring, hash_ring_len, sizeof(HashPoint), cmp_hash_point);
+}
+
+/* Pick a healthy backend, never returning 'avoid' if there is a choice */
+static Backend *pick_backend(const char *path, Backend *avoid) {
+    if (policy == POLICY_HASH && hash_ring_len > 0) {
+        uint32_t h = hash_bytes(path, strlen(path), 2166136261u);
+
+        /* First ring point at or after h, then walk to a healthy backend */
+        int lo = 0, hi = hash_ring_len;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (hash_ring[mid].hash < h) lo = mid + 1;
+            else hi = mid;
+        }
+        for (int i = 0; i < hash_ring_len; i++) {
+            Backend *b = &backends[hash_ring[(lo + i) % hash_ring_len].backend];
+            if (b->healthy && b != avoid) return b;
+        }
+        return (avoid && avoid->healthy) ? avoid : NULL;
+    }
+
+    /* Least connections; ties go to the backend that has served least */
+    Backend *best = NULL;
+    for (int i = 0; i < backend_count; i++) {
+        Backend *b = &backends[i];
+        if (!b->healthy || b == avoid) continue;
+        if (!best || b->active < best->active ||
+            (b->active == best->active && b->served < best->served)) {
+            best = b;
+        }
+    }
+    return best ? best : ((avoid && avoid->healthy) ? avoid : NULL);
+}
+
+/* Record a health result and log state changes */
+static void backend_report(Backend *b, int ok) {
+    if (ok) {
+        b->fails = 0;
+        if (!b->healthy && ++b->rises >= CHECK_RISE) {
+            b->healthy = 1;
+            b->rises = 0;
+            printf("Backend %s is up\n", b->spec);
+        }
+    } else {
+        b->rises = 0;
+        if (b->healthy && ++b->fails >= CHECK_FALL) {
+            b->healthy = 0;
+            printf("Backend %s ejected (not responding)\n", b->spec);
+        }
+    }
+}
+
+/* Health checks */
+
+static void check_finish(Backend *b, int ok) {
+    if (b->check_fd >= 0) {
+        uint32_t cur = 1;   /* Force EPOLL_CTL_DEL */
+        ep_update(b->check_fd, &b->check_ep, &cur, 0);
+        close(b->check_fd);
+        b->check_fd = -1;
+    }
+    b->next_check = now_ms() + check_interval_ms;
+    backend_report(b, ok);
+}
+
+static void check_start(Backend *b) {
+    b->check_fd = connect_nonblocking(&b->addr);
+    if (b->check_fd < 0) {
+        check_finish(b, 0);
+        return;
+    }
+
+    b->check_sent = 0;
+    b->check_len = 0;
+    b->check_deadline = now_ms() + check_timeout_ms;
+
+    uint32_t cur = 0;
+    ep_update(b->check_fd, &b->check_ep, &cur, EPOLLOUT);
+}
+
+static void check_event(Backend *b, uint32_t events) {
+    /* Headers only: the guest answers HEAD without reading the file */
+    static const char req[] = "HEAD / HTTP/1.0\r\nConnection: close\r\n\r\n";
+
+    if (!b->check_sent) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(b->check_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err || (events & EPOLLERR) ||
+            send(b->check_fd, req, sizeof(req) - 1, 0) != (ssize_t)(sizeof(req) - 1)) {
+            check_finish(b, 0);
+            return;
+        }
+        b->check_sent = 1;
+        uint32_t cur = EPOLLOUT;
+        ep_update(b->check_fd, &b->check_ep, &cur, EPOLLIN);
+        return;
+    }
+
+    /* Only the status line matters: "HTTP/1.x NNN" */
+    ssize_t n = recv(b->check_fd, b->check_buf + b->check_len,
+                     sizeof(b->check_buf) - 1 - b->check_len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (n > 0) b->check_len += n;
+
+    if (b->check_len >= 12 || n <= 0) {
+        b->check_buf[b->check_len] = '\0';
+        int status = 0;
+        if (b->check_len >= 12 && strncmp(b->check_buf, "HTTP/1.", 7) == 0) {
+            status = atoi(b->check_buf + 9);
+        }
+        check_finish(b, status >= 200 && status < 400);
+    }
+}
+
+/* Start due checks, time out stuck ones; returns ms until next deadline */
+static int run_health_checks(void) {
+    int64_t now = now_ms();
+    int64_t next = now + check_interval_ms;
+
+    for (int i = 0; i < backend_count; i++) {
+        Backend *b = &backends[i];
+        if (b->check_fd >= 0 && now >= b->check_deadline) {
+            check_finish(b, 0);
+        }
+        if (b->check_fd < 0 && now >= b->next_check) {
+            check_start(b);
+        }
+        int64_t due = b->check_fd >= 0 ? b->check_deadline : b->next_check;
+        if (due < next) next = due;
+    }
+
+    return next > now ? (int)(next - now) : 0;
+}
+
+/* Proxy buffers */
+
+/* Move bytes from fd into buf, counting them in *got; returns 0 on EOF,
+ * -1 on error, 1 otherwise */
+static int buf_fill(Buffer *buf, int fd, size_t *got) {
+    *got = 0;
+    if (buf->start == buf->end) buf->start = buf->end = 0;
+    if (buf->end == PROXY_BUF_SIZE) return 1;
+
+    ssize_t n = recv(fd, buf->data + buf->end, PROXY_BUF_SIZE - buf->end, 0);
+    if (n > 0) {
+        buf->end += n;
+        *got = n;
+        return 1;
+    }
+    if (n == 0) return 0;
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 1 : -1;
+}
+
+/* Move bytes from buf to fd; returns -1 on error */
+static int buf_drain(Buffer *buf, int fd) {
+    if (buf->end == buf->start) return 0;
+
+    ssize_t n = send(fd, buf->data + buf->start, buf->end - buf->start, MSG_NOSIGNAL);
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    buf->start += n;
+    if (buf->start == buf->end) buf->start = buf->end = 0;
+    return 0;
+}
+
+/* Response cache */
+
+/* Find a header's value in a header block; NULL if absent */
+static const char *find_header(const uint8_t *hdr, size_t len, const char *name, size_t *vlen) {
+    const char *p = (const char *)hdr;
+    const char *end = p + len;
+    size_t nlen = strlen(name);
+
+    /* The first line is the request or status line */
+    const char *nl = memchr(p, '\n', len);
+    while (nl && nl + 1 < end) {
+        const char *line = nl + 1;
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+
+        if ((size_t)(eol - line) > nlen && line[nlen] == ':' &&
+            strncasecmp(line, name, nlen) == 0) {
+            const char *v = line + nlen + 1;
+            const char *ve = eol;
+            while (v < ve && (*v == ' ' || *v == '\t')) v++;
+            while (ve > v && (ve[-1] == '\r' || ve[-1] == ' ')) ve--;
+            *vlen = ve - v;
+            return v;
+        }
+        nl = eol < end ? eol : NULL;
+    }
+    return NULL;
+}
+
+/* Look up a Cache-Control directive. Returns -1 if absent, its numeric
+ * argument if it has one, else 0. */
+static long cache_directive(const char *v, size_t vlen, const char *name) {
+    size_t nlen = strlen(name);
+    const char *end = v + vlen;
+
+    while (v < end) {
+        while (v < end && (*v == ' ' || *v == ',')) v++;
+        const char *tok = v;
+        while (v < end && *v != ',') v++;
+
+        if ((size_t)(v - tok) >= nlen && strncasecmp(tok, name, nlen) == 0 &&
+            (tok + nlen == v || tok[nlen] == '=' || tok[nlen] == ' ')) {
+            return tok[nlen] == '=' ? strtol(tok + nlen + 1, NULL, 10) : 0;
+        }
+    }
+    return -1;
+}
+
+/* Copy a header value into a fixed buffer; empty if absent or too long */
+static void copy_header(const uint8_t *hdr, size_t len, const char *name, char *out, size_t size) {
+    size_t vlen;
+    const char *v = find_header(hdr, len, name, &vlen);
+    out[0] = '\0';
+    if (v && vlen < size) {
+        memcpy(out, v, vlen);
+        out[vlen] = '\0';
+    }
+}
+
+/* How long a response may be served without asking the guest (ms).
+ * Returns -1 if it must not be stored at all. */
+static int response_freshness(const uint8_t *hdr, size_t len, int64_t *ttl_ms) {
+    size_t vlen;
+    if (find_header(hdr, len, "Set-Cookie", &vlen) || find_header(hdr, len, "Vary", &vlen)) {
+        return -1;
+    }
+
+    const char *cc = find_header(hdr, len, "Cache-Control", &vlen);
+    if (cc) {
+        if (cache_directive(cc, vlen, "no-store") >= 0 || cache_directive(cc, vlen, "private") >= 0) {
+            return -1;
+        }
+        if (cache_directive(cc, vlen, "no-cache") >= 0) {
+            *ttl_ms = 0;
+            return 0;
+        }
+        long age = cache_directive(cc, vlen, "s-maxage");
+        if (age < 0) age = cache_directive(cc, vlen, "max-age");
+        if (age >= 0) {
+            *ttl_ms = (int64_t)age * 1000;
+            return 0;
+        }
+    }
+
+    *ttl_ms = cache_default_ttl_ms;
+    return 0;
+}
+
+static CacheEntry **cache_bucket(const char *key) {
+    return &cache_table[hash_bytes(key, strlen(key), 2166136261u) % CACHE_BUCKETS];
+}
+
+static CacheEntry *cache_lookup(const char *key) {
+    for (CacheEntry *e = *cache_bucket(key); e; e = e->hash_next) {
+        if (strcmp(e->key, key) == 0) return e;
+    }
+    return NULL;
+}
+
+static size_t cache_entry_size(const CacheEntry *e) {
+    return sizeof(*e) + e->len + strlen(e->key) + 1;
+}
+
+static void cache_free(CacheEntry *e) {
+    free(e->key);
+    free(e->data);
+    free(e);
+}
+
+static void lru_remove(CacheEntry *e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(CacheEntry *e) {
+    e->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = e;
+    lru_head = e;
+    if (!lru_tail) lru_tail = e;
+}
+
+static void cache_touch(CacheEntry *e) {
+    if (e->dead || lru_head == e) return;
+    lru_remove(e);
+    lru_push_front(e);
+}
+
+/* Take an entry out of the cache; freed now or by its last user */
+static void cache_unlink(CacheEntry *e) {
+    CacheEntry **pp = cache_bucket(e->key);
+    while (*pp && *pp != e) pp = &(*pp)->hash_next;
+    if (*pp) *pp = e->hash_next;
+
+    lru_remove(e);
+    cache_used -= cache_entry_size(e);
+    e->dead = 1;
+    if (e->refs == 0) cache_free(e);
+}
+
+static void cache_release(CacheEntry *e) {
+    if (--e->refs == 0 && e->dead) cache_free(e);
+}
+
+/* Store a complete response, evicting least recently used entries */
+static void cache_insert(const char *key, uint8_t *data, size_t len, const uint8_t *hdr,
+                         size_t hdr_len, int64_t ttl_ms) {
+    CacheEntry *old = cache_lookup(key);
+    if (old) cache_unlink(old);
+
+    CacheEntry *e = calloc(1, sizeof(CacheEntry));
+    if (!e || !(e->key = strdup(key))) {
+        free(e);
+        free(data);
+        return;
+    }
+    e->data = data;
+    e->len = len;
+    e->expires = now_ms() + ttl_ms;
+    copy_header(hdr, hdr_len, "ETag", e->etag, sizeof(e->etag));
+    copy_header(hdr, hdr_len, "Last-Modified", e->last_modified, sizeof(e->last_modified));
+
+    size_t size = cache_entry_size(e);
+    if (size > cache_limit) {
+        cache_free(e);
+        return;
+    }
+    while (cache_used + size > cache_limit && lru_tail) {
+        cache_unlink(lru_tail);
+    }
+
+    CacheEntry **bucket = cache_bucket(key);
+    e->hash_next = *bucket;
+    *bucket = e;
+    lru_push_front(e);
+    cache_used += size;
+}
+
+/* Append reply bytes to the capture; gives up on oversized objects */
+static void cache_capture(Conn *c, const uint8_t *data, size_t len) {
+    if (c->capture_len + len > c->capture_size) {
+        size_t size = c->capture_size ? c->capture_size : PROXY_BUF_SIZE;
+        while (size < c->capture_len + len) size *= 2;
+
+        uint8_t *buf = NULL;
+        if (size <= CACHE_MAX_OBJECT && size <= cache_limit) {
+            buf = realloc(c->capture, size);
+        }
+        if (!buf) {
+            free(c->capture);
+            c->capture = NULL;
+            c->capture_len = c->capture_size = 0;
+            c->cache_mode = CACHE_BYPASS;
+            return;
+        }
+        c->capture = buf;
+        c->capture_size = size;
+    }
+    memcpy(c->capture + c->capture_len, data, len);
+    c->capture_len += len;
+}
+
+/* The guest finished its reply: store it if it is complete and cacheable */
+static void cache_fill_done(Conn *c) {
+    uint8_t *data = c->capture;
+    size_t len = c->capture_len;
+    c->capture = NULL;
+    c->capture_len = c->capture_size = 0;
+    c->cache_mode = CACHE_BYPASS;
+
+    const uint8_t *end = data ? memmem(data, len, "\r\n\r\n", 4) : NULL;
+    if (!end || len < 12 || memcmp(data, "HTTP/1.", 7) != 0 || atoi((char *)data + 9) != 200) {
+        free(data);
+        return;
+    }
+    size_t hdr_len = end + 4 - data;
+
+    size_t vlen;
+    const char *cl = find_header(data, hdr_len, "Content-Length", &vlen);
+    int64_t ttl;
+    if ((cl && strtoull(cl, NULL, 10) != len - hdr_len) ||
+        response_freshness(data, hdr_len, &ttl) < 0) {
+        free(data);
+        return;
+    }
+
+    /* Already stale and no way to revalidate: not worth keeping */
+    if (ttl == 0 && !find_header(data, hdr_len, "ETag", &vlen) &&
+        !find_header(data, hdr_len, "Last-Modified", &vlen)) {
+        free(data);
+        return;
+    }
+
+    cache_insert(c->cache_key, data, len, data, hdr_len, ttl);
+}
+
+/* Decide how a request uses the cache. Returns 1 if it is answered
+ * from memory (the connection moves to CONN_CACHE), 0 to forward it. */
+static int cache_request(Conn *c) {
+    const uint8_t *req = c->up.data;
+    const uint8_t *end = memmem(req, c->up.end, "\r\n\r\n", 4);
+    if (!end) return 0;
+    size_t hdr_len = end + 4 - req;
+
+    const uint8_t *sp = memchr(req, ' ', hdr_len);
+    if (!sp) return 0;
+    const uint8_t *target = sp + 1;
+    const uint8_t *target_end = memchr(target, ' ', end - target);
+    if (!target_end) return 0;
+
+    char *key = strndup((const char *)target, target_end - target);
+    if (!key) return 0;
+
+    /* Anything that may change the resource drops the cached copy */
+    size_t mlen = sp - req;
+    int is_get = mlen == 3 && memcmp(req, "GET", 3) == 0;
+    int is_head = mlen == 4 && memcmp(req, "HEAD", 4) == 0;
+    if (!is_get) {
+        CacheEntry *e = is_head ? NULL : cache_lookup(key);
+        if (e) cache_unlink(e);
+        free(key);
+        return 0;
+    }
+
+    size_t vlen;
+    const char *cc = find_header(req, hdr_len, "Cache-Control", &vlen);
+    if (find_header(req, hdr_len, "Authorization", &vlen) ||
+        (cc && cache_directive(cc, vlen, "no-store") >= 0)) {
+        free(key);
+        return 0;
+    }
+    int force = cc && (cache_directive(cc, vlen, "no-cache") >= 0 ||
+                       cache_directive(cc, vlen, "max-age") == 0);
+    const char *pragma = find_header(req, hdr_len, "Pragma", &vlen);
+    if (pragma && vlen >= 8 && strncasecmp(pragma, "no-cache", 8) == 0) force = 1;
+
+    c->cache_key = key;
+    c->cache_mode = CACHE_FILL;
+
+    CacheEntry *e = cache_lookup(key);
+    if (!e) {
+        cache_misses++;
+        return 0;
+    }
+
+    size_t inm_len;
+    const char *inm = find_header(req, hdr_len, "If-None-Match", &inm_len);
+    const char *ims = find_header(req, hdr_len, "If-Modified-Since", &vlen);
+
+    if (!force && now_ms() < e->expires) {
+        cache_hits++;
+        cache_touch(e);
+
+        if (inm && etag_match(inm, inm_len, e->etag)) {
+            /* The client already has this version */
+            int n = snprintf((char *)c->down.data, PROXY_BUF_SIZE,
+                             "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n"
+                             "Connection: close\r\n\r\n", e->etag);
+            c->down.start = 0;
+            c->down.end = n;
+        } else {
+            c->hit = e;
+            e->refs++;
+            c->hit_off = 0;
+        }
+        c->cache_mode = CACHE_BYPASS;
+        c->state = CONN_CACHE;
+        c->up.start = c->up.end = 0;
+        return 1;
+    }
+
+    /* Stale: ask the guest whether our copy is still current, unless the
+     * client is revalidating its own copy */
+    if ((e->etag[0] || e->last_modified[0]) && !inm && !ims) {
+        char extra[256];
+        int n = 0;
+        if (e->etag[0]) {
+            n += snprintf(extra + n, sizeof(extra) - n, "If-None-Match: %s\r\n", e->etag);
+        }
+        if (e->last_modified[0]) {
+            n += snprintf(extra + n, sizeof(extra) - n, "If-Modified-Since: %s\r\n",
+                          e->last_modified);
+        }
+
+        size_t at = end + 2 - req;
+        if (n < (int)sizeof(extra) && c->up.end + n <= PROXY_BUF_SIZE) {
+            memmove(c->up.data + at + n, c->up.data + at, c->up.end - at);
+            memcpy(c->up.data + at, extra, n);
+            c->up.end += n;
+            c->cache_mode = CACHE_REVALIDATE;
+            c->hold_down = 1;
+            c->hit = e;
+            e->refs++;
+            return 0;
+        }
+    }
+
+    cache_misses++;
+    return 0;
+}
+
+/* Revalidation reply arriving: a 304 turns the request into a hit,
+ * anything else is passed on (and cached) like a miss. Returns 1 if the
+ * connection switched to serving from the cache. */
+static int cache_check_revalidation(Conn *c) {
+    const uint8_t *d = c->down.data + c->down.start;
+    size_t len = c->down.end - c->down.start;
+    const uint8_t *end = memmem(d, len, "\r\n\r\n", 4);
+    if (!end && c->down.end < PROXY_BUF_SIZE && !c->backend_eof) return 0;
+
+    c->hold_down = 0;
+    CacheEntry *e = c->hit;
+
+    if (end && len >= 12 && memcmp(d, "HTTP/1.", 7) == 0 && atoi((const char *)d + 9) == 304) {
+        int64_t ttl;
+        if (response_freshness(d, end + 4 - d, &ttl) < 0) ttl = 0;
+        e->expires = now_ms() + ttl;
+        cache_touch(e);
+        cache_revalidated++;
+
+        ep_update(c->backend_fd, &c->backend_ep, &c->backend_events, 0);
+        close(c->backend_fd);
+        c->backend_fd = -1;
+        c->backend->active--;
+        c->backend = NULL;
+
+        c->down.start = c->down.end = 0;
+        c->hit_off = 0;
+        c->cache_mode = CACHE_BYPASS;
+        c->state = CONN_CACHE;
+        return 1;
+    }
+
+    cache_release(e);
+    c->hit = NULL;
+    c->cache_mode = CACHE_FILL;
+    cache_misses++;
+    cache_capture(c, d, len);
+    return 0;
+}
+
+/* Send the cached reply (or a generated one in c->down). Returns 1 when
+ * everything is sent, -1 on error, 0 to wait for more room. */
+static int cache_send(Conn *c) {
+    if (!c->hit) {
+        if (buf_drain(&c->down, c->client_fd) < 0) return -1;
+        return c->down.end == c->down.start;
+    }
+
+    CacheEntry *e = c->hit;
+    ssize_t n = send(c->client_fd, e->data + c->hit_off, e->len - c->hit_off, MSG_NOSIGNAL);
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    c->hit_off += n;
+    return c->hit_off == e->len;
+}
+
+/* Proxied connections */
+
+static void conn_close(Conn *c) {
+    if (c->client_fd >= 0) {
+        ep_update(c->client_fd, &c->client_ep, &c->client_events, 0);
+        close(c->client_fd);
+    }
+    if (c->backend_fd >= 0) {
+        ep_update(c->backend_fd, &c->backend_ep, &c->backend_events, 0);
+        close(c->backend_fd);
+    }
+    if (c->backend) {
+        c->backend->active--;
+    }
+    if (c->hit) {
+        cache_release(c->hit);
+    }
+    free(c->capture);
+    free(c->cache_key);
+
+    /* Other events for this connection may still be in the current batch */
+    c->closed = 1;
+    c->next_dead = dead_conns;
+    dead_conns = c;
+}
+
+/* Recompute epoll interest from buffer and EOF state */
+static void conn_update_events(Conn *c) {
+    uint32_t client = 0, backend = 0;
+    int up_room = c->up.end < PROXY_BUF_SIZE;
+    int down_room = c->down.end < PROXY_BUF_SIZE;
+
+    if (c->state == CONN_CACHE) {
+        client = EPOLLOUT;
+    } else {
+        if (!c->client_eof && up_room && c->state != CONN_CONNECTING) client |= EPOLLIN;
+        if (c->down.end > c->down.start && !c->hold_down) client |= EPOLLOUT;
+    }
+
+    if (c->backend_fd >= 0) {
+        if (c->state == CONN_CONNECTING) {
+            backend = EPOLLOUT;
+        } else {
+            if (!c->backend_eof && down_room) backend |= EPOLLIN;
+            if (c->up.end > c->up.start) backend |= EPOLLOUT;
+        }
+    }
+
+    ep_update(c->client_fd, &c->client_ep, &c->client_events, client);
+    if (c->backend_fd >= 0) {
+        ep_update(c->backend_fd, &c->backend_ep, &c->backend_events, backend);
+    }
+}
+
+/* Extract the request path (without query) for hashing and logging */
+static int parse_request_path(Conn *c) {
+    const char *req = (const char *)c->up.data;
+    size_t len = c->up.end;
+
+    size_t i = 0;
+    while (i < len && req[i] != ' ') i++;
+    if (++i >= len) return -1;
+
+    size_t j = 0;
+    while (i < len && j < sizeof(c->path) - 1) {
+        char ch = req[i];
+        if (ch == ' ' || ch == '?' || ch == '#' || ch == '\r' || ch == '\n') break;
+        c->path[j++] = ch;
+        i++;
+    }
+    c->path[j] = '\0';
+    return j > 0 ? 0 : -1;
+}
+
+/* Connect to a backend, trying others if the connect fails outright */
+static int conn_connect(Conn *c, Backend *avoid) {
+    while (c->attempts < CONNECT_ATTEMPTS) {
+        Backend *b = pick_backend(c->path, avoid);
+        if (!b) break;
+        c->attempts++;
+
+        int fd = connect_nonblocking(&b->addr);
+        if (fd >= 0) {
+            c->backend = b;
+            c->backend_fd = fd;
+            b->active++;
+            b->served++;
+            c->state = CONN_CONNECTING;
+            return 0;
+        }
+        backend_report(b, 0);
+        avoid = b;
+    }
+
+    /* Nothing healthy: answer directly and hang up */
+    ssize_t r = send(c->client_fd, http_503, sizeof(http_503) - 1, MSG_NOSIGNAL);
+    (void)r;
+    return -1;
+}
+
+/* Backend connect finished (or failed) */
+static int conn_connected(Conn *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(c->backend_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (!err) {
+        c->state = CONN_PROXY;
+        return 0;
+    }
+
+    /* Passive failure: count it and retry elsewhere */
+    Backend *failed = c->backend;
+    backend_report(failed, 0);
+    failed->active--;
+    ep_update(c->backend_fd, &c->backend_ep, &c->backend_events, 0);
+    close(c->backend_fd);
+    c->backend_fd = -1;
+    c->backend = NULL;
+    return conn_connect(c, failed);
+}
+
+static void conn_event(Conn *c, int is_backend, uint32_t events) {
+    size_t got;
+
+    if (c->closed) return;
+
+    if (!is_backend && c->state == CONN_CACHE) {
+        /* Answered from memory; the reply ends with Connection: close */
+        if ((events & EPOLLERR) || cache_send(c) != 0) goto close;
+        conn_update_events(c);
+        return;
+    }
+
+    if (!is_backend) {
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            int r = buf_fill(&c->up, c->client_fd, &got);
+            if (r < 0) goto close;
+            if (r == 0) c->client_eof = 1;
+        }
+
+        if (c->state == CONN_READ_HEADERS) {
+            /* Wait for the full header block (or a full buffer) */
+            int complete = c->up.end == PROXY_BUF_SIZE ||
+                           memmem(c->up.data, c->up.end, "\r\n\r\n", 4) != NULL;
+            if (!complete && !c->client_eof) {
+                conn_update_events(c);
+                return;
+            }
+            if (parse_request_path(c) < 0) goto close;
+            if (cache_limit > 0 && cache_request(c)) {
+                conn_update_events(c);
+                return;
+            }
+            if (conn_connect(c, NULL) < 0) goto close;
+        }
+
+        if (events & EPOLLOUT) {
+            if (buf_drain(&c->down, c->client_fd) < 0) goto close;
+        }
+    } else {
+        if (c->state == CONN_CONNECTING) {
+            if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+            if (conn_connected(c) < 0) goto close;
+            if (c->state == CONN_CONNECTING) {
+                conn_update_events(c);
+                return;
+            }
+        }
+
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            int r = buf_fill(&c->down, c->backend_fd, &got);
+            if (r < 0) goto close;
+            if (r == 0) c->backend_eof = 1;
+            if (got && c->cache_mode == CACHE_FILL) {
+                cache_capture(c, c->down.data + c->down.end - got, got);
+            }
+        }
+        if (c->hold_down && cache_check_revalidation(c)) {
+            conn_update_events(c);
+            return;
+        }
+        if (c->backend_eof && c->cache_mode == CACHE_FILL) {
+            cache_fill_done(c);
+        }
+        if (buf_drain(&c->up, c->backend_fd) < 0) goto close;
+        if (!c->hold_down && buf_drain(&c->down, c->client_fd) < 0) goto close;
+    }
+
+    if (c->state == CONN_PROXY) {
+        /* Propagate half-closes once the matching buffer is drained */
+        if (c->client_eof && c->up.end == c->up.start) {
+            shutdown(c->backend_fd, SHUT_WR);
+        }
+        if (c->backend_eof && c->down.end == c->down.start) {
+            goto close;
+        }
+    }
+
+    conn_update_events(c);
+    return;
+
+close:
+    conn_close(c);
+}
+
+static void accept_clients(int listen_fd) {
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+        set_nonblocking(fd);
+
+        Conn *c = calloc(1, sizeof(Conn));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->state = CONN_READ_HEADERS;
+        c->client_fd = fd;
+        c->backend_fd = -1;
+        c->client_ep.kind = EP_CLIENT;
+        c->client_ep.owner = c;
+        c->backend_ep.kind = EP_BACKEND;
+        c->backend_ep.owner = c;
+        conn_update_events(c);
+    }
+}
+
+/* Parse HOST:PORT (HOST defaults to 127.0.0.1 if omitted) */
+static int parse_backend(const char *spec) {
+    if (backend_count >= MAX_BACKENDS) {
+        fprintf(stderr, "Too many backends (max %d)\n", MAX_BACKENDS);
+        return -1;
+    }
+
+    Backend *b = &backends[backend_count];
+    memset(b, 0, sizeof(*b));
+    b->spec = spec;
+    b->addr.sin_family = AF_INET;
+    b->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    const char *colon = strrchr(spec, ':');
+    const char *port = colon ? colon + 1 : spec;
+    if (colon) {
+        char host[64];
+        size_t n = colon - spec;
+        if (n >= sizeof(host)) {
+            fprintf(stderr, "Invalid backend address: %s\n", spec);
+            return -1;
+        }
+        memcpy(host, spec, n);
+        host[n] = '\0';
+        if (inet_pton(AF_INET, host, &b->addr.sin_addr) != 1) {
+            fprintf(stderr, "Invalid backend address: %s\n", spec);
+            return -1;
+        }
+    }
+    int p = atoi(port);
+    if (p <= 0 || p > 65535) {
+        fprintf(stderr, "Invalid backend port: %s\n", spec);
+        return -1;
+    }
+    b->addr.sin_port = htons(p);
+    b->healthy = 1;     /* Optimistic until checks say otherwise */
+    b->check_fd = -1;
+    b->check_ep.kind = EP_CHECK;
+    b->check_ep.owner = b;
+    backend_count++;
+    return 0;
+}
+
+static void signal_handler(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [options] --backend=[HOST:]PORT ...\n", prog);
+    printf("Options:\n");
+    printf("  --listen=PORT          Host port to accept HTTP on (default: %d)\n", DEFAULT_LISTEN_PORT);
+    printf("  --backend=[HOST:]PORT  Backend to balance across (repeatable)\n");
+    printf("  --policy=leastconn|hash\n");
+    printf("                         Least connections (default) or consistent\n");
+    printf("                         hash of the request path\n");
+    printf("  --check-interval=MS    Health check period (default: %d)\n", DEFAULT_CHECK_INTERVAL_MS);
+    printf("  --check-timeout=MS     Health check timeout (default: %d)\n", DEFAULT_CHECK_TIMEOUT_MS);
+    printf("  --cache=MB             Cache GET responses in up to MB of memory\n");
+    printf("  --cache-ttl=SEC        Freshness for cached responses without\n");
+    printf("                         Cache-Control max-age (default: 0, revalidate)\n");
+    printf("  --help                 Show this help\n");
+    printf("\nExample (two guests behind one slirp_bridge):\n");
+    printf("  slirp_bridge --socket=/tmp/s0.sock --socket=/tmp/s1.sock --fwd=8080:80\n");
+    printf("  %s --listen=8000 --backend=8080 --backend=8081\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int listen_port = DEFAULT_LISTEN_PORT;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--listen=", 9) == 0) {
+            listen_port = atoi(argv[i] + 9);
+        } else if (strncmp(argv[i], "--backend=", 10) == 0) {
+            if (parse_backend(argv[i] + 10) < 0) return 1;
+        } else if (strcmp(argv[i], "--policy=leastconn") == 0) {
+            policy = POLICY_LEASTCONN;
+        } else if (strcmp(argv[i], "--policy=hash") == 0) {
+            policy = POLICY_HASH;
+        } else if (strncmp(argv[i], "--check-interval=", 17) == 0) {
+            check_interval_ms = atoi(argv[i] + 17);
+        } else if (strncmp(argv[i], "--check-timeout=", 16) == 0) {
+            check_timeout_ms = atoi(argv[i] + 16);
+        } else if (strncmp(argv[i], "--cache=", 8) == 0) {
+            cache_limit = (size_t)atol(argv[i] + 8) * 1024 * 1024;
+        } else if (strncmp(argv[i], "--cache-ttl=", 12) == 0) {
+            cache_default_ttl_ms = (int64_t)atol(argv[i] + 12) * 1000;
+        } else if (strcmp(argv[i], "--help") == 0) {
+            usage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (backend_count == 0) {
+        fprintf(stderr, "At least one --backend is required\n");
+        usage(argv[0]);
+        return 1;
+    }
+    if (check_interval_ms <= 0) check_interval_ms = DEFAULT_CHECK_INTERVAL_MS;
+    if (check_timeout_ms <= 0) check_timeout_ms = DEFAULT_CHECK_TIMEOUT_MS;
+
+    build_hash_ring();
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(listen_port);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 128) < 0) {
+        perror("bind/listen");
+        return 1;
+    }
+    set_nonblocking(listen_fd);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    Endpoint listen_ep = {.kind = EP_LISTEN, .owner = NULL};
+    uint32_t listen_events = 0;
+    ep_update(listen_fd, &listen_ep, &listen_events, EPOLLIN);
+
+    printf("=====================================\n");
+    printf("  HTTP Balancer for Spike guests\n");
+    printf("=====================================\n");
+    printf("Listening on: http://localhost:%d\n", listen_port);
+    printf("Policy: %s\n", policy == POLICY_HASH ? "consistent hash (path)" : "least connections");
+    for (int i = 0; i < backend_count; i++) {
+        printf("Backend %d: %s\n", i, backends[i].spec);
+    }
+    printf("Health check: HEAD / every %d ms (timeout %d ms)\n",
+           check_interval_ms, check_timeout_ms);
+    if (cache_limit > 0) {
+        printf("Cache: %zu MB (default TTL %lld s)\n", cache_limit >> 20,
+               (long long)(cache_default_ttl_ms / 1000));
+    }
+    printf("Press Ctrl+C to stop\n\n");
+
+    while (running) {
+        int timeout = run_health_checks();
+
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        int nready = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+        if (nready < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < nready; i++) {
+            Endpoint *ep = events[i].data.ptr;
+            switch (ep->kind) {
+            case EP_LISTEN:
+                accept_clients(listen_fd);
+                break;
+            case EP_CLIENT:
+                conn_event(ep->owner, 0, events[i].events);
+                break;
+            case EP_BACKEND:
+                conn_event(ep->owner, 1, events[i].events);
+                break;
+            case EP_CHECK:
+                check_event(ep->owner, events[i].events);
+                break;
+            }
+        }
+
+        while (dead_conns) {
+            Conn *c = dead_conns;
+            dead_conns = c->next_dead;
+            free(c);
+        }
+    }
+
+    printf("\nShutting down...\n");
+    for (int i = 0; i < backend_count; i++) {
+        printf("Backend %s: %llu connections served\n",
+               backends[i].spec, (unsigned long long)backends[i].served);
+    }
+    if (cache_limit > 0) {
+        printf("Cache: %llu hits, %llu revalidated, %llu misses, %zu bytes held\n",
+               (unsigned long long)cache_hits, (unsigned long long)cache_revalidated,
+               (unsigned long long)cache_misses, cache_used);
+    }
+    close(listen_fd);
+    close(epoll_fd);
+    printf("Done.\n");
+    return 0;
+}
@@ -0,0 +1,217 @@
+/*
+ * pcapng.h - Buffered pcapng writer for the host bridges
+ *
+ * Records every frame crossing a bridge with a nanosecond timestamp so
+ * captures can be analysed offline in Wireshark. Blocks are assembled in
+ * memory and written in large batches; nothing is fsynced. Optionally
+ * rotates through a ring of files once each reaches a size limit, and
+ * truncates frames to a snap length.
+ *
+ * Direction flags are from the bridge's point of view: frames from Spike
+ * are inbound, frames to Spike are outbound.
+ */
+
+#ifndef PCAPNG_H
+#define PCAPNG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define PCAPNG_BUF_SIZE (256 * 1024)
+#define PCAPNG_FLUSH_NS 1000000000LL    /* Flush buffered data at least this often */
+#define PCAPNG_DEFAULT_SNAPLEN 65535
+
+#define PCAPNG_IN 1
+#define PCAPNG_OUT 2
+
+typedef struct PcapWriter {
+    char base[512];             /* Path given by the user */
+    char path[528];             /* Current file (base, or base.N when rotating) */
+    const char *if_name;
+    int fd;
+    uint32_t snaplen;
+    uint64_t rotate_bytes;      /* 0 = never rotate */
+    int rotate_files;           /* Ring length when rotating */
+    int file_index;
+    uint64_t file_bytes;
+    uint8_t *buf;
+    size_t len;
+    int64_t last_flush;
+    uint64_t frames;
+} PcapWriter;
+
+static inline int64_t pcapng_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void pcapng_put32(PcapWriter *w, uint32_t v) {
+    memcpy(w->buf + w->len, &v, 4);
+    w->len += 4;
+}
+
+static inline void pcapng_put16(PcapWriter *w, uint16_t v) {
+    memcpy(w->buf + w->len, &v, 2);
+    w->len += 2;
+}
+
+static inline void pcapng_flush(PcapWriter *w) {
+    size_t off = 0;
+    while (off < w->len) {
+        ssize_t n = write(w->fd, w->buf + off, w->len - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("pcapng write");
+            break;
+        }
+        off += n;
+    }
+    w->file_bytes += w->len;
+    w->len = 0;
+    w->last_flush = pcapng_now_ns();
+}
+
+/* Section header plus one Ethernet interface with ns timestamps */
+static inline void pcapng_write_header(PcapWriter *w) {
+    /* Section Header Block */
+    pcapng_put32(w, 0x0A0D0D0A);
+    pcapng_put32(w, 28);
+    pcapng_put32(w, 0x1A2B3C4D);        /* Byte-order magic */
+    pcapng_put16(w, 1);                 /* Version 1.0 */
+    pcapng_put16(w, 0);
+    pcapng_put32(w, 0xFFFFFFFF);        /* Section length unknown */
+    pcapng_put32(w, 0xFFFFFFFF);
+    pcapng_put32(w, 28);
+
+    /* Interface Description Block */
+    size_t name_len = strlen(w->if_name);
+    size_t name_pad = (name_len + 3) & ~(size_t)3;
+    uint32_t total = 16 + 8 + 4 + name_pad + 4 + 4;
+    pcapng_put32(w, 0x00000001);
+    pcapng_put32(w, total);
+    pcapng_put16(w, 1);                 /* LINKTYPE_ETHERNET */
+    pcapng_put16(w, 0);
+    pcapng_put32(w, w->snaplen);
+    pcapng_put16(w, 9);                 /* if_tsresol: 10^-9 */
+    pcapng_put16(w, 1);
+    memset(w->buf + w->len, 0, 4);
+    w->buf[w->len] = 9;
+    w->len += 4;
+    pcapng_put16(w, 2);                 /* if_name */
+    pcapng_put16(w, (uint16_t)name_len);
+    memset(w->buf + w->len, 0, name_pad);
+    memcpy(w->buf + w->len, w->if_name, name_len);
+    w->len += name_pad;
+    pcapng_put32(w, 0);                 /* opt_endofopt */
+    pcapng_put32(w, total);
+}
+
+static inline int pcapng_open_file(PcapWriter *w) {
+    if (w->rotate_bytes) {
+        snprintf(w->path, sizeof(w->path), "%s.%d", w->base, w->file_index);
+    } else {
+        snprintf(w->path, sizeof(w->path), "%s", w->base);
+    }
+
+    w->fd = open(w->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0) {
+        perror(w->path);
+        return -1;
+    }
+    w->file_bytes = 0;
+    pcapng_write_header(w);
+    return 0;
+}
+
+/* Start a capture. rotate_mb = 0 writes a single file. */
+static inline PcapWriter *pcapng_open(const char *path, const char *if_name, uint32_t snaplen,
+                               uint64_t rotate_mb, int rotate_files) {
+    PcapWriter *w = calloc(1, sizeof(PcapWriter));
+    if (!w) return NULL;
+
+    w->buf = malloc(PCAPNG_BUF_SIZE);
+    w->if_name = if_name;
+    w->snaplen = snaplen ? snaplen : PCAPNG_DEFAULT_SNAPLEN;
+    w->rotate_bytes = rotate_mb * 1024 * 1024;
+    w->rotate_files = rotate_files > 0 ? rotate_files : 1;
+    w->last_flush = pcapng_now_ns();
+    snprintf(w->base, sizeof(w->base), "%s", path);
+
+    if (!w->buf || pcapng_open_file(w) < 0) {
+        free(w->buf);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+/* Move on to the next file of the ring, overwriting the oldest */
+static inline void pcapng_rotate(PcapWriter *w) {
+    pcapng_flush(w);
+    close(w->fd);
+    w->file_index = (w->file_index + 1) % w->rotate_files;
+    if (pcapng_open_file(w) < 0) {
+        w->rotate_bytes = 0;
+    }
+}
+
+/* Append one frame as an Enhanced Packet Block */
+static inline void pcapng_write(PcapWriter *w, const uint8_t *frame, size_t len, int direction) {
+    if (!w || w->fd < 0) return;
+
+    uint32_t caplen = len > w->snaplen ? w->snaplen : (uint32_t)len;
+    uint32_t pad = (4 - (caplen & 3)) & 3;
+    uint32_t total = 28 + caplen + pad + 12 + 4;
+
+    if (w->len + total > PCAPNG_BUF_SIZE) {
+        pcapng_flush(w);
+    }
+    if (w->rotate_bytes && w->file_bytes + w->len + total > w->rotate_bytes) {
+        pcapng_rotate(w);
+        if (w->fd < 0) return;
+    }
+
+    uint64_t ts = (uint64_t)pcapng_now_ns();
+    pcapng_put32(w, 0x00000006);
+    pcapng_put32(w, total);
+    pcapng_put32(w, 0);                 /* Interface 0 */
+    pcapng_put32(w, (uint32_t)(ts >> 32));
+    pcapng_put32(w, (uint32_t)ts);
+    pcapng_put32(w, caplen);
+    pcapng_put32(w, (uint32_t)len);
+    memcpy(w->buf + w->len, frame, caplen);
+    memset(w->buf + w->len + caplen, 0, pad);
+    w->len += caplen + pad;
+    pcapng_put16(w, 2);                 /* epb_flags: direction */
+    pcapng_put16(w, 4);
+    pcapng_put32(w, (uint32_t)direction);
+    pcapng_put32(w, 0);                 /* opt_endofopt */
+    pcapng_put32(w, total);
+    w->frames++;
+}
+
+/* Call periodically so a quiet link still reaches the disk */
+static inline void pcapng_tick(PcapWriter *w) {
+    if (w && w->len > 0 && pcapng_now_ns() - w->last_flush >= PCAPNG_FLUSH_NS) {
+        pcapng_flush(w);
+    }
+}
+
+static inline void pcapng_close(PcapWriter *w) {
+    if (!w) return;
+    if (w->fd >= 0) {
+        pcapng_flush(w);
+        close(w->fd);
+    }
+    free(w->buf);
+    free(w);
+}
+
+#endif /* PCAPNG_H */
@@ -2,11 +2,17 @@
  * slirp_bridge.c - Bridge between Spike VirtIO socket and SLIRP
  *
  * Connects to Spike's Unix domain socket and bridges network traffic
- * through SLIRP for user-mode NAT networking.
+ * through SLIRP for user-mode NAT networking. Several Spike instances
+ * can be attached at once; each gets its own SLIRP network, its own set
+ * of host port forwards and its own event loop thread. If Spike offers
+ * a shared-memory ring (spike_shm.h), frames move through it instead of
+ * the socket stream. With --pcap, every frame is also recorded to a
+ * pcapng file (pcapng.h).
  *
- * Build: gcc -O2 -o slirp_bridge slirp_bridge.c $(pkg-config --cflags --libs slirp glib-2.0)
+ * Build: gcc -O2 -pthread -o slirp_bridge slirp_bridge.c $(pkg-config --cflags --libs slirp glib-2.0)
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,34 +20,131 @@
 #include <errno.h>
 #include <time.h>
 #include <signal.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 #include <sys/select.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 
 #include <slirp/libslirp.h>
-#include <poll.h>
+
+#include "spike_shm.h"
+#include "pcapng.h"
 
 #define MAX_FRAME_SIZE 2048
-#define MAX_POLL_FDS 64
+#define MIN_FRAME_SIZE 14  /* Ethernet header */
+#define RECV_RING_SIZE (256 * 1024)  /* Multiple of the page size */
+#define MAX_EPOLL_EVENTS 64
+#define MAX_POLL_TIMEOUT_MS 1000
+#define SEND_BUF_SIZE (MAX_FRAME_SIZE * 32)
+#define MAX_GUESTS 16
+#define MAX_FORWARDS 16
 #define DEFAULT_SOCKET_PATH "/tmp/spike_fifo.sock"
 #define DEFAULT_HOST_PORT 8080
 #define DEFAULT_GUEST_PORT 80
 
-/* Global state */
-static int spike_fd = -1;
-static Slirp *slirp = NULL;
-static volatile int running = 1;
+/* How frames reach Spike: undecided until its first bytes arrive */
+enum { TRANSPORT_PENDING, TRANSPORT_STREAM, TRANSPORT_SHM };
+
+/* Timer structure */
+typedef struct SlirpTimer {
+    SlirpTimerCb cb;
+    void *cb_opaque;
+    int64_t expire_time;
+    int heap_idx;       /* Position in the loop's timer heap, -1 if not armed */
+    struct EventLoop *loop;
+} SlirpTimer;
 
-/* Receive buffer for handling partial frames */
-static uint8_t recv_buf[MAX_FRAME_SIZE * 4];
-static size_t recv_buf_len = 0;
+/* epoll registration for one fd, indexed by fd. add_poll_cb hands the
+ * fd back as the poll index, so revents lookups are O(1) and epoll_ctl
+ * is only called when an fd's interest set changes. */
+typedef struct PollEntry {
+    uint32_t events;    /* Interest currently registered with epoll */
+    uint32_t revents;   /* Result of the last epoll_wait */
+    uint32_t gen;       /* Fill pass that last reported this fd */
+    struct Guest *guest; /* Set for Spike sockets, NULL for SLIRP fds */
+} PollEntry;
+
+/* Event loop: one epoll set, the fd table and the armed SLIRP timers
+ * (a binary min-heap keyed by expire_time). Each guest thread owns one,
+ * so nothing in here is shared between threads. */
+typedef struct EventLoop {
+    int epoll_fd;
+    int wake_fd;        /* eventfd poked by the signal handler */
+    PollEntry *entries;
+    int entries_size;
+    uint32_t gen;
+    int armed;          /* Entries with non-empty SLIRP interest */
+    int reported;       /* Of those, reported in the current fill pass */
+    SlirpTimer **timer_heap;
+    int timer_heap_len;
+    int timer_heap_size;
+} EventLoop;
+
+/* One attached Spike instance and its private SLIRP network */
+typedef struct Guest {
+    int index;
+    const char *socket_path;
+    EventLoop *loop;
+    pthread_t thread;
+    Slirp *slirp;
+    int spike_fd;
+    uint32_t spike_events;
+
+    /* Receive ring for Spike input. Its memfd is mapped twice back to
+     * back, so any frame starting inside the ring is contiguous. */
+    uint8_t *recv_ring;
+    size_t recv_head;
+    size_t recv_len;
+    size_t recv_skipped;
+
+    /* Transmit ring for framed packets to Spike, flushed once per pass */
+    uint8_t *send_buf;
+    size_t send_buf_head;
+    size_t send_buf_len;
+
+    /* Shared-memory transport offered by Spike (see spike_shm.h) */
+    int transport;
+    int shm_fds[SPIKE_SHM_NUM_FDS];
+    void *shm_base;
+    size_t shm_size;
+    struct spike_shm_queue shm_rx;  /* Spike -> bridge */
+    struct spike_shm_queue shm_tx;  /* Bridge -> Spike */
+    int shm_kick;                   /* Frames queued since the last doorbell */
+
+    PcapWriter *pcap;               /* Capture file, NULL unless --pcap */
+} Guest;
+
+/* Host port forward; guest N listens on host_port + N */
+typedef struct Forward {
+    int is_udp;
+    int host_port;
+    int guest_port;
+} Forward;
 
-/* Poll fd management for SLIRP */
-static struct pollfd poll_fds[MAX_POLL_FDS];
-static int poll_fd_count = 0;
+/* Global state */
+static Guest guests[MAX_GUESTS];
+static int guest_count = 0;
+static EventLoop loops[MAX_GUESTS];
+static int loops_ready = 0;
+static Forward forwards[MAX_FORWARDS];
+static int forward_count = 0;
+static int pin_threads = 1;
+static int allow_shm = 1;
+static cpu_set_t allowed_cpus;
+static volatile sig_atomic_t running = 1;
+static const char *pcap_path = NULL;
+static uint32_t pcap_snaplen = PCAPNG_DEFAULT_SNAPLEN;
+static uint64_t pcap_rotate_mb = 0;
+static int pcap_rotate_files = 8;
 
 /* SLIRP callbacks */
 static ssize_t slirp_send_packet(const void *buf, size_t len, void *opaque);
@@ -66,44 +169,146 @@ static const SlirpCb slirp_callbacks = {
     .notify = slirp_notify,
 };
 
-/* Timer structure */
-typedef struct SlirpTimer {
-    SlirpTimerCb cb;
-    void *cb_opaque;
-    int64_t expire_time;
-    struct SlirpTimer *next;
-} SlirpTimer;
+/* Close shared-memory fds received from Spike */
+static void shm_close_fds(Guest *g) {
+    for (int i = 0; i < SPIKE_SHM_NUM_FDS; i++) {
+        if (g->shm_fds[i] >= 0) {
+            close(g->shm_fds[i]);
+            g->shm_fds[i] = -1;
+        }
+    }
+}
+
+/* Drop the shared-memory transport, if any */
+static void shm_detach(Guest *g) {
+    int doorbell = g->shm_fds[SPIKE_SHM_FD_HOST_DOORBELL];
+    if (g->transport == TRANSPORT_SHM && doorbell < g->loop->entries_size) {
+        epoll_ctl(g->loop->epoll_fd, EPOLL_CTL_DEL, doorbell, NULL);
+        memset(&g->loop->entries[doorbell], 0, sizeof(PollEntry));
+    }
+    if (g->shm_base) {
+        munmap(g->shm_base, g->shm_size);
+        g->shm_base = NULL;
+    }
+    shm_close_fds(g);
+}
+
+/* Append bytes to the transmit ring (caller checks for space) */
+static void send_buf_put(Guest *g, const uint8_t *data, size_t len) {
+    size_t tail = (g->send_buf_head + g->send_buf_len) % SEND_BUF_SIZE;
+    size_t first = SEND_BUF_SIZE - tail;
+    if (first > len) first = len;
+
+    memcpy(g->send_buf + tail, data, first);
+    memcpy(g->send_buf, data + first, len - first);
+    g->send_buf_len += len;
+}
+
+/* Detach a guest whose Spike connection is gone. Its thread exits;
+ * the other guests keep running and the bridge stops once all have. */
+static void guest_disconnect(Guest *g) {
+    if (g->spike_fd < 0) return;
+
+    shm_detach(g);
+
+    if (g->spike_fd < g->loop->entries_size) {
+        memset(&g->loop->entries[g->spike_fd], 0, sizeof(PollEntry));
+    }
+    close(g->spike_fd);
+    g->spike_fd = -1;
+    g->spike_events = 0;
+    g->send_buf_len = 0;
+}
+
+/* Flush queued frames to Spike with as few writev calls as possible.
+ * Partial writes leave the remainder queued; EAGAIN is not an error. */
+static int flush_send_buf(Guest *g) {
+    /* One doorbell per pass, and only if Spike went to sleep */
+    if (g->shm_kick) {
+        g->shm_kick = 0;
+        if (spike_shm_needs_kick(&g->shm_tx)) {
+            uint64_t one = 1;
+            if (write(g->shm_fds[SPIKE_SHM_FD_SPIKE_DOORBELL], &one, sizeof(one)) < 0 &&
+                errno != EAGAIN) {
+                fprintf(stderr, "[guest %d] doorbell: %s\n", g->index, strerror(errno));
+            }
+        }
+    }
 
-static SlirpTimer *timer_list = NULL;
+    while (g->send_buf_len > 0) {
+        struct iovec iov[2];
+        int iovcnt = 1;
+        size_t first = SEND_BUF_SIZE - g->send_buf_head;
+        if (first > g->send_buf_len) first = g->send_buf_len;
+
+        iov[0].iov_base = g->send_buf + g->send_buf_head;
+        iov[0].iov_len = first;
+        if (first < g->send_buf_len) {
+            iov[1].iov_base = g->send_buf;
+            iov[1].iov_len = g->send_buf_len - first;
+            iovcnt = 2;
+        }
+
+        ssize_t sent = writev(g->spike_fd, iov, iovcnt);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            fprintf(stderr, "[guest %d] send to spike: %s\n", g->index, strerror(errno));
+            guest_disconnect(g);
+            return -1;
+        }
 
-/* Send Ethernet frame to guest via Spike socket */
+        g->send_buf_head = (g->send_buf_head + sent) % SEND_BUF_SIZE;
+        g->send_buf_len -= sent;
+    }
+
+    g->send_buf_head = 0;
+    return 0;
+}
+
+/* Queue Ethernet frame for the guest; sent by flush_send_buf() */
 static ssize_t slirp_send_packet(const void *buf, size_t len, void *opaque) {
-    (void)opaque;
+    Guest *g = opaque;
 
-    if (spike_fd < 0 || len > MAX_FRAME_SIZE - 2) {
+    if (g->spike_fd < 0 || len > MAX_FRAME_SIZE - 2) {
         return -1;
     }
 
-    /* Frame format: 2-byte big-endian length prefix + frame data */
-    uint8_t frame[MAX_FRAME_SIZE];
-    frame[0] = (len >> 8) & 0xFF;
-    frame[1] = len & 0xFF;
-    memcpy(frame + 2, buf, len);
+    if (g->transport == TRANSPORT_SHM) {
+        /* A full ring drops the frame, as a full socket would */
+        if (spike_shm_put(&g->shm_tx, buf, len) < 0) {
+            return -1;
+        }
+        g->shm_kick = 1;
+        pcapng_write(g->pcap, buf, len, PCAPNG_OUT);
+        return len;
+    }
 
-    ssize_t sent = send(spike_fd, frame, len + 2, 0);
-    if (sent < 0) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("send to spike");
+    if (g->send_buf_len + len + 2 > SEND_BUF_SIZE) {
+        /* Ring full: drain what the socket accepts now, else drop the
+         * whole frame so the length-prefixed stream stays in sync */
+        flush_send_buf(g);
+        if (g->spike_fd < 0 || g->send_buf_len + len + 2 > SEND_BUF_SIZE) {
+            return -1;
         }
-        return -1;
     }
 
+    /* Frame format: 2-byte big-endian length prefix + frame data */
+    uint8_t prefix[2];
+    prefix[0] = (len >> 8) & 0xFF;
+    prefix[1] = len & 0xFF;
+    send_buf_put(g, prefix, 2);
+    send_buf_put(g, buf, len);
+    pcapng_write(g->pcap, buf, len, PCAPNG_OUT);
+
     return len;
 }
 
 static void slirp_guest_error(const char *msg, void *opaque) {
-    (void)opaque;
-    fprintf(stderr, "SLIRP error: %s\n", msg);
+    Guest *g = opaque;
+    fprintf(stderr, "[guest %d] SLIRP error: %s\n", g->index, msg);
 }
 
 static int64_t slirp_clock_get_ns(void *opaque) {
@@ -113,105 +318,262 @@ static int64_t slirp_clock_get_ns(void *opaque) {
     return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
+/* Timer heap helpers */
+static void timer_heap_set(EventLoop *loop, int idx, SlirpTimer *t) {
+    loop->timer_heap[idx] = t;
+    t->heap_idx = idx;
+}
+
+static void timer_heap_sift_up(EventLoop *loop, int idx) {
+    SlirpTimer *t = loop->timer_heap[idx];
+    while (idx > 0) {
+        int parent = (idx - 1) / 2;
+        if (loop->timer_heap[parent]->expire_time <= t->expire_time) break;
+        timer_heap_set(loop, idx, loop->timer_heap[parent]);
+        idx = parent;
+    }
+    timer_heap_set(loop, idx, t);
+}
+
+static void timer_heap_sift_down(EventLoop *loop, int idx) {
+    SlirpTimer *t = loop->timer_heap[idx];
+    for (;;) {
+        int child = 2 * idx + 1;
+        if (child >= loop->timer_heap_len) break;
+        if (child + 1 < loop->timer_heap_len &&
+            loop->timer_heap[child + 1]->expire_time < loop->timer_heap[child]->expire_time) {
+            child++;
+        }
+        if (t->expire_time <= loop->timer_heap[child]->expire_time) break;
+        timer_heap_set(loop, idx, loop->timer_heap[child]);
+        idx = child;
+    }
+    timer_heap_set(loop, idx, t);
+}
+
+static int timer_heap_push(EventLoop *loop, SlirpTimer *t) {
+    if (loop->timer_heap_len == loop->timer_heap_size) {
+        int size = loop->timer_heap_size ? loop->timer_heap_size * 2 : 16;
+        SlirpTimer **heap = realloc(loop->timer_heap, size * sizeof(SlirpTimer *));
+        if (!heap) return -1;
+        loop->timer_heap = heap;
+        loop->timer_heap_size = size;
+    }
+    timer_heap_set(loop, loop->timer_heap_len++, t);
+    timer_heap_sift_up(loop, t->heap_idx);
+    return 0;
+}
+
+static void timer_heap_remove(EventLoop *loop, SlirpTimer *t) {
+    int idx = t->heap_idx;
+    SlirpTimer *last = loop->timer_heap[--loop->timer_heap_len];
+    t->heap_idx = -1;
+
+    if (last != t) {
+        timer_heap_set(loop, idx, last);
+        timer_heap_sift_up(loop, idx);
+        timer_heap_sift_down(loop, last->heap_idx);
+    }
+}
+
 static void *slirp_timer_new(SlirpTimerCb cb, void *cb_opaque, void *opaque) {
-    (void)opaque;
+    Guest *g = opaque;
     SlirpTimer *timer = malloc(sizeof(SlirpTimer));
     if (!timer) return NULL;
 
     timer->cb = cb;
     timer->cb_opaque = cb_opaque;
     timer->expire_time = -1;
-    timer->next = timer_list;
-    timer_list = timer;
+    timer->heap_idx = -1;
+    timer->loop = g->loop;
     return timer;
 }
 
 static void slirp_timer_free(void *timer, void *opaque) {
     (void)opaque;
-    SlirpTimer **pp = &timer_list;
-    while (*pp) {
-        if (*pp == timer) {
-            *pp = (*pp)->next;
-            free(timer);
-            return;
-        }
-        pp = &(*pp)->next;
+    SlirpTimer *t = timer;
+    if (!t) return;
+
+    if (t->heap_idx >= 0) {
+        timer_heap_remove(t->loop, t);
     }
+    free(t);
 }
 
 static void slirp_timer_mod(void *timer, int64_t expire_time, void *opaque) {
     (void)opaque;
-    if (timer) {
-        ((SlirpTimer *)timer)->expire_time = expire_time;
+    SlirpTimer *t = timer;
+    if (!t) return;
+
+    t->expire_time = expire_time;
+    if (expire_time < 0) {
+        if (t->heap_idx >= 0) {
+            timer_heap_remove(t->loop, t);
+        }
+    } else if (t->heap_idx < 0) {
+        if (timer_heap_push(t->loop, t) < 0) {
+            fprintf(stderr, "Out of memory arming timer\n");
+            t->expire_time = -1;
+        }
+    } else {
+        timer_heap_sift_up(t->loop, t->heap_idx);
+        timer_heap_sift_down(t->loop, t->heap_idx);
     }
 }
 
-static void slirp_register_poll_fd(int fd, void *opaque) {
-    (void)opaque;
-    /* Add fd to poll set if not already there */
-    for (int i = 0; i < poll_fd_count; i++) {
-        if (poll_fds[i].fd == fd) return;
-    }
-    if (poll_fd_count < MAX_POLL_FDS) {
-        poll_fds[poll_fd_count].fd = fd;
-        poll_fds[poll_fd_count].events = 0;
-        poll_fd_count++;
+/* Look up (growing the table if needed) the poll entry for fd */
+static PollEntry *poll_entry(EventLoop *loop, int fd) {
+    if (fd < 0) return NULL;
+
+    if (fd >= loop->entries_size) {
+        int size = loop->entries_size ? loop->entries_size : 64;
+        while (size <= fd) size *= 2;
+
+        PollEntry *entries = realloc(loop->entries, size * sizeof(PollEntry));
+        if (!entries) return NULL;
+        memset(entries + loop->entries_size, 0,
+               (size - loop->entries_size) * sizeof(PollEntry));
+        loop->entries = entries;
+        loop->entries_size = size;
     }
+
+    return &loop->entries[fd];
 }
 
-static void slirp_unregister_poll_fd(int fd, void *opaque) {
-    (void)opaque;
-    /* Remove fd from poll set */
-    for (int i = 0; i < poll_fd_count; i++) {
-        if (poll_fds[i].fd == fd) {
-            poll_fds[i] = poll_fds[--poll_fd_count];
+/* Bring fd's epoll registration in line with events (0 = not registered) */
+static void poll_set_events(EventLoop *loop, int fd, uint32_t events) {
+    PollEntry *e = poll_entry(loop, fd);
+    if (!e || e->events == events) return;
+
+    struct epoll_event ev = {.events = events, .data.fd = fd};
+    int op = !events ? EPOLL_CTL_DEL : (e->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD);
+    if (epoll_ctl(loop->epoll_fd, op, fd, &ev) < 0) {
+        /* fd closed and reused without an unregister: re-add it */
+        if (op == EPOLL_CTL_MOD && errno == ENOENT) {
+            op = EPOLL_CTL_ADD;
+            if (epoll_ctl(loop->epoll_fd, op, fd, &ev) < 0) {
+                perror("epoll_ctl");
+                return;
+            }
+        } else if (op != EPOLL_CTL_DEL) {
+            perror("epoll_ctl");
             return;
         }
     }
+
+    if (!e->events) loop->armed++;
+    if (!events) loop->armed--;
+    e->events = events;
+}
+
+/* Drop interest for fds SLIRP did not report in this fill pass. Only
+ * scans the table when the counters say something went stale. */
+static void poll_disarm_stale(EventLoop *loop) {
+    if (loop->armed == loop->reported) return;
+
+    for (int fd = 0; fd < loop->entries_size; fd++) {
+        PollEntry *e = &loop->entries[fd];
+        if (!e->guest && e->events && e->gen != loop->gen) {
+            poll_set_events(loop, fd, 0);
+        }
+    }
+}
+
+static void slirp_register_poll_fd(int fd, void *opaque) {
+    Guest *g = opaque;
+    /* Interest is registered lazily by add_poll_cb; just size the table */
+    poll_entry(g->loop, fd);
+}
+
+static void slirp_unregister_poll_fd(int fd, void *opaque) {
+    Guest *g = opaque;
+    /* Remove fd from the epoll set before SLIRP closes it */
+    PollEntry *e = poll_entry(g->loop, fd);
+    if (e) {
+        poll_set_events(g->loop, fd, 0);
+        memset(e, 0, sizeof(*e));
+    }
 }
 
 static void slirp_notify(void *opaque) {
     (void)opaque;
 }
 
-/* Polling callbacks for SLIRP */
+/* Polling callbacks for SLIRP (opaque is the EventLoop) */
 static int add_poll_cb(int fd, int events, void *opaque) {
-    (void)opaque;
-    if (poll_fd_count < MAX_POLL_FDS) {
-        poll_fds[poll_fd_count].fd = fd;
-        poll_fds[poll_fd_count].events = 0;
-        if (events & SLIRP_POLL_IN) poll_fds[poll_fd_count].events |= POLLIN;
-        if (events & SLIRP_POLL_OUT) poll_fds[poll_fd_count].events |= POLLOUT;
-        poll_fds[poll_fd_count].revents = 0;
-        return poll_fd_count++;
-    }
-    return -1;
+    EventLoop *loop = opaque;
+    uint32_t ev = 0;
+    if (events & SLIRP_POLL_IN) ev |= EPOLLIN;
+    if (events & SLIRP_POLL_OUT) ev |= EPOLLOUT;
+    if (events & SLIRP_POLL_PRI) ev |= EPOLLPRI;
+
+    poll_set_events(loop, fd, ev);
+
+    PollEntry *e = poll_entry(loop, fd);
+    if (!e) return -1;
+    if (ev && e->gen != loop->gen) loop->reported++;
+    e->gen = loop->gen;
+    return fd;
 }
 
 static int get_revents_cb(int idx, void *opaque) {
-    (void)opaque;
-    if (idx < 0 || idx >= poll_fd_count) return 0;
+    EventLoop *loop = opaque;
+    if (idx < 0 || idx >= loop->entries_size) return 0;
+    uint32_t ev = loop->entries[idx].revents;
     int revents = 0;
-    if (poll_fds[idx].revents & POLLIN) revents |= SLIRP_POLL_IN;
-    if (poll_fds[idx].revents & POLLOUT) revents |= SLIRP_POLL_OUT;
-    if (poll_fds[idx].revents & POLLERR) revents |= SLIRP_POLL_ERR;
-    if (poll_fds[idx].revents & POLLHUP) revents |= SLIRP_POLL_HUP;
+    if (ev & EPOLLIN) revents |= SLIRP_POLL_IN;
+    if (ev & EPOLLOUT) revents |= SLIRP_POLL_OUT;
+    if (ev & EPOLLPRI) revents |= SLIRP_POLL_PRI;
+    if (ev & EPOLLERR) revents |= SLIRP_POLL_ERR;
+    if (ev & EPOLLHUP) revents |= SLIRP_POLL_HUP;
     return revents;
 }
 
-/* Process expired timers */
-static void process_timers(void) {
+/* Register the Spike socket (edge-triggered); EPOLLOUT only while the
+ * transmit ring holds data */
+static void update_spike_events(Guest *g) {
+    if (g->spike_fd < 0) return;
+
+    uint32_t events = EPOLLIN | EPOLLET;
+    if (g->send_buf_len > 0) events |= EPOLLOUT;
+    if (events == g->spike_events) return;
+
+    struct epoll_event ev = {.events = events, .data.fd = g->spike_fd};
+    if (epoll_ctl(g->loop->epoll_fd, g->spike_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  g->spike_fd, &ev) < 0) {
+        perror("epoll_ctl spike");
+        guest_disconnect(g);
+        return;
+    }
+    g->spike_events = events;
+}
+
+/* Milliseconds until the nearest SLIRP timer expires (capped) */
+static uint32_t next_timer_timeout(EventLoop *loop) {
+    if (loop->timer_heap_len == 0) return MAX_POLL_TIMEOUT_MS;
+
+    int64_t next = loop->timer_heap[0]->expire_time;
     int64_t now = slirp_clock_get_ns(NULL);
-    SlirpTimer *t = timer_list;
+    if (next <= now) return 0;
 
-    while (t) {
-        if (t->expire_time >= 0 && t->expire_time <= now) {
-            t->expire_time = -1;
-            if (t->cb) {
-                t->cb(t->cb_opaque);
-            }
+    int64_t ms = (next - now + 999999) / 1000000;
+    return ms < MAX_POLL_TIMEOUT_MS ? (uint32_t)ms : MAX_POLL_TIMEOUT_MS;
+}
+
+/* Process expired timers. Callbacks may re-arm or free any timer; the
+ * firing budget stops a timer re-armed into the past from spinning. */
+static void process_timers(EventLoop *loop) {
+    int64_t now = slirp_clock_get_ns(NULL);
+    int budget = loop->timer_heap_len;
+
+    while (loop->timer_heap_len > 0 && budget-- > 0 &&
+           loop->timer_heap[0]->expire_time <= now) {
+        SlirpTimer *t = loop->timer_heap[0];
+        timer_heap_remove(loop, t);
+        t->expire_time = -1;
+        if (t->cb) {
+            t->cb(t->cb_opaque);
         }
-        t = t->next;
     }
 }
 
@@ -252,8 +614,8 @@ static int connect_to_spike(const char *path) {
     return -1;
 }
 
-/* Initialize SLIRP */
-static Slirp *init_slirp(void) {
+/* Initialize SLIRP for one guest */
+static Slirp *init_slirp(Guest *g) {
     SlirpConfig cfg;
     memset(&cfg, 0, sizeof(cfg));
 
@@ -266,61 +628,535 @@ static Slirp *init_slirp(void) {
     cfg.vdhcp_start.s_addr = inet_addr("10.0.2.15"); /* DHCP start (guest IP) */
     cfg.vnameserver.s_addr = inet_addr("10.0.2.3");  /* DNS */
 
-    return slirp_new(&cfg, &slirp_callbacks, NULL);
+    return slirp_new(&cfg, &slirp_callbacks, g);
 }
 
-/* Handle input from Spike */
-static void handle_spike_input(void) {
-    /* Read available data */
-    ssize_t n = recv(spike_fd, recv_buf + recv_buf_len,
-                     sizeof(recv_buf) - recv_buf_len, 0);
+/* Set up the double-mapped receive ring */
+static uint8_t *init_recv_ring(void) {
+    int fd = memfd_create("spike_recv", 0);
+    if (fd < 0) {
+        perror("memfd_create");
+        return NULL;
+    }
 
-    if (n <= 0) {
-        if (n == 0) {
-            printf("Spike disconnected\n");
-            running = 0;
-        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("recv from spike");
-            running = 0;
-        }
-        return;
+    if (ftruncate(fd, RECV_RING_SIZE) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+
+    /* Reserve space for both views, then map the memfd into each half */
+    uint8_t *base = mmap(NULL, 2 * RECV_RING_SIZE, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return NULL;
     }
 
-    recv_buf_len += n;
+    if (mmap(base, RECV_RING_SIZE, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + RECV_RING_SIZE, RECV_RING_SIZE, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        perror("mmap");
+        munmap(base, 2 * RECV_RING_SIZE);
+        close(fd);
+        return NULL;
+    }
 
-    /* Process complete frames */
-    size_t offset = 0;
-    while (offset + 2 <= recv_buf_len) {
-        uint16_t frame_len = (recv_buf[offset] << 8) | recv_buf[offset + 1];
+    close(fd);
+    return base;
+}
 
-        if (frame_len == 0 || frame_len > MAX_FRAME_SIZE) {
-            fprintf(stderr, "Invalid frame length: %u\n", frame_len);
-            recv_buf_len = 0;
-            return;
+/* Pass every complete frame in the receive ring to SLIRP */
+static void process_spike_frames(Guest *g) {
+    while (g->recv_len >= 2) {
+        const uint8_t *p = g->recv_ring + g->recv_head;
+        uint16_t frame_len = (p[0] << 8) | p[1];
+        int valid = frame_len >= MIN_FRAME_SIZE && frame_len <= MAX_FRAME_SIZE;
+
+        /* While resynchronizing, also require the next prefix to be sane */
+        if (valid && g->recv_skipped > 0 && g->recv_len >= 4 + (size_t)frame_len) {
+            uint16_t next_len = (p[2 + frame_len] << 8) | p[3 + frame_len];
+            valid = next_len >= MIN_FRAME_SIZE && next_len <= MAX_FRAME_SIZE;
         }
 
-        if (offset + 2 + frame_len > recv_buf_len) {
+        if (!valid) {
+            /* Lost sync: slide forward a byte at a time until a
+             * plausible length prefix shows up again */
+            if (g->recv_skipped++ == 0) {
+                fprintf(stderr, "[guest %d] Invalid frame length: %u, resynchronizing\n",
+                        g->index, frame_len);
+            }
+            g->recv_head = (g->recv_head + 1) % RECV_RING_SIZE;
+            g->recv_len--;
+            continue;
+        }
+
+        if (2 + (size_t)frame_len > g->recv_len) {
             break; /* Incomplete frame */
         }
 
+        if (g->recv_skipped > 0) {
+            fprintf(stderr, "[guest %d] Resynchronized after skipping %zu bytes\n",
+                    g->index, g->recv_skipped);
+            g->recv_skipped = 0;
+        }
+
         /* Pass Ethernet frame to SLIRP */
-        slirp_input(slirp, recv_buf + offset + 2, frame_len);
-        offset += 2 + frame_len;
+        pcapng_write(g->pcap, p + 2, frame_len, PCAPNG_IN);
+        slirp_input(g->slirp, p + 2, frame_len);
+        g->recv_head = (g->recv_head + 2 + frame_len) % RECV_RING_SIZE;
+        g->recv_len -= 2 + frame_len;
+    }
+}
+
+/* Read from the Spike socket. Until the transport is settled, use
+ * recvmsg so fds attached to a shared-memory offer are picked up. */
+static ssize_t spike_recv(Guest *g, void *buf, size_t len) {
+    if (g->transport != TRANSPORT_PENDING) {
+        return recv(g->spike_fd, buf, len, 0);
+    }
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(SPIKE_SHM_NUM_FDS * sizeof(int))];
+    } control;
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = &control,
+        .msg_controllen = sizeof(control),
+    };
+
+    ssize_t n = recvmsg(g->spike_fd, &msg, MSG_CMSG_CLOEXEC);
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); n > 0 && c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+
+        int nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *fds = (int *)CMSG_DATA(c);
+        for (int k = 0; k < nfds; k++) {
+            if (k < SPIKE_SHM_NUM_FDS && g->shm_fds[k] < 0) {
+                g->shm_fds[k] = fds[k];
+            } else {
+                close(fds[k]);
+            }
+        }
+    }
+    return n;
+}
+
+/* Map the rings Spike offered; returns SPIKE_SHM_ACCEPT or an errno */
+static int shm_attach(Guest *g, const struct spike_shm_hello *hello) {
+    if (!allow_shm) return ENOTSUP;
+    if (hello->version != SPIKE_SHM_VERSION) return EPROTO;
+
+    uint32_t size = hello->ring_size;
+    if (size < 2 * MAX_FRAME_SIZE || (size & (size - 1)) || size > (1u << 30)) {
+        return EINVAL;
+    }
+    for (int i = 0; i < SPIKE_SHM_NUM_FDS; i++) {
+        if (g->shm_fds[i] < 0) return EBADF;
+    }
+
+    struct stat st;
+    g->shm_size = SPIKE_SHM_SIZE(size);
+    if (fstat(g->shm_fds[SPIKE_SHM_FD_MEM], &st) < 0) return errno;
+    if ((size_t)st.st_size < g->shm_size) return EINVAL;
+
+    void *base = mmap(NULL, g->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      g->shm_fds[SPIKE_SHM_FD_MEM], 0);
+    if (base == MAP_FAILED) return errno;
+    g->shm_base = base;
+
+    struct spike_shm_header *hdr = base;
+    if (memcmp(hdr->magic, SPIKE_SHM_MAGIC, 4) != 0 ||
+        hdr->version != SPIKE_SHM_VERSION || hdr->ring_size != size) {
+        return EPROTO;
+    }
+
+    uint8_t *data = (uint8_t *)base + SPIKE_SHM_DATA_OFFSET;
+    g->shm_rx.ring = &hdr->to_host;
+    g->shm_rx.data = data;
+    g->shm_rx.size = size;
+    g->shm_tx.ring = &hdr->to_spike;
+    g->shm_tx.data = data + size;
+    g->shm_tx.size = size;
+
+    /* Spike's doorbell wakes this loop like socket input does */
+    int doorbell = g->shm_fds[SPIKE_SHM_FD_HOST_DOORBELL];
+    int flags = fcntl(doorbell, F_GETFL, 0);
+    fcntl(doorbell, F_SETFL, flags | O_NONBLOCK);
+    flags = fcntl(g->shm_fds[SPIKE_SHM_FD_SPIKE_DOORBELL], F_GETFL, 0);
+    fcntl(g->shm_fds[SPIKE_SHM_FD_SPIKE_DOORBELL], F_SETFL, flags | O_NONBLOCK);
+
+    PollEntry *e = poll_entry(g->loop, doorbell);
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.fd = doorbell};
+    if (!e || epoll_ctl(g->loop->epoll_fd, EPOLL_CTL_ADD, doorbell, &ev) < 0) {
+        return errno ? errno : ENOMEM;
+    }
+    e->guest = g;
+    return SPIKE_SHM_ACCEPT;
+}
+
+/* Settle the transport from the first bytes Spike sends: a zero length
+ * prefix is a shared-memory offer, anything else is a stream frame */
+static void shm_negotiate(Guest *g) {
+    if (g->recv_len < 2) return;
+
+    const uint8_t *p = g->recv_ring + g->recv_head;
+    if (p[0] || p[1]) {
+        g->transport = TRANSPORT_STREAM;
+        shm_close_fds(g);
+        return;
+    }
+
+    struct spike_shm_hello hello;
+    if (g->recv_len < sizeof(hello)) return;
+    memcpy(&hello, p, sizeof(hello));
+    g->recv_head = (g->recv_head + sizeof(hello)) % RECV_RING_SIZE;
+    g->recv_len -= sizeof(hello);
+
+    struct spike_shm_reply reply = {.zero = {0, 0}, .magic = SPIKE_SHM_MAGIC};
+    if (memcmp(hello.magic, SPIKE_SHM_MAGIC, 4) != 0) {
+        reply.status = EPROTO;
+    } else {
+        reply.status = shm_attach(g, &hello);
+    }
+
+    /* The reply goes out behind any stream frames already queued */
+    if (g->send_buf_len + sizeof(reply) > SEND_BUF_SIZE) {
+        flush_send_buf(g);
+    }
+    if (g->send_buf_len + sizeof(reply) <= SEND_BUF_SIZE) {
+        send_buf_put(g, (const uint8_t *)&reply, sizeof(reply));
+    }
+
+    if (reply.status == SPIKE_SHM_ACCEPT) {
+        g->transport = TRANSPORT_SHM;
+        printf("[guest %d] Using shared-memory transport (%u-byte rings)\n",
+               g->index, hello.ring_size);
+    } else {
+        g->transport = TRANSPORT_STREAM;
+        shm_detach(g);
+        fprintf(stderr, "[guest %d] Declined shared-memory transport: %s\n",
+                g->index, strerror(reply.status));
+    }
+}
+
+/* Drain the Spike -> bridge ring, then arm the doorbell before idling */
+static void shm_receive(Guest *g) {
+    do {
+        const uint8_t *frame;
+        uint16_t len;
+        while ((frame = spike_shm_peek(&g->shm_rx, &len)) != NULL) {
+            if (len >= MIN_FRAME_SIZE && len <= MAX_FRAME_SIZE) {
+                pcapng_write(g->pcap, frame, len, PCAPNG_IN);
+                slirp_input(g->slirp, frame, len);
+            }
+            spike_shm_pop(&g->shm_rx, len);
+        }
+    } while (!spike_shm_prepare_sleep(&g->shm_rx));
+}
+
+/* Handle input from Spike. The socket is edge-triggered, so keep reading
+ * until a short read shows it has been drained. */
+static void handle_spike_input(Guest *g) {
+    while (g->spike_fd >= 0) {
+        size_t tail = (g->recv_head + g->recv_len) % RECV_RING_SIZE;
+        size_t space = RECV_RING_SIZE - g->recv_len;
+        ssize_t n = spike_recv(g, g->recv_ring + tail, space);
+
+        if (n <= 0) {
+            if (n == 0) {
+                printf("[guest %d] Spike disconnected\n", g->index);
+                guest_disconnect(g);
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "[guest %d] recv from spike: %s\n", g->index, strerror(errno));
+                guest_disconnect(g);
+            }
+            break;
+        }
+
+        g->recv_len += n;
+        if (g->transport == TRANSPORT_PENDING) {
+            shm_negotiate(g);
+        }
+        if (g->transport == TRANSPORT_STREAM) {
+            process_spike_frames(g);
+        } else if (g->transport == TRANSPORT_SHM) {
+            /* Nothing but EOF is expected on the socket any more */
+            g->recv_head = 0;
+            g->recv_len = 0;
+        }
+
+        if ((size_t)n < space) {
+            break;
+        }
+    }
+
+    if (g->transport == TRANSPORT_SHM && g->spike_fd >= 0) {
+        uint64_t count;
+        ssize_t r = read(g->shm_fds[SPIKE_SHM_FD_HOST_DOORBELL], &count, sizeof(count));
+        (void)r;
+        shm_receive(g);
+    }
+}
+
+/* Set up a guest: rings, SLIRP instance and port forwards */
+static int guest_init(Guest *g, EventLoop *loop) {
+    g->loop = loop;
+    g->spike_fd = -1;
+    g->transport = TRANSPORT_PENDING;
+    for (int i = 0; i < SPIKE_SHM_NUM_FDS; i++) {
+        g->shm_fds[i] = -1;
+    }
+
+    g->recv_ring = init_recv_ring();
+    g->send_buf = malloc(SEND_BUF_SIZE);
+    if (!g->recv_ring || !g->send_buf) {
+        fprintf(stderr, "[guest %d] Failed to set up buffers\n", g->index);
+        return -1;
+    }
+
+    g->slirp = init_slirp(g);
+    if (!g->slirp) {
+        fprintf(stderr, "[guest %d] Failed to initialize SLIRP\n", g->index);
+        return -1;
+    }
+
+    if (pcap_path) {
+        /* One file per guest thread, so writers never share state */
+        char path[512];
+        if (guest_count > 1) {
+            snprintf(path, sizeof(path), "%s.%d", pcap_path, g->index);
+        } else {
+            snprintf(path, sizeof(path), "%s", pcap_path);
+        }
+        g->pcap = pcapng_open(path, "spike-virtio", pcap_snaplen,
+                              pcap_rotate_mb, pcap_rotate_files);
+        if (!g->pcap) {
+            fprintf(stderr, "[guest %d] Failed to open capture %s\n", g->index, path);
+            return -1;
+        }
+        printf("[guest %d] Capturing to %s%s\n", g->index, path,
+               pcap_rotate_mb ? ".N" : "");
+    }
+
+    struct in_addr host_addr = {.s_addr = INADDR_ANY};
+    struct in_addr guest_addr = {.s_addr = inet_addr("10.0.2.15")};
+
+    for (int i = 0; i < forward_count; i++) {
+        const Forward *f = &forwards[i];
+        int host_port = f->host_port + g->index;
+
+        if (slirp_add_hostfwd(g->slirp, f->is_udp, host_addr, host_port,
+                              guest_addr, f->guest_port) < 0) {
+            fprintf(stderr, "[guest %d] Warning: Failed to forward %s port %d\n",
+                    g->index, f->is_udp ? "udp" : "tcp", host_port);
+        } else {
+            printf("[guest %d] Port forwarding: %slocalhost:%d -> 10.0.2.15:%d\n",
+                   g->index, f->is_udp ? "udp:" : "", host_port, f->guest_port);
+        }
+    }
+
+    return 0;
+}
+
+static void guest_cleanup(Guest *g) {
+    guest_disconnect(g);
+    if (g->slirp) {
+        slirp_cleanup(g->slirp);
+    }
+    if (g->recv_ring) {
+        munmap(g->recv_ring, 2 * RECV_RING_SIZE);
+    }
+    free(g->send_buf);
+    if (g->pcap) {
+        printf("[guest %d] Captured %lu frames\n", g->index, (unsigned long)g->pcap->frames);
+        pcapng_close(g->pcap);
+        g->pcap = NULL;
+    }
+}
+
+/* Parse --fwd=[tcp:|udp:]HOST:GUEST */
+static int parse_forward(const char *spec) {
+    if (forward_count >= MAX_FORWARDS) {
+        fprintf(stderr, "Too many forwards (max %d)\n", MAX_FORWARDS);
+        return -1;
+    }
+
+    Forward *f = &forwards[forward_count];
+    f->is_udp = 0;
+    if (strncmp(spec, "udp:", 4) == 0) {
+        f->is_udp = 1;
+        spec += 4;
+    } else if (strncmp(spec, "tcp:", 4) == 0) {
+        spec += 4;
+    }
+
+    char *end;
+    long host_port = strtol(spec, &end, 10);
+    if (*end != ':') {
+        fprintf(stderr, "Invalid forward (want HOST:GUEST): %s\n", spec);
+        return -1;
+    }
+    long guest_port = strtol(end + 1, &end, 10);
+    if (*end != '\0' || host_port <= 0 || host_port > 65535 ||
+        guest_port <= 0 || guest_port > 65535) {
+        fprintf(stderr, "Invalid forward ports: %s\n", spec);
+        return -1;
+    }
+
+    f->host_port = (int)host_port;
+    f->guest_port = (int)guest_port;
+    forward_count++;
+    return 0;
+}
+
+/* Create a loop's epoll set and wakeup eventfd */
+static int loop_init(EventLoop *loop) {
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    /* Registered directly: SLIRP never sees it, so it has no PollEntry */
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = loop->wake_fd};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+        perror("epoll_ctl wake");
+        return -1;
+    }
+    return 0;
+}
+
+static void loop_cleanup(EventLoop *loop) {
+    close(loop->epoll_fd);
+    close(loop->wake_fd);
+    free(loop->entries);
+
+    /* Free timers SLIRP left armed */
+    while (loop->timer_heap_len > 0) {
+        slirp_timer_free(loop->timer_heap[0], NULL);
+    }
+    free(loop->timer_heap);
+}
+
+/* Pin the calling thread to the Nth CPU the process may run on */
+static void pin_to_cpu(Guest *g) {
+    int count = CPU_COUNT(&allowed_cpus);
+    if (count <= 0) return;
+
+    int want = g->index % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed_cpus) || want-- > 0) continue;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err) {
+            fprintf(stderr, "[guest %d] Cannot pin to CPU %d: %s\n",
+                    g->index, cpu, strerror(err));
+        } else {
+            printf("[guest %d] Pinned to CPU %d\n", g->index, cpu);
+        }
+        return;
+    }
+}
+
+/* Per-guest thread: epoll with persistent registrations */
+static void *guest_thread(void *arg) {
+    Guest *g = arg;
+    EventLoop *loop = g->loop;
+
+    if (pin_threads) {
+        pin_to_cpu(g);
     }
 
-    /* Move remaining data to beginning of buffer */
-    if (offset > 0 && offset < recv_buf_len) {
-        memmove(recv_buf, recv_buf + offset, recv_buf_len - offset);
-        recv_buf_len -= offset;
-    } else if (offset == recv_buf_len) {
-        recv_buf_len = 0;
+    while (running && g->spike_fd >= 0) {
+        /* Let SLIRP refresh its interest set; only changes reach epoll */
+        uint32_t timeout = next_timer_timeout(loop);
+        loop->gen++;
+        loop->reported = 0;
+        slirp_pollfds_fill(g->slirp, &timeout, add_poll_cb, loop);
+        poll_disarm_stale(loop);
+        update_spike_events(g);
+
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        int nready = epoll_wait(loop->epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+        if (nready < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        /* Handle Spike input, record revents for SLIRP sockets */
+        for (int i = 0; i < nready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == loop->wake_fd || fd >= loop->entries_size) continue;
+
+            PollEntry *e = &loop->entries[fd];
+            if (e->guest) {
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    handle_spike_input(e->guest);
+                }
+            } else {
+                e->revents = events[i].events;
+            }
+        }
+
+        /* Let SLIRP process its events */
+        slirp_pollfds_poll(g->slirp, nready <= 0, get_revents_cb, loop);
+
+        for (int i = 0; i < nready; i++) {
+            int fd = events[i].data.fd;
+            if (fd < loop->entries_size) {
+                loop->entries[fd].revents = 0;
+            }
+        }
+
+        /* Process timers */
+        process_timers(loop);
+
+        /* Frames whose doorbell was skipped or lost are picked up here;
+         * with the ring empty this is just two loads and a store */
+        if (g->transport == TRANSPORT_SHM && g->spike_fd >= 0) {
+            shm_receive(g);
+        }
+
+        /* Send everything queued during this pass in one go */
+        if (g->spike_fd >= 0) {
+            flush_send_buf(g);
+        }
+
+        pcapng_tick(g->pcap);
     }
+
+    return NULL;
 }
 
-/* Signal handler */
+/* Signal handler: stop every loop, waking threads blocked in epoll_wait */
 static void signal_handler(int sig) {
     (void)sig;
     running = 0;
+
+    uint64_t one = 1;
+    for (int i = 0; i < loops_ready; i++) {
+        ssize_t r = write(loops[i].wake_fd, &one, sizeof(one));
+        (void)r;
+    }
 }
 
 /* Print usage */
@@ -328,21 +1164,66 @@ static void usage(const char *prog) {
     printf("Usage: %s [options]\n", prog);
     printf("Options:\n");
     printf("  --socket=PATH   Spike VirtIO socket path (default: %s)\n", DEFAULT_SOCKET_PATH);
-    printf("  --port=PORT     Host port to forward to guest:80 (default: %d)\n", DEFAULT_HOST_PORT);
+    printf("                  Repeat to attach several Spike instances;\n");
+    printf("                  each runs on its own thread\n");
+    printf("  --fwd=[udp:]HOST:GUEST\n");
+    printf("                  Forward host port to guest port (repeatable).\n");
+    printf("                  Guest N (0-based) listens on HOST+N\n");
+    printf("  --port=PORT     Same as --fwd=PORT:%d (default: %d)\n",
+           DEFAULT_GUEST_PORT, DEFAULT_HOST_PORT);
+    printf("  --no-pin        Do not pin guest threads to CPUs\n");
+    printf("  --no-shm        Decline Spike's shared-memory transport\n");
+    printf("  --pcap=FILE     Record all frames to a pcapng file (FILE.N per guest\n");
+    printf("                  when several are attached)\n");
+    printf("  --pcap-snaplen=N\n");
+    printf("                  Truncate captured frames to N bytes (default: %d)\n",
+           PCAPNG_DEFAULT_SNAPLEN);
+    printf("  --pcap-rotate=MB[,FILES]\n");
+    printf("                  Cycle through FILES capture files (default: %d) of\n",
+           pcap_rotate_files);
+    printf("                  at most MB megabytes each, named FILE.0, FILE.1, ...\n");
     printf("  --help          Show this help\n");
 }
 
 int main(int argc, char *argv[]) {
-    const char *socket_path = DEFAULT_SOCKET_PATH;
-    int host_port = DEFAULT_HOST_PORT;
-    int guest_port = DEFAULT_GUEST_PORT;
-
     /* Parse arguments */
     for (int i = 1; i < argc; i++) {
         if (strncmp(argv[i], "--socket=", 9) == 0) {
-            socket_path = argv[i] + 9;
+            if (guest_count >= MAX_GUESTS) {
+                fprintf(stderr, "Too many sockets (max %d)\n", MAX_GUESTS);
+                return 1;
+            }
+            guests[guest_count].index = guest_count;
+            guests[guest_count].socket_path = argv[i] + 9;
+            guest_count++;
+        } else if (strncmp(argv[i], "--fwd=", 6) == 0) {
+            if (parse_forward(argv[i] + 6) < 0) {
+                return 1;
+            }
         } else if (strncmp(argv[i], "--port=", 7) == 0) {
-            host_port = atoi(argv[i] + 7);
+            char spec[32];
+            snprintf(spec, sizeof(spec), "%d:%d", atoi(argv[i] + 7), DEFAULT_GUEST_PORT);
+            if (parse_forward(spec) < 0) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--no-pin") == 0) {
+            pin_threads = 0;
+        } else if (strcmp(argv[i], "--no-shm") == 0) {
+            allow_shm = 0;
+        } else if (strncmp(argv[i], "--pcap=", 7) == 0) {
+            pcap_path = argv[i] + 7;
+        } else if (strncmp(argv[i], "--pcap-snaplen=", 15) == 0) {
+            pcap_snaplen = strtoul(argv[i] + 15, NULL, 10);
+        } else if (strncmp(argv[i], "--pcap-rotate=", 14) == 0) {
+            char *end;
+            pcap_rotate_mb = strtoull(argv[i] + 14, &end, 10);
+            if (*end == ',') {
+                pcap_rotate_files = atoi(end + 1);
+            }
+            if (pcap_rotate_mb == 0 || pcap_rotate_files <= 0) {
+                fprintf(stderr, "Invalid --pcap-rotate: %s\n", argv[i] + 14);
+                return 1;
+            }
         } else if (strcmp(argv[i], "--help") == 0) {
             usage(argv[0]);
             return 0;
@@ -353,11 +1234,28 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (guest_count == 0) {
+        guests[0].index = 0;
+        guests[0].socket_path = DEFAULT_SOCKET_PATH;
+        guest_count = 1;
+    }
+    if (forward_count == 0) {
+        forwards[0].host_port = DEFAULT_HOST_PORT;
+        forwards[0].guest_port = DEFAULT_GUEST_PORT;
+        forward_count = 1;
+    }
+
     printf("=====================================\n");
     printf("  SLIRP Bridge for Spike VirtIO\n");
     printf("=====================================\n");
-    printf("Socket: %s\n", socket_path);
-    printf("Port forwarding: localhost:%d -> guest:10.0.2.15:%d\n", host_port, guest_port);
+    for (int i = 0; i < guest_count; i++) {
+        printf("Socket %d: %s\n", i, guests[i].socket_path);
+    }
+    for (int i = 0; i < forward_count; i++) {
+        printf("Port forwarding: %s localhost:%d%s -> guest:10.0.2.15:%d\n",
+               forwards[i].is_udp ? "udp" : "tcp", forwards[i].host_port,
+               guest_count > 1 ? "+N" : "", forwards[i].guest_port);
+    }
     printf("\n");
 
     /* Set up signal handlers */
@@ -365,93 +1263,82 @@ int main(int argc, char *argv[]) {
     signal(SIGTERM, signal_handler);
     signal(SIGPIPE, SIG_IGN);
 
-    /* Initialize SLIRP */
-    slirp = init_slirp();
-    if (!slirp) {
-        fprintf(stderr, "Failed to initialize SLIRP\n");
-        return 1;
+    if (pin_threads && sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus) < 0) {
+        perror("sched_getaffinity");
+        pin_threads = 0;
     }
-    printf("SLIRP initialized (network: 10.0.2.0/24, gateway: 10.0.2.2)\n");
 
-    /* Add port forwarding: host:8080 -> guest:80 */
-    struct in_addr host_addr = {.s_addr = INADDR_ANY};
-    struct in_addr guest_addr = {.s_addr = inet_addr("10.0.2.15")};
-
-    if (slirp_add_hostfwd(slirp, 0, host_addr, host_port,
-                          guest_addr, guest_port) < 0) {
-        fprintf(stderr, "Warning: Failed to add port forwarding\n");
-    } else {
-        printf("Port forwarding: localhost:%d -> 10.0.2.15:%d\n", host_port, guest_port);
+    /* Initialize one event loop and SLIRP network per guest */
+    for (int i = 0; i < guest_count; i++) {
+        if (loop_init(&loops[i]) < 0) {
+            return 1;
+        }
+        loops_ready++;
+        if (guest_init(&guests[i], &loops[i]) < 0) {
+            return 1;
+        }
     }
+    printf("SLIRP initialized (network: 10.0.2.0/24, gateway: 10.0.2.2)\n");
 
     printf("\n");
     printf("Waiting for Spike to start...\n");
-    printf("Run: spike --virtio-fifo=%s firmware.elf\n", socket_path);
+    printf("Run: spike --virtio-fifo=%s firmware.elf\n", guests[0].socket_path);
     printf("\n");
 
     /* Connect to Spike */
-    spike_fd = connect_to_spike(socket_path);
-    if (spike_fd < 0) {
-        fprintf(stderr, "Failed to connect to Spike\n");
-        slirp_cleanup(slirp);
-        return 1;
+    for (int i = 0; i < guest_count; i++) {
+        Guest *g = &guests[i];
+        g->spike_fd = connect_to_spike(g->socket_path);
+        if (g->spike_fd < 0) {
+            fprintf(stderr, "Failed to connect to Spike at %s\n", g->socket_path);
+            for (int j = 0; j < guest_count; j++) {
+                guest_cleanup(&guests[j]);
+            }
+            return 1;
+        }
+        poll_entry(g->loop, g->spike_fd)->guest = g;
     }
 
     printf("\n");
     printf("Bridge running!\n");
-    printf("Access web server at: http://localhost:%d\n", host_port);
+    for (int i = 0; i < guest_count; i++) {
+        for (int j = 0; j < forward_count; j++) {
+            const Forward *f = &forwards[j];
+            printf("Guest %d: %s localhost:%d -> 10.0.2.15:%d\n", i,
+                   f->is_udp ? "udp" : "tcp", f->host_port + i, f->guest_port);
+        }
+    }
     printf("Press Ctrl+C to stop\n");
     printf("\n");
 
-    /* Main loop with proper SLIRP polling */
-    while (running) {
-        /* Reset poll fd events */
-        poll_fd_count = 0;
-
-        /* Add spike fd */
-        poll_fds[poll_fd_count].fd = spike_fd;
-        poll_fds[poll_fd_count].events = POLLIN;
-        poll_fds[poll_fd_count].revents = 0;
-        int spike_idx = poll_fd_count++;
-
-        /* Let SLIRP add its FDs */
-        uint32_t timeout = 10;
-        slirp_pollfds_fill(slirp, &timeout, add_poll_cb, NULL);
-
-        /* Poll all FDs */
-        int ret = poll(poll_fds, poll_fd_count, timeout);
-        if (ret < 0) {
-            if (errno == EINTR)
-                continue;
-            perror("poll");
+    /* Guest threads block the stop signals so they land on this thread */
+    sigset_t stop_signals, old_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+
+    int started = 0;
+    for (int i = 0; i < guest_count; i++) {
+        int err = pthread_create(&guests[i].thread, NULL, guest_thread, &guests[i]);
+        if (err) {
+            fprintf(stderr, "[guest %d] pthread_create: %s\n", i, strerror(err));
+            running = 0;
             break;
         }
-
-        /* Handle Spike input */
-        if (poll_fds[spike_idx].revents & POLLIN) {
-            handle_spike_input();
-        }
-
-        /* Let SLIRP process its events */
-        slirp_pollfds_poll(slirp, ret <= 0, get_revents_cb, NULL);
-
-        /* Process timers */
-        process_timers();
+        started++;
     }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
 
-    printf("\nShutting down...\n");
-
-    if (spike_fd >= 0) {
-        close(spike_fd);
+    for (int i = 0; i < started; i++) {
+        pthread_join(guests[i].thread, NULL);
     }
 
-    slirp_cleanup(slirp);
+    printf("\nShutting down...\n");
 
-    /* Free all timers */
-    while (timer_list) {
-        SlirpTimer *t = timer_list;
-        timer_list = t->next;
-        free(t);
+    for (int i = 0; i < guest_count; i++) {
+        guest_cleanup(&guests[i]);
+        loop_cleanup(&loops[i]);
     }
 
     printf("Done.\n");
@@ -0,0 +1,184 @@
+/*
+ * spike_shm.h - Shared-memory frame transport between Spike and a bridge
+ *
+ * The VirtIO FIFO socket carries Ethernet frames as a byte stream with a
+ * 2-byte big-endian length prefix. This header defines an optional
+ * shared-memory path for the same frames, so that neither side needs a
+ * syscall per frame in the steady state. It is shared by the bridge and
+ * the Spike VirtIO FIFO device; both must agree on SPIKE_SHM_VERSION.
+ *
+ * Handshake (on the existing Unix socket, Spike speaks first):
+ *
+ *   1. Right after accepting the bridge, Spike sends a spike_shm_hello
+ *      with SCM_RIGHTS carrying three fds: the memfd holding the rings,
+ *      an eventfd Spike writes to wake the bridge, and an eventfd the
+ *      bridge writes to wake Spike. The hello starts with a zero length
+ *      prefix, which is never a valid frame, so an older bridge simply
+ *      resynchronizes past it.
+ *   2. The bridge answers with a spike_shm_reply on the socket. Status
+ *      SPIKE_SHM_ACCEPT switches both directions to the rings; anything
+ *      else (or no reply) keeps the socket stream. Frames the bridge sent
+ *      before the reply are ordinary stream frames.
+ *   3. The socket stays open after switching; EOF on it still means the
+ *      peer is gone.
+ *
+ * Shared memory layout (memfd, SPIKE_SHM_SIZE(ring_size) bytes):
+ *
+ *   [0, 4096)                          spike_shm_header
+ *   [4096, 4096 + ring_size)           to_host data  (Spike -> bridge)
+ *   [4096 + ring_size, + ring_size)    to_spike data (bridge -> Spike)
+ *
+ * Each ring is single-producer/single-consumer. head and tail are
+ * free-running byte counters; ring_size is a power of two. A record is
+ * a length-prefixed frame exactly as on the socket and never wraps: if
+ * it does not fit before the end of the data area, the producer writes
+ * SPIKE_SHM_PAD as the length (when at least 2 bytes remain) and starts
+ * over at offset 0. A consumer that finds fewer than 2 bytes before the
+ * end also skips to offset 0.
+ *
+ * Doorbells: a consumer sets need_wakeup before it goes to sleep and
+ * re-checks the ring afterwards. A producer writes the peer's eventfd
+ * only when it sees need_wakeup set after publishing head, so a busy
+ * consumer is never signalled.
+ */
+
+#ifndef SPIKE_SHM_H
+#define SPIKE_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define SPIKE_SHM_MAGIC "SHMR"
+#define SPIKE_SHM_VERSION 1
+#define SPIKE_SHM_DATA_OFFSET 4096
+#define SPIKE_SHM_SIZE(ring_size) (SPIKE_SHM_DATA_OFFSET + 2 * (size_t)(ring_size))
+#define SPIKE_SHM_PAD 0xFFFF
+#define SPIKE_SHM_ACCEPT 0
+
+/* Handshake fds, in SCM_RIGHTS order */
+enum { SPIKE_SHM_FD_MEM, SPIKE_SHM_FD_HOST_DOORBELL, SPIKE_SHM_FD_SPIKE_DOORBELL,
+       SPIKE_SHM_NUM_FDS };
+
+struct spike_shm_hello {
+    uint8_t zero[2];        /* Zero length prefix marks a control message */
+    char magic[4];          /* SPIKE_SHM_MAGIC */
+    uint8_t reserved[2];    /* Zero; keeps the fields below aligned */
+    uint32_t version;       /* Host byte order; both ends share a host */
+    uint32_t ring_size;
+};
+
+struct spike_shm_reply {
+    uint8_t zero[2];
+    char magic[4];
+    uint8_t reserved[2];
+    uint32_t status;        /* SPIKE_SHM_ACCEPT or an errno value */
+};
+
+/* Producer and consumer indices live on separate cache lines */
+struct spike_shm_ring {
+    uint32_t head;          /* Written by the producer */
+    uint8_t pad0[60];
+    uint32_t tail;          /* Written by the consumer */
+    uint8_t pad1[60];
+    uint32_t need_wakeup;   /* Set by an idle consumer */
+    uint8_t pad2[60];
+};
+
+struct spike_shm_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t ring_size;
+    uint8_t pad[52];
+    struct spike_shm_ring to_host;
+    struct spike_shm_ring to_spike;
+};
+
+/* One direction as seen by this process */
+struct spike_shm_queue {
+    struct spike_shm_ring *ring;
+    uint8_t *data;
+    uint32_t size;
+};
+
+/* Copy one frame into the ring. Returns 0, or -1 if there is no room
+ * (the caller drops the frame; nothing is published). */
+static inline int spike_shm_put(struct spike_shm_queue *q, const void *frame, uint16_t len) {
+    uint32_t head = q->ring->head;
+    uint32_t tail = __atomic_load_n(&q->ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t off = head & (q->size - 1);
+    uint32_t need = 2 + (uint32_t)len;
+    uint32_t skip = 0;
+
+    if (len >= SPIKE_SHM_PAD || need > q->size) return -1;
+    if (q->size - off < need) skip = q->size - off;
+    if (head + skip + need - tail > q->size) return -1;
+
+    if (skip) {
+        if (skip >= 2) {
+            q->data[off] = SPIKE_SHM_PAD >> 8;
+            q->data[off + 1] = SPIKE_SHM_PAD & 0xFF;
+        }
+        head += skip;
+        off = 0;
+    }
+
+    q->data[off] = len >> 8;
+    q->data[off + 1] = len & 0xFF;
+    memcpy(q->data + off + 2, frame, len);
+    __atomic_store_n(&q->ring->head, head + need, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Return the next frame in place (valid until spike_shm_pop), or NULL
+ * if the ring is empty. *len is set to the frame length. A record that
+ * overruns the data area discards everything queued. */
+static inline const uint8_t *spike_shm_peek(struct spike_shm_queue *q, uint16_t *len) {
+    for (;;) {
+        uint32_t tail = q->ring->tail;
+        uint32_t head = __atomic_load_n(&q->ring->head, __ATOMIC_ACQUIRE);
+        if (head == tail) return NULL;
+
+        uint32_t off = tail & (q->size - 1);
+        uint16_t n = 0;
+        if (q->size - off >= 2) {
+            n = (q->data[off] << 8) | q->data[off + 1];
+        }
+        if (q->size - off < 2 || n == SPIKE_SHM_PAD) {
+            /* Skip the unused end of the data area */
+            __atomic_store_n(&q->ring->tail, tail + (q->size - off), __ATOMIC_RELEASE);
+            continue;
+        }
+        if (2 + (uint32_t)n > q->size - off) {
+            /* Record overruns the data area: the ring is corrupt, drop it */
+            __atomic_store_n(&q->ring->tail, head, __ATOMIC_RELEASE);
+            return NULL;
+        }
+
+        *len = n;
+        return q->data + off + 2;
+    }
+}
+
+static inline void spike_shm_pop(struct spike_shm_queue *q, uint16_t len) {
+    __atomic_store_n(&q->ring->tail, q->ring->tail + 2 + (uint32_t)len, __ATOMIC_RELEASE);
+}
+
+/* Consumer about to sleep: returns 1 if it may, 0 if data raced in */
+static inline int spike_shm_prepare_sleep(struct spike_shm_queue *q) {
+    __atomic_store_n(&q->ring->need_wakeup, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->ring->head, __ATOMIC_SEQ_CST) != q->ring->tail) {
+        __atomic_store_n(&q->ring->need_wakeup, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+/* Producer after publishing: returns 1 if the consumer must be woken */
+static inline int spike_shm_needs_kick(struct spike_shm_queue *q) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&q->ring->need_wakeup, __ATOMIC_RELAXED)) return 0;
+    __atomic_store_n(&q->ring->need_wakeup, 0, __ATOMIC_RELAXED);
+    return 1;
+}
+
+#endif /* SPIKE_SHM_H */
@@ -0,0 +1,153 @@
+#!/bin/bash
+#
+# End-to-end HTTP benchmark for the RISC-V bare-metal web server
+#
+# Builds an ext4 image with files of representative sizes, boots Spike on
+# it once per (file, concurrency) pair and drives the firmware with
+# debug_bridge's load generator, which talks to the guest directly over
+# the VirtIO FIFO socket. Results go to bench-results/ as JSON.
+#
+# Environment:
+#   SPIKE              spike binary (default: as in run.sh)
+#   BENCH_CONCURRENCY  concurrent connections to try (default: "1 4")
+#   BENCH_SCALE        multiplies every request count (default: 1)
+#   BENCH_OUT          output directory (default: bench-results)
+#   BENCH_TIMEOUT      seconds allowed per run, boot included (default: 600)
+#
+
+set -e
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+PROJECT_DIR="$(dirname "$SCRIPT_DIR")"
+SOCKET_PATH="/tmp/spike_bench.sock"
+CONCURRENCY="${BENCH_CONCURRENCY:-1 4}"
+SCALE="${BENCH_SCALE:-1}"
+OUT_DIR="${BENCH_OUT:-$PROJECT_DIR/bench-results}"
+RUN_TIMEOUT="${BENCH_TIMEOUT:-600}"
+WORK_DIR="$(mktemp -d)"
+
+# File name, size in bytes, requests per run
+FILES="
+small.html  1024     200
+medium.bin  65536    50
+large.bin   4194304  5
+"
+
+# Find spike
+SPIKE="${SPIKE:-$(which spike 2>/dev/null)}"
+if [ -z "$SPIKE" ]; then
+    for path in \
+        "$PROJECT_DIR/riscv-isa-sim/build/spike" \
+        "/usr/local/bin/spike" \
+        "/opt/riscv/bin/spike"; do
+        if [ -x "$path" ]; then
+            SPIKE="$path"
+            break
+        fi
+    done
+fi
+
+if [ -z "$SPIKE" ] || [ ! -x "$SPIKE" ]; then
+    echo "ERROR: spike not found! Set SPIKE or run 'make spike'."
+    exit 1
+fi
+
+FIRMWARE="$PROJECT_DIR/firmware/firmware.elf"
+BRIDGE="$PROJECT_DIR/host/debug_bridge"
+for f in "$FIRMWARE" "$BRIDGE"; do
+    if [ ! -e "$f" ]; then
+        echo "ERROR: $f not found! Run 'make firmware host' first."
+        exit 1
+    fi
+done
+
+if ! command -v mkfs.ext4 >/dev/null; then
+    echo "ERROR: mkfs.ext4 not found (install e2fsprogs)"
+    exit 1
+fi
+
+SPIKE_PID=""
+cleanup() {
+    [ -n "$SPIKE_PID" ] && kill $SPIKE_PID 2>/dev/null
+    rm -f "$SOCKET_PATH"
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+echo "=========================================="
+echo "  RISC-V Web Server Benchmark"
+echo "=========================================="
+echo ""
+echo "Spike: $SPIKE"
+echo "Concurrency: $CONCURRENCY"
+echo ""
+
+# Disk image. Contents are generated, not random, so images (and thus
+# block access patterns) are identical from run to run.
+echo "Creating disk image..."
+mkdir -p "$WORK_DIR/root"
+echo "$FILES" | while read -r name size requests; do
+    [ -z "$name" ] && continue
+    seq 1 "$size" | head -c "$size" > "$WORK_DIR/root/$name"
+done
+dd if=/dev/zero of="$WORK_DIR/disk.img" bs=1M count=32 status=none
+mkfs.ext4 -q -F -d "$WORK_DIR/root" "$WORK_DIR/disk.img"
+
+mkdir -p "$OUT_DIR"
+RESULT="$OUT_DIR/bench-$(date +%Y%m%d-%H%M%S).json"
+COMMIT="$(git -C "$PROJECT_DIR" rev-parse --short HEAD 2>/dev/null || echo unknown)"
+RUNS=""
+
+while read -r name size requests; do
+    [ -z "$name" ] && continue
+    requests=$((requests * SCALE))
+
+    for conc in $CONCURRENCY; do
+        echo ""
+        echo "--- /$name ($size bytes), $conc concurrent, $requests requests ---"
+
+        rm -f "$SOCKET_PATH"
+        "$SPIKE" --virtio-fifo="$SOCKET_PATH" --virtio-block="$WORK_DIR/disk.img" \
+            "$FIRMWARE" > "$WORK_DIR/spike.log" 2>&1 &
+        SPIKE_PID=$!
+
+        RUN_JSON="$WORK_DIR/run.json"
+        rm -f "$RUN_JSON"
+        if ! timeout "$RUN_TIMEOUT" "$BRIDGE" --socket="$SOCKET_PATH" --load="$conc" \
+                --requests="$requests" --path="/$name" --instret --json="$RUN_JSON" \
+                > "$WORK_DIR/bridge.log" 2>&1; then
+            echo "ERROR: load generator failed:"
+            tail -20 "$WORK_DIR/bridge.log"
+            exit 1
+        fi
+        kill $SPIKE_PID 2>/dev/null || true
+        wait $SPIKE_PID 2>/dev/null || true
+        SPIKE_PID=""
+
+        sed -n '/^Load: .* completed/,/^$/p' "$WORK_DIR/bridge.log"
+        if [ ! -f "$RUN_JSON" ]; then
+            echo "ERROR: no results written"
+            exit 1
+        fi
+
+        RUN="{\"file\": \"$name\", \"size\": $size, \"result\": $(cat "$RUN_JSON")}"
+        RUNS="${RUNS:+$RUNS,
+}$RUN"
+    done
+done <<< "$FILES"
+
+cat > "$RESULT" << EOF
+{
+"commit": "$COMMIT",
+"date": "$(date -u +%Y-%m-%dT%H:%M:%SZ)",
+"spike": "$SPIKE",
+"runs": [
+$RUNS
+]
+}
+EOF
+
+echo ""
+echo "=========================================="
+echo "  Results: $RESULT"
+echo "=========================================="
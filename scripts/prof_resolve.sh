@@ -0,0 +1,93 @@
+#!/bin/bash
+#
+# Turn the firmware's PC samples into a flat profile
+#
+# Reads the output of /__prof/pcs (from a PROFILE=1 PROFILE_HZ=N build)
+# and attributes each sampled address to the function containing it,
+# using the symbol labels in firmware/firmware.dump.
+#
+# Usage:
+#   prof_resolve.sh [SOURCE] [DUMP]
+#
+#   SOURCE  URL or file with the samples (default: http://localhost:8080/__prof/pcs)
+#   DUMP    objdump -d output of the same build (default: firmware/firmware.dump)
+#
+
+set -e
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+PROJECT_DIR="$(dirname "$SCRIPT_DIR")"
+SOURCE="${1:-http://localhost:8080/__prof/pcs}"
+DUMP="${2:-$PROJECT_DIR/firmware/firmware.dump}"
+
+if [ ! -f "$DUMP" ]; then
+    echo "ERROR: $DUMP not found! Build the firmware with 'make PROFILE=1 PROFILE_HZ=N'."
+    exit 1
+fi
+
+case "$SOURCE" in
+    http://*|https://*) SAMPLES="$(curl -sf "$SOURCE")" ;;
+    *)                  SAMPLES="$(cat "$SOURCE")" ;;
+esac
+
+if [ -z "$SAMPLES" ]; then
+    echo "ERROR: no samples read from $SOURCE"
+    exit 1
+fi
+
+# The dump goes first: "0000000080000000 <_start>:" lines give every
+# function's start address. The samples are "hex-pc count" lines after a
+# "hz N samples N dropped N" header.
+echo "$SAMPLES" | awk '
+function hex(s,    i, n, c) {
+    n = 0
+    s = tolower(s)
+    sub(/^0x/, "", s)
+    for (i = 1; i <= length(s); i++) {
+        c = index("0123456789abcdef", substr(s, i, 1))
+        if (c == 0) break
+        n = n * 16 + c - 1
+    }
+    return n
+}
+
+FNR == NR {
+    if ($0 ~ /^[0-9a-f]+ <.*>:$/) {
+        name = $2
+        gsub(/[<>:]/, "", name)
+        nsym++
+        addr[nsym] = hex($1)
+        sym[nsym] = name
+    }
+    next
+}
+
+/^hz / {
+    hz = $2; total = $4; dropped = $6
+    next
+}
+
+NF == 2 {
+    pc = hex($1)
+    # Binary search for the last symbol at or below pc
+    lo = 1; hi = nsym; found = 0
+    while (lo <= hi) {
+        mid = int((lo + hi) / 2)
+        if (addr[mid] <= pc) { found = mid; lo = mid + 1 } else { hi = mid - 1 }
+    }
+    fn = found ? sym[found] : "?"
+    count[fn] += $2
+    seen += $2
+}
+
+END {
+    if (total == 0) total = seen
+    printf "%d samples at %d Hz (%d dropped, %d not listed)\n\n", \
+        total, hz, dropped, total - seen - dropped
+    printf "%8s %7s  %s\n", "samples", "%", "function"
+    for (fn in count) {
+        printf "%8d %6.2f%%  %s\n", count[fn], total ? 100 * count[fn] / total : 0, fn | "sort -rn"
+    }
+    close("sort -rn")
+}
+' "$DUMP" -